@@ -0,0 +1,367 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <iterator>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+
+#ifdef _OPENMP
+#	include <omp.h>
+#endif
+
+#include <fluid/simulation.h>
+
+/// \file
+/// Headless benchmark that runs the scenes of the testbed for a fixed number of frames and reports timings as
+/// JSON.
+
+using fluid::vec3d;
+using fluid::vec3s;
+
+/// The scenes of the testbed. The scenes are designed for a 50x50x50 grid, and are scaled for other sizes.
+enum class scene_type {
+	dam_break, ///< A box of water in the middle of the grid.
+	sphere_drop, ///< A large sphere of water.
+	sphere_into_pool, ///< A small sphere of water falling into a pool.
+	wall_of_water, ///< A wall of water at one side of the grid.
+	source_obstacle ///< A fluid source shooting at a spherical obstacle.
+};
+/// The names of all scenes, in the order of \ref scene_type.
+const char *const scene_names[]{ "dam_break", "sphere_drop", "sphere_into_pool", "wall_of_water", "source_obstacle" };
+constexpr std::size_t num_scenes = std::size(scene_names); ///< The number of scenes.
+
+/// Sets up the given scene in a grid of the given size.
+template <typename Sim> void setup_scene(Sim &sim, scene_type scene, std::size_t size) {
+	using vec3_type = typename Sim::vec3_type;
+	using scalar_type = typename Sim::scalar_type;
+
+	sim.resize(vec3s(size, size, size));
+	sim.grid_offset = vec3_type();
+	sim.cell_size = 1;
+	sim.simulation_method = Sim::method::apic;
+	sim.blending_factor = 1;
+	sim.gravity = vec3_type(vec3d(0.0, -981.0, 0.0));
+	sim.statistics_history_length = std::numeric_limits<std::size_t>::max();
+
+	double scale = static_cast<double>(size) / 50.0;
+	auto scaled = [scale](double x, double y, double z) {
+		return vec3_type(vec3d(x, y, z) * scale);
+	};
+	auto scaled_cell = [scale](double v) {
+		return static_cast<std::size_t>(v * scale);
+	};
+	switch (scene) {
+	case scene_type::dam_break:
+		sim.seed_box(scaled(15.0, 15.0, 15.0), scaled(20.0, 20.0, 20.0));
+		break;
+	case scene_type::sphere_drop:
+		sim.seed_sphere(scaled(25.0, 25.0, 25.0), static_cast<scalar_type>(15.0 * scale));
+		break;
+	case scene_type::sphere_into_pool:
+		sim.seed_sphere(scaled(25.0, 44.0, 25.0), static_cast<scalar_type>(5.0 * scale));
+		sim.seed_box(vec3_type(), scaled(50.0, 15.0, 50.0));
+		break;
+	case scene_type::wall_of_water:
+		sim.seed_box(vec3_type(), scaled(10.0, 50.0, 50.0));
+		break;
+	case scene_type::source_obstacle:
+		{
+			// fluid source
+			auto source = std::make_unique<fluid::source>();
+			for (std::size_t x = scaled_cell(1.0); x < scaled_cell(5.0); ++x) {
+				for (std::size_t y = scaled_cell(25.0); y < scaled_cell(35.0); ++y) {
+					for (std::size_t z = scaled_cell(20.0); z < scaled_cell(30.0); ++z) {
+						source->cells.emplace_back(x, y, z);
+					}
+				}
+			}
+			source->velocity = vec3d(200.0, 0.0, 0.0);
+			source->coerce_velocity = true;
+			sim.sources.emplace_back(std::move(source));
+
+			// spherical obstacle
+			vec3d center = vec3d(25.0, 25.0, 25.0) * scale;
+			double radius = 10.0 * scale;
+			sim.grid().cell_types().for_each_in_range_unchecked(
+				[&](vec3s cell, fluid::grid_cell_type &type) {
+					vec3d diff = vec3d(cell) + vec3d(0.5, 0.5, 0.5) - center;
+					if (diff.squared_length() < radius * radius) {
+						type = fluid::grid_cell_type::solid;
+					}
+				},
+				vec3s(scaled_cell(15.0), scaled_cell(15.0), scaled_cell(15.0)),
+				vec3s(scaled_cell(35.0), scaled_cell(35.0), scaled_cell(35.0))
+					);
+		}
+		break;
+	}
+	sim.reset_space_hash();
+}
+
+/// Runs the given scene and writes its results as a JSON object.
+template <typename Sim> void run_scene(
+	std::ostream &out, scene_type scene, std::size_t size, std::size_t frames, double frame_time
+) {
+	using stage = fluid::time_step_statistics::stage;
+
+	Sim sim;
+	setup_scene(sim, scene, size);
+
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < frames; ++i) {
+		sim.update(frame_time);
+	}
+	double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double stage_seconds[fluid::time_step_statistics::num_stages]{}, particle_steps = 0.0;
+	std::size_t total_iterations = 0, max_iterations = 0, peak_bytes = 0;
+	const std::deque<fluid::time_step_statistics> &history = sim.get_statistics_history();
+	for (const fluid::time_step_statistics &stats : history) {
+		for (std::size_t i = 0; i < fluid::time_step_statistics::num_stages; ++i) {
+			stage_seconds[i] += stats.stage_seconds[i];
+		}
+		particle_steps += static_cast<double>(stats.num_particles);
+		total_iterations += stats.pressure_iterations;
+		max_iterations = std::max(max_iterations, stats.pressure_iterations);
+		peak_bytes = std::max(peak_bytes, stats.allocated_bytes);
+	}
+	std::size_t num_steps = history.size();
+
+	out <<
+		"    {\n" <<
+		"      \"scene\": \"" << scene_names[static_cast<std::size_t>(scene)] << "\",\n" <<
+		"      \"grid_size\": " << size << ",\n" <<
+		"      \"precision\": \"" <<
+		(std::is_same_v<typename Sim::scalar_type, float> ? "float" : "double") << "\",\n" <<
+		"      \"frames\": " << frames << ",\n" <<
+		"      \"time_steps\": " << num_steps << ",\n" <<
+		"      \"wall_seconds\": " << wall_seconds << ",\n" <<
+		"      \"final_particles\": " << sim.particles().size() << ",\n" <<
+		"      \"particles_per_second\": " << (wall_seconds > 0.0 ? particle_steps / wall_seconds : 0.0) << ",\n" <<
+		"      \"pcg_iterations\": " << total_iterations << ",\n" <<
+		"      \"mean_pcg_iterations\": " <<
+		(num_steps > 0 ? static_cast<double>(total_iterations) / static_cast<double>(num_steps) : 0.0) << ",\n" <<
+		"      \"max_pcg_iterations\": " << max_iterations << ",\n" <<
+		"      \"peak_allocated_bytes\": " << peak_bytes << ",\n" <<
+		"      \"stage_seconds\": {\n";
+	for (std::size_t i = 0; i < fluid::time_step_statistics::num_stages; ++i) {
+		out <<
+			"        \"" << fluid::time_step_statistics::get_stage_name(static_cast<stage>(i)) << "\": " <<
+			stage_seconds[i] << (i + 1 < fluid::time_step_statistics::num_stages ? ",\n" : "\n");
+	}
+	out <<
+		"      }\n" <<
+		"    }";
+}
+
+/// Returns whether the two arrays have the same length and are bitwise identical.
+template <typename T> bool is_bitwise_equal(const T *lhs, std::size_t lhs_count, const T *rhs, std::size_t rhs_count) {
+	return lhs_count == rhs_count && (lhs_count == 0 || std::memcmp(lhs, rhs, lhs_count * sizeof(T)) == 0);
+}
+/// \overload
+template <typename T> bool is_bitwise_equal(const std::vector<T> &lhs, const std::vector<T> &rhs) {
+	return is_bitwise_equal(lhs.data(), lhs.size(), rhs.data(), rhs.size());
+}
+
+/// Runs the given scene, saving a checkpoint halfway through, then resumes a second simulation from that
+/// checkpoint with a different number of threads and checks that both end in bitwise identical states. Writes
+/// the results as a JSON object.
+///
+/// \return Whether the resumed simulation matches.
+template <typename Sim> bool check_resume(
+	std::ostream &out, scene_type scene, std::size_t size, std::size_t frames, double frame_time,
+	const std::string &checkpoint
+) {
+	int threads = 1, resume_threads = 1;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+	resume_threads = threads > 1 ? threads - 1 : 2;
+#endif
+
+	Sim sim;
+	setup_scene(sim, scene, size);
+	std::size_t save_frame = frames / 2;
+	bool saved = true;
+	for (std::size_t i = 0; i < frames; ++i) {
+		if (i == save_frame) {
+			saved = sim.save_checkpoint(checkpoint);
+		}
+		sim.update(frame_time);
+	}
+
+#ifdef _OPENMP
+	omp_set_num_threads(resume_threads);
+#endif
+	Sim resumed;
+	bool loaded = saved && resumed.load_checkpoint(checkpoint);
+	if (loaded) {
+		for (std::size_t i = save_frame; i < frames; ++i) {
+			resumed.update(frame_time);
+		}
+	}
+#ifdef _OPENMP
+	omp_set_num_threads(threads);
+#endif
+
+	bool matches = loaded;
+	if (matches) {
+		const auto &expected = sim.particles(), &actual = resumed.particles();
+		matches =
+			is_bitwise_equal(expected.positions, actual.positions) &&
+			is_bitwise_equal(expected.velocities, actual.velocities) &&
+			is_bitwise_equal(expected.cx, actual.cx) &&
+			is_bitwise_equal(expected.cy, actual.cy) &&
+			is_bitwise_equal(expected.cz, actual.cz);
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			const auto &expected_vel = sim.grid().velocities(dim), &actual_vel = resumed.grid().velocities(dim);
+			matches = matches && is_bitwise_equal(
+				expected_vel.data(), expected_vel.get_storage_size(), actual_vel.data(), actual_vel.get_storage_size()
+			);
+		}
+	}
+
+	out <<
+		"    {\n" <<
+		"      \"scene\": \"" << scene_names[static_cast<std::size_t>(scene)] << "\",\n" <<
+		"      \"grid_size\": " << size << ",\n" <<
+		"      \"precision\": \"" <<
+		(std::is_same_v<typename Sim::scalar_type, float> ? "float" : "double") << "\",\n" <<
+		"      \"frames\": " << frames << ",\n" <<
+		"      \"checkpoint_frame\": " << save_frame << ",\n" <<
+		"      \"resume_threads\": " << resume_threads << ",\n" <<
+		"      \"saved\": " << (saved ? "true" : "false") << ",\n" <<
+		"      \"loaded\": " << (loaded ? "true" : "false") << ",\n" <<
+		"      \"resume_matches\": " << (matches ? "true" : "false") << "\n" <<
+		"    }";
+	return matches;
+}
+
+/// Prints the usage of this program.
+void print_usage(const char *program) {
+	std::cerr <<
+		"Usage: " << program << " [options]\n" <<
+		"  --scene <name>     Scene to run, or \"all\" (default). Scenes:";
+	for (const char *name : scene_names) {
+		std::cerr << " " << name;
+	}
+	std::cerr << "\n" <<
+		"  --size <n>         Grid size along each axis. Can be given multiple times. Default: 64.\n" <<
+		"  --frames <n>       Number of frames to simulate. Default: 10.\n" <<
+		"  --fps <n>          Frames per second. Default: 60.\n" <<
+		"  --precision <p>    Scalar type of the simulation, \"float\" or \"double\" (default).\n" <<
+		"  --output <file>    Write the JSON report to the given file instead of stdout.\n" <<
+		"  --check-resume <file>\n" <<
+		"                     Instead of measuring timings, save a checkpoint to the given file halfway through\n" <<
+		"                     each scene, resume from it with a different number of threads, and check that the\n" <<
+		"                     results are identical. The exit code is 1 if any scene differs.\n";
+}
+
+int main(int argc, char **argv) {
+	std::vector<scene_type> scenes;
+	std::vector<std::size_t> sizes;
+	std::size_t frames = 10;
+	double fps = 60.0;
+	bool single_precision = false;
+	std::string output, checkpoint;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") {
+			print_usage(argv[0]);
+			return 0;
+		}
+		if (i + 1 >= argc) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		std::string value = argv[++i];
+		if (arg == "--scene") {
+			if (value == "all") {
+				continue;
+			}
+			auto it = std::find(std::begin(scene_names), std::end(scene_names), value);
+			if (it == std::end(scene_names)) {
+				std::cerr << "unknown scene: " << value << "\n";
+				return 1;
+			}
+			scenes.emplace_back(static_cast<scene_type>(it - std::begin(scene_names)));
+		} else if (arg == "--size") {
+			sizes.emplace_back(std::stoul(value));
+		} else if (arg == "--frames") {
+			frames = std::stoul(value);
+		} else if (arg == "--fps") {
+			fps = std::stod(value);
+		} else if (arg == "--precision") {
+			if (value != "float" && value != "double") {
+				std::cerr << "unknown precision: " << value << "\n";
+				return 1;
+			}
+			single_precision = value == "float";
+		} else if (arg == "--output") {
+			output = value;
+		} else if (arg == "--check-resume") {
+			checkpoint = value;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (scenes.empty()) {
+		for (std::size_t i = 0; i < num_scenes; ++i) {
+			scenes.emplace_back(static_cast<scene_type>(i));
+		}
+	}
+	if (sizes.empty()) {
+		sizes.emplace_back(64);
+	}
+
+	std::ofstream fout;
+	if (!output.empty()) {
+		fout.open(output);
+		if (!fout) {
+			std::cerr << "cannot open " << output << "\n";
+			return 1;
+		}
+	}
+	std::ostream &out = output.empty() ? std::cout : fout;
+
+	int threads = 1;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+	out <<
+		"{\n" <<
+		"  \"threads\": " << threads << ",\n" <<
+		"  \"results\": [\n";
+	bool first = true, all_match = true;
+	for (std::size_t size : sizes) {
+		for (scene_type scene : scenes) {
+			std::cerr << "running " << scene_names[static_cast<std::size_t>(scene)] << " at " << size << "^3\n";
+			if (!first) {
+				out << ",\n";
+			}
+			first = false;
+			if (!checkpoint.empty()) {
+				all_match = (single_precision ?
+					check_resume<fluid::basic_simulation<float>>(out, scene, size, frames, 1.0 / fps, checkpoint) :
+					check_resume<fluid::simulation>(out, scene, size, frames, 1.0 / fps, checkpoint)
+				) && all_match;
+			} else if (single_precision) {
+				run_scene<fluid::basic_simulation<float>>(out, scene, size, frames, 1.0 / fps);
+			} else {
+				run_scene<fluid::simulation>(out, scene, size, frames, 1.0 / fps);
+			}
+			out.flush();
+		}
+	}
+	out <<
+		"\n" <<
+		"  ]\n" <<
+		"}\n";
+	return all_match ? 0 : 1;
+}
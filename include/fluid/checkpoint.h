@@ -0,0 +1,153 @@
+#pragma once
+
+/// \file
+/// Reading and writing of binary checkpoint files.
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <filesystem>
+#include <type_traits>
+
+namespace fluid {
+	/// The header at the start of every checkpoint file. It is followed by \ref section_count instances of
+	/// \ref checkpoint_section, then by the payloads of all sections. All values are stored in the byte order of
+	/// the machine that wrote the file.
+	struct checkpoint_header {
+		/// The magic number at the start of every checkpoint file.
+		constexpr static char magic_value[8]{ 'F', 'L', 'U', 'I', 'D', 'C', 'K', 'P' };
+		/// The current version of the file format. Files of other versions are rejected.
+		constexpr static std::uint32_t current_version = 1;
+		/// Written as-is so that files written on machines with a different byte order can be detected.
+		constexpr static std::uint32_t byte_order_mark = 0x01020304;
+		/// The alignment of the payload of each section, relative to the start of the file.
+		constexpr static std::size_t payload_alignment = 64;
+
+		char magic[8]; ///< Equal to \ref magic_value.
+		std::uint32_t
+			version, ///< The version of the file format.
+			byte_order, ///< Equal to \ref byte_order_mark.
+			/// The size of the scalar type of the simulation that has been saved, used to reject files saved by a
+			/// simulation of a different precision.
+			scalar_size,
+			section_count; ///< The number of sections.
+		std::uint64_t file_size; ///< The total size of the file, used to detect truncated files.
+	};
+	/// An entry in the section table of a checkpoint file. Each section is a tightly packed array of trivially
+	/// copyable elements.
+	struct checkpoint_section {
+		std::uint32_t
+			id, ///< Identifies the contents of this section. The meaning is defined by the user of the file.
+			element_size; ///< The size of each element in bytes.
+		std::uint64_t
+			offset, ///< The offset of the payload from the start of the file.
+			count; ///< The number of elements.
+	};
+
+	/// Collects arrays and writes them to a checkpoint file. Only pointers to the data are stored, so the data
+	/// must be kept alive and unmodified until \ref write() is called.
+	class checkpoint_writer {
+	public:
+		/// Adds a section containing the given array.
+		template <typename T> void add(std::uint32_t id, const T *data, std::size_t count) {
+			static_assert(std::is_trivially_copyable_v<T>, "sections can only contain trivially copyable types");
+			_sections.emplace_back(_pending_section{ id, sizeof(T), data, count });
+		}
+		/// \overload
+		template <typename T> void add(std::uint32_t id, const std::vector<T> &data) {
+			add(id, data.data(), data.size());
+		}
+		/// Adds a section containing a single value.
+		template <typename T> void add_value(std::uint32_t id, const T &value) {
+			add(id, &value, 1);
+		}
+
+		/// Writes all sections to the given file. The file is first written under a temporary name and then
+		/// renamed, so that an existing checkpoint is not lost if writing fails halfway.
+		///
+		/// \param path The path of the file.
+		/// \param scalar_size See \ref checkpoint_header::scalar_size.
+		/// \return Whether the file has been written successfully.
+		bool write(const std::filesystem::path &path, std::uint32_t scalar_size) const;
+	private:
+		/// A section that has been added but not yet written.
+		struct _pending_section {
+			std::uint32_t
+				id, ///< \ref checkpoint_section::id.
+				element_size; ///< \ref checkpoint_section::element_size.
+			const void *data; ///< The data of this section.
+			std::size_t count; ///< \ref checkpoint_section::count.
+		};
+
+		std::vector<_pending_section> _sections; ///< All sections.
+	};
+
+	/// Maps a checkpoint file into memory and copies sections out of it. On platforms without \p mmap the whole
+	/// file is read into memory instead.
+	class checkpoint_reader {
+	public:
+		/// Opens the given file and validates its header and section table. Use \ref is_valid() to check whether
+		/// this has succeeded.
+		///
+		/// \param path The path of the file.
+		/// \param scalar_size The expected value of \ref checkpoint_header::scalar_size.
+		checkpoint_reader(const std::filesystem::path &path, std::uint32_t scalar_size);
+		/// No copy construction.
+		checkpoint_reader(const checkpoint_reader&) = delete;
+		/// No copy assignment.
+		checkpoint_reader &operator=(const checkpoint_reader&) = delete;
+		/// Unmaps the file.
+		~checkpoint_reader();
+
+		/// Returns whether the file has been opened successfully and is a valid checkpoint file.
+		[[nodiscard]] bool is_valid() const {
+			return _header != nullptr;
+		}
+		/// Returns the section with the given ID, or \p nullptr if there is no such section.
+		[[nodiscard]] const checkpoint_section *find_section(std::uint32_t id) const;
+
+		/// Copies the contents of the given section into the given array, which must have exactly as many elements
+		/// as the section.
+		///
+		/// \return Whether the section exists and has the right element size and count.
+		template <typename T> bool read(std::uint32_t id, T *result, std::size_t count) const {
+			static_assert(std::is_trivially_copyable_v<T>, "sections can only contain trivially copyable types");
+			const checkpoint_section *section = find_section(id);
+			if (section == nullptr || section->element_size != sizeof(T) || section->count != count) {
+				return false;
+			}
+			if (count > 0) {
+				std::memcpy(result, _data + section->offset, count * sizeof(T));
+			}
+			return true;
+		}
+		/// Resizes the given vector to the number of elements in the given section, then copies the section into it.
+		///
+		/// \return Whether the section exists and has the right element size.
+		template <typename T> bool read(std::uint32_t id, std::vector<T> &result) const {
+			const checkpoint_section *section = find_section(id);
+			if (section == nullptr) {
+				return false;
+			}
+			result.resize(static_cast<std::size_t>(section->count));
+			return read(id, result.data(), result.size());
+		}
+		/// Copies a section that contains a single value.
+		///
+		/// \return Whether the section exists and contains exactly one value of the right size.
+		template <typename T> bool read_value(std::uint32_t id, T &result) const {
+			return read(id, &result, 1);
+		}
+	private:
+		const char *_data = nullptr; ///< The contents of the file.
+		std::size_t _size = 0; ///< The size of the file.
+		/// The header of the file, or \p nullptr if the file could not be opened or is invalid.
+		const checkpoint_header *_header = nullptr;
+		const checkpoint_section *_sections = nullptr; ///< The section table.
+		std::vector<char> _buffer; ///< The contents of the file on platforms where it is not mapped.
+		bool _mapped = false; ///< Whether \ref _data points to a memory mapping.
+
+		/// Validates the header and the section table, setting \ref _header and \ref _sections on success.
+		void _validate(std::uint32_t scalar_size);
+	};
+}
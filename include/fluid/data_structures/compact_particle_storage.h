@@ -0,0 +1,80 @@
+#pragma once
+
+/// \file
+/// Quantized, cell-relative storage of fluid particles.
+
+#include <cstdint>
+#include <array>
+#include <vector>
+
+#include "../math/vec.h"
+#include "particle_storage.h"
+
+namespace fluid {
+	/// Stores particles in a compact, lossy encoding, intended for frame caches that are written out or kept for
+	/// playback. Each particle is stored as the linear index of the cell it is in and a 16-bit fixed-point offset
+	/// inside that cell along each axis, its velocity in single precision, and its APIC c vectors in half precision.
+	/// This takes 40 bytes per particle instead of 152 for a \ref particle_storage. Since the encoding is lossy,
+	/// it should not be used for state that a simulation is resumed from; use \ref basic_simulation::save_checkpoint()
+	/// for that.
+	///
+	/// Positions are accurate to 1/131072 of a cell. Old positions are not stored, since they are equal to
+	/// positions at the end of a time step; decoded particles have their old positions set to their positions.
+	/// All arrays always have the same length.
+	class compact_particle_storage {
+	public:
+		using fixed_vec3 = std::array<std::uint16_t, 3>; ///< A vector of 16-bit fixed-point numbers.
+		using half_vec3 = std::array<std::uint16_t, 3>; ///< A vector of half precision floats.
+		/// The number of steps that a cell is divided into along each axis by the offsets.
+		constexpr static std::uint32_t offset_steps = 65536;
+
+		/// Returns the number of particles.
+		[[nodiscard]] std::size_t size() const {
+			return cell_indices.size();
+		}
+		/// Returns whether there are no particles.
+		[[nodiscard]] bool empty() const {
+			return cell_indices.empty();
+		}
+		/// Removes all particles and releases the memory they use.
+		void clear();
+		/// Resizes all arrays. New particles are default-initialized.
+		void resize(std::size_t);
+		/// Returns the number of bytes allocated by this storage.
+		[[nodiscard]] std::size_t get_allocated_bytes() const;
+
+		/// Encodes the given particles, replacing all particles in this storage. Positions are clamped to the
+		/// grid, so that every particle is assigned a valid cell.
+		///
+		/// \param particles The particles to encode.
+		/// \param grid_size The size of the simulation grid, which must have fewer than 2^32 cells.
+		/// \param grid_offset The world position of the origin of the grid.
+		/// \param cell_size The size of a cell.
+		template <typename T> void encode(
+			const basic_particle_storage<T> &particles, vec3s grid_size, vec3<T> grid_offset, T cell_size
+		);
+		/// Decodes all particles in this storage into the given storage, replacing all particles in it. The grid
+		/// parameters must be the same as those used for encoding. \ref basic_particle::raw_cell_index is set
+		/// assuming the linear layout used by \ref basic_mac_grid.
+		template <typename T> void decode(
+			basic_particle_storage<T> &particles, vec3s grid_size, vec3<T> grid_offset, T cell_size
+		) const;
+
+		/// Converts a single precision float to half precision, rounding to the nearest representable value.
+		/// Values that are too large become infinity.
+		[[nodiscard]] static std::uint16_t to_half(float);
+		/// Converts a half precision float to single precision. This conversion is exact.
+		[[nodiscard]] static float from_half(std::uint16_t);
+		/// Converts the given number of half precision floats to single precision. This uses F16C instructions
+		/// when they are available.
+		static void from_half(const std::uint16_t *halves, float *result, std::size_t count);
+
+		std::vector<std::uint32_t> cell_indices; ///< Linear indices of the cells that the particles are in.
+		std::vector<fixed_vec3> offsets; ///< Fixed-point positions of particles inside their cells.
+		std::vector<vec3f> velocities; ///< Velocities of all particles.
+		std::vector<half_vec3>
+			cx, ///< The c vectors used in APIC.
+			cy, ///< The c vectors used in APIC.
+			cz; ///< The c vectors used in APIC.
+	};
+}
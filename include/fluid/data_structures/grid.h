@@ -6,13 +6,21 @@
 #include <vector>
 
 #include "../math/vec.h"
+#include "grid_layout.h"
 
 namespace fluid {
-	/// A N-dimensional grid. The cells are stored in X-Y-Z- etc. order, i.e., cells with consecutive X coordinates
-	/// are stored consecutively in memory.
-	template <std::size_t Dim, typename Cell> class grid {
+	/// A N-dimensional grid. By default the cells are stored in X-Y-Z- etc. order, i.e., cells with consecutive X
+	/// coordinates are stored consecutively in memory; other layouts can be selected using the \p Layout
+	/// parameter. Raw indices always refer to the underlying storage, and should only be obtained using
+	/// \ref index_to_raw().
+	///
+	/// \tparam Layout The memory layout of cells. See \ref linear_layout, \ref bricked_layout, and
+	///                \ref morton_layout.
+	template <std::size_t Dim, typename Cell, typename Layout = linear_layout> class grid {
 	public:
 		using size_type = vec<Dim, std::size_t>; ///< The type used to store the size of this grid and indices.
+		using layout_type = Layout; ///< The memory layout.
+		using mapping_type = typename Layout::template mapping<Dim>; ///< Maps indices to raw indices.
 
 		/// Default constructor.
 		grid() = default;
@@ -20,15 +28,8 @@ namespace fluid {
 		explicit grid(size_type size) : grid(size, Cell{}) {
 		}
 		/// Initializes the cell storage, seting all cells to the given value.
-		grid(size_type size, const Cell &c) : _cells(get_array_size(size), c), _size(size) {
-			std::size_t mul = 1;
-			vec_ops::for_each(
-				[&mul](std::size_t &offset, std::size_t size) {
-					offset = mul;
-					mul *= size;
-				},
-				_layer_offset, get_size()
-					);
+		grid(size_type size, const Cell &c) : _mapping(size), _size(size) {
+			_cells.resize(_mapping.get_storage_size(), c);
 		}
 
 		/// Indexing.
@@ -80,6 +81,20 @@ namespace fluid {
 			return _size;
 		}
 
+		/// Returns the number of elements in the underlying storage. This may be larger than the number of cells if
+		/// the layout requires padding.
+		std::size_t get_storage_size() const {
+			return _cells.size();
+		}
+		/// Returns the underlying storage, which contains \ref get_storage_size() elements.
+		Cell *data() {
+			return _cells.data();
+		}
+		/// \overload
+		const Cell *data() const {
+			return _cells.data();
+		}
+
 		/// Fills the entire grid using the given value.
 		void fill(const Cell &value) {
 			for (Cell &c : _cells) {
@@ -104,13 +119,42 @@ namespace fluid {
 		/// Executes the given callback for each cell in the grid. The order in which the cells are visited is the
 		/// same as the order in which they're stored in memory.
 		template <typename Callback> void for_each(Callback &&cb) {
-			_for_each_impl_wrapper(std::forward<Callback>(cb), size_type(), _size, std::make_index_sequence<Dim>());
+			if constexpr (mapping_type::is_linear) {
+				_for_each_impl_wrapper(
+					std::forward<Callback>(cb), size_type(), _size, std::make_index_sequence<Dim>()
+				);
+			} else {
+				for (std::size_t i = 0; i < _cells.size(); ++i) {
+					size_type index = _mapping.index_from_raw(i);
+					if (_is_inside(index)) { // skip padding
+						cb(index, _cells[i]);
+					}
+				}
+			}
 		}
 		/// Executes the given callback for the given range of the grid. The order in which the cells are visited is
 		/// as close to the order in which they're stored in memory as possible. The range must completely lie inside
 		/// the grid.
 		template <typename Callback> void for_each_in_range_unchecked(Callback &&cb, size_type min, size_type max) {
-			_for_each_impl_wrapper(std::forward<Callback>(cb), min, max, std::make_index_sequence<Dim>());
+			if constexpr (mapping_type::is_linear) {
+				_for_each_impl_wrapper(std::forward<Callback>(cb), min, max, std::make_index_sequence<Dim>());
+			} else {
+				for (std::size_t dim = 0; dim < Dim; ++dim) {
+					if (min[dim] >= max[dim]) {
+						return;
+					}
+				}
+				// visit cells in X-Y-Z order
+				for (size_type cur = min; cur[Dim - 1] < max[Dim - 1]; ) {
+					cb(cur, at(cur));
+					for (std::size_t dim = 0; dim < Dim; ++dim) {
+						if (++cur[dim] < max[dim] || dim + 1 == Dim) {
+							break;
+						}
+						cur[dim] = min[dim];
+					}
+				}
+			}
 		}
 		/// Executes the given callback for the given range of the grid.
 		template <typename Callback> void for_each_in_range_checked(Callback &&cb, size_type min, size_type max) {
@@ -134,6 +178,19 @@ namespace fluid {
 			for_each_in_range_checked(std::forward<Callback>(cb), min_corner, center + diffmax + vec3s(1, 1, 1));
 		}
 
+		/// Executes the given callback in parallel for the cells with the given raw indices. The callback receives
+		/// the raw index of each cell and the cell itself. The indices must be unique.
+		template <typename Callback> void for_each_in_list_parallel(
+			const std::vector<std::size_t> &raw_indices, Callback &&cb
+		) {
+			int num_cells = static_cast<int>(raw_indices.size());
+#pragma omp parallel for
+			for (int i = 0; i < num_cells; ++i) {
+				std::size_t raw = raw_indices[static_cast<std::size_t>(i)];
+				cb(raw, _cells[raw]);
+			}
+		}
+
 		/// March through the grid. The callback's parameters are the (signed) index of the next cell, the direction
 		/// (dimension) of the face that's hit, the surface normal, and the \p t value of the intersection point. The
 		/// callback should return \p false to stop marching.
@@ -218,22 +275,27 @@ namespace fluid {
 				i, _size
 					);
 #endif
-			return vec_ops::dot(i, _layer_offset);
+			return _mapping.index_to_raw(i);
 		}
 		/// Converts a raw index for \ref _cells to a (x, y, z) position.
 		size_type index_from_raw(std::size_t i) const {
-			assert(i < get_array_size(get_size()));
-			return vec_ops::apply<size_type>(
-				[&i](std::size_t max) {
-					std::size_t v = i % max;
-					i /= max;
-					return v;
-				},
-				get_size()
-					);
+			assert(i < _cells.size());
+			if constexpr (mapping_type::is_linear) {
+				return vec_ops::apply<size_type>(
+					[&i](std::size_t max) {
+						std::size_t v = i % max;
+						i /= max;
+						return v;
+					},
+					get_size()
+						);
+			} else {
+				return _mapping.index_from_raw(i);
+			}
 		}
 
-		/// Returns the array size given the grid size.
+		/// Returns the number of cells in a grid of the given size. This does not include padding that some layouts
+		/// may require; see \ref get_storage_size().
 		inline static std::size_t get_array_size(size_type size) {
 			std::size_t result = 1;
 			vec_ops::for_each(
@@ -246,12 +308,18 @@ namespace fluid {
 		}
 	private:
 		std::vector<Cell> _cells; ///< Cell storage.
-		size_type
-			_size, ///< The size of this grid.
-			/// The offset that is used to obtain consecutive cells in a certain dimension. For example,
-			/// \p _layer_offset[0] is 1, \p _layer_offset[1] is \p _size[0], \p _layer_offset[2] is
-			/// <tt>_size[0] * _size[1]</tt>, and so on.
-			_layer_offset;
+		mapping_type _mapping; ///< Maps indices to raw indices.
+		size_type _size; ///< The size of this grid.
+
+		/// Returns whether the given index lies inside this grid.
+		bool _is_inside(size_type i) const {
+			for (std::size_t dim = 0; dim < Dim; ++dim) {
+				if (i[dim] >= _size[dim]) {
+					return false;
+				}
+			}
+			return true;
+		}
 
 		/// Wrapper around \ref _for_each_impl(). Call this with \p std::make_index_sequence<Dim>.
 		template <std::size_t ...Dims, typename Callback> FLUID_FORCEINLINE void _for_each_impl_wrapper(
@@ -275,7 +343,7 @@ namespace fluid {
 			i = min[ThisDim];
 			_for_each_impl<OtherDims...>(std::forward<Callback>(cb), my_it, min, max, cur);
 			for (++i; i < max[ThisDim]; ++i) {
-				my_it += _layer_offset[ThisDim];
+				my_it += _mapping.get_layer_offset(ThisDim);
 				_for_each_impl<OtherDims...>(std::forward<Callback>(cb), my_it, min, max, cur);
 			}
 		}
@@ -287,6 +355,8 @@ namespace fluid {
 		}
 	};
 
-	template <typename Cell> using grid2 = grid<2, Cell>; ///< Shorthand for 2D grids.
-	template <typename Cell> using grid3 = grid<3, Cell>; ///< Shorthand for 3D grids.
+	/// Shorthand for 2D grids.
+	template <typename Cell, typename Layout = linear_layout> using grid2 = grid<2, Cell, Layout>;
+	/// Shorthand for 3D grids.
+	template <typename Cell, typename Layout = linear_layout> using grid3 = grid<3, Cell, Layout>;
 }
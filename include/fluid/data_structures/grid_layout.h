@@ -0,0 +1,184 @@
+#pragma once
+
+/// \file
+/// Memory layouts of cells in a \ref fluid::grid.
+
+#include <cassert>
+#include <algorithm>
+
+#include "../math/vec.h"
+
+namespace fluid {
+	/// Stores cells in X-Y-Z- etc. order, i.e., cells with consecutive X coordinates are stored consecutively in
+	/// memory.
+	struct linear_layout {
+		/// Maps indices of a grid of the given dimension to storage indices.
+		template <std::size_t Dim> class mapping {
+		public:
+			using size_type = vec<Dim, std::size_t>; ///< The type used to store sizes and indices.
+			/// Whether cells with consecutive X coordinates are stored consecutively in memory.
+			constexpr static bool is_linear = true;
+
+			/// Default constructor.
+			mapping() = default;
+			/// Initializes this mapping for a grid of the given size.
+			explicit mapping(size_type size) {
+				std::size_t mul = 1;
+				vec_ops::for_each(
+					[&mul](std::size_t &offset, std::size_t size) {
+						offset = mul;
+						mul *= size;
+					},
+					_layer_offset, size
+						);
+				_storage_size = mul;
+			}
+
+			/// Returns the number of elements needed to store all cells.
+			[[nodiscard]] std::size_t get_storage_size() const {
+				return _storage_size;
+			}
+			/// Returns the distance in memory between consecutive cells along the given axis.
+			[[nodiscard]] std::size_t get_layer_offset(std::size_t dim) const {
+				return _layer_offset[dim];
+			}
+			/// Converts an index into a storage index.
+			[[nodiscard]] std::size_t index_to_raw(size_type i) const {
+				return vec_ops::dot(i, _layer_offset);
+			}
+			/// Converts a storage index into an index.
+			[[nodiscard]] size_type index_from_raw(std::size_t i) const {
+				size_type result;
+				for (std::size_t dim = Dim; dim > 0; --dim) {
+					result[dim - 1] = i / _layer_offset[dim - 1];
+					i %= _layer_offset[dim - 1];
+				}
+				return result;
+			}
+		private:
+			/// The offset that is used to obtain consecutive cells in a certain dimension. For example,
+			/// \p _layer_offset[0] is 1, \p _layer_offset[1] is \p size[0], \p _layer_offset[2] is
+			/// <tt>size[0] * size[1]</tt>, and so on.
+			size_type _layer_offset;
+			std::size_t _storage_size = 0; ///< The number of elements needed to store all cells.
+		};
+	};
+
+	/// Stores cells in cubic bricks. The bricks are stored in linear order, and cells inside each brick are also
+	/// stored in linear order. The grid is padded to a whole number of bricks along each axis.
+	///
+	/// \tparam BrickSizeLog2 Base 2 logarithm of the number of cells along each axis of a brick.
+	template <std::size_t BrickSizeLog2 = 2> struct bricked_layout {
+		/// Maps indices of a grid of the given dimension to storage indices.
+		template <std::size_t Dim> class mapping {
+		public:
+			using size_type = vec<Dim, std::size_t>; ///< The type used to store sizes and indices.
+			/// Whether cells with consecutive X coordinates are stored consecutively in memory.
+			constexpr static bool is_linear = false;
+			constexpr static std::size_t
+				brick_size = 1 << BrickSizeLog2, ///< The number of cells along each axis of a brick.
+				brick_mask = brick_size - 1; ///< Mask used to obtain the position of a cell inside its brick.
+
+			/// Default constructor.
+			mapping() = default;
+			/// Initializes this mapping for a grid of the given size.
+			explicit mapping(size_type size) {
+				std::size_t num_bricks = 1;
+				vec_ops::for_each(
+					[&num_bricks](std::size_t &offset, std::size_t size) {
+						offset = num_bricks;
+						num_bricks *= (size + brick_mask) >> BrickSizeLog2;
+					},
+					_brick_offset, size
+						);
+				_storage_size = num_bricks << (Dim * BrickSizeLog2);
+			}
+
+			/// Returns the number of elements needed to store all cells, including padding.
+			[[nodiscard]] std::size_t get_storage_size() const {
+				return _storage_size;
+			}
+			/// Converts an index into a storage index.
+			[[nodiscard]] std::size_t index_to_raw(size_type i) const {
+				std::size_t brick = 0, in_brick = 0;
+				for (std::size_t dim = 0; dim < Dim; ++dim) {
+					brick += (i[dim] >> BrickSizeLog2) * _brick_offset[dim];
+					in_brick |= (i[dim] & brick_mask) << (dim * BrickSizeLog2);
+				}
+				return (brick << (Dim * BrickSizeLog2)) | in_brick;
+			}
+			/// Converts a storage index into an index. The result may lie outside of the grid for padding cells.
+			[[nodiscard]] size_type index_from_raw(std::size_t i) const {
+				std::size_t brick = i >> (Dim * BrickSizeLog2);
+				size_type result;
+				for (std::size_t dim = Dim; dim > 0; --dim) {
+					result[dim - 1] = (brick / _brick_offset[dim - 1]) << BrickSizeLog2;
+					brick %= _brick_offset[dim - 1];
+				}
+				for (std::size_t dim = 0; dim < Dim; ++dim) {
+					result[dim] |= (i >> (dim * BrickSizeLog2)) & brick_mask;
+				}
+				return result;
+			}
+		private:
+			size_type _brick_offset; ///< The offset between consecutive bricks along each axis, in bricks.
+			std::size_t _storage_size = 0; ///< The number of elements needed to store all cells.
+		};
+	};
+
+	/// Stores cells in Morton order (Z-order), obtained by interleaving the bits of all coordinates. The grid is
+	/// padded to a cube whose size is a power of two, so this layout wastes memory for grids that are far from
+	/// cubic.
+	struct morton_layout {
+		/// Maps indices of a grid of the given dimension to storage indices.
+		template <std::size_t Dim> class mapping {
+		public:
+			using size_type = vec<Dim, std::size_t>; ///< The type used to store sizes and indices.
+			/// Whether cells with consecutive X coordinates are stored consecutively in memory.
+			constexpr static bool is_linear = false;
+
+			/// Default constructor.
+			mapping() = default;
+			/// Initializes this mapping for a grid of the given size.
+			explicit mapping(size_type size) {
+				std::size_t max_size = 0;
+				for (std::size_t dim = 0; dim < Dim; ++dim) {
+					max_size = std::max(max_size, size[dim]);
+				}
+				for (_bits = 0; (static_cast<std::size_t>(1) << _bits) < max_size; ++_bits) {
+				}
+				assert(_bits * Dim < sizeof(std::size_t) * 8);
+				_storage_size = max_size == 0 ? 0 : static_cast<std::size_t>(1) << (_bits * Dim);
+			}
+
+			/// Returns the number of elements needed to store all cells, including padding.
+			[[nodiscard]] std::size_t get_storage_size() const {
+				return _storage_size;
+			}
+			/// Converts an index into a storage index.
+			[[nodiscard]] std::size_t index_to_raw(size_type i) const {
+				std::size_t result = 0;
+				for (std::size_t bit = 0; bit < _bits; ++bit) {
+					for (std::size_t dim = 0; dim < Dim; ++dim) {
+						result |= ((i[dim] >> bit) & 1) << (bit * Dim + dim);
+					}
+				}
+				return result;
+			}
+			/// Converts a storage index into an index. The result may lie outside of the grid for padding cells.
+			[[nodiscard]] size_type index_from_raw(std::size_t i) const {
+				size_type result;
+				for (std::size_t bit = 0; bit < _bits; ++bit) {
+					for (std::size_t dim = 0; dim < Dim; ++dim) {
+						result[dim] |= ((i >> (bit * Dim + dim)) & 1) << bit;
+					}
+				}
+				return result;
+			}
+		private:
+			std::size_t
+				_bits = 0, ///< The number of bits of each coordinate.
+				_storage_size = 0; ///< The number of elements needed to store all cells.
+		};
+	};
+}
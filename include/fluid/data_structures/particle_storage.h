@@ -0,0 +1,261 @@
+#pragma once
+
+/// \file
+/// Structure-of-arrays storage of fluid particles.
+
+#include <vector>
+#include <iterator>
+#include <type_traits>
+
+#include "../math/vec.h"
+
+namespace fluid {
+	/// A single fluid particle. This is only used when particles need to be handled one at a time; particles
+	/// owned by a simulation are stored in a \ref basic_particle_storage.
+	///
+	/// \tparam T The scalar type of positions and velocities.
+	template <typename T> struct basic_particle {
+		using vec3_type = vec3<T>; ///< The vector type.
+
+		vec3_type
+			position, ///< The position of this particle.
+			velocity, ///< The velocity of this particle.
+			cx, ///< The c vector used in APIC.
+			cy, ///< The c vector used in APIC.
+			cz; ///< The c vector used in APIC.
+		/// The final position of this particle in the *previous* time step. This is used for collision
+		/// detection.
+		vec3_type old_position;
+		std::size_t raw_cell_index = 0; ///< Raw index of the cell this particle's in.
+
+		/// Computes the cell index of this particle. This function assumes that the computation won't result in
+		/// underflow of the cell index.
+		vec3s compute_cell_index(vec3_type grid_offset, T cell_size) const;
+		/// Computes the cell index and fraction position inside the cell of this particle. This function assumes
+		/// that the computation won't result in underflow of the cell index.
+		std::pair<vec3s, vec3_type> compute_cell_index_and_position(vec3_type grid_offset, T cell_size) const;
+
+		/// Computes the cell index of the given position. This function assumes that the computation won't result
+		/// in underflow of the cell index.
+		static vec3s compute_cell_index(vec3_type position, vec3_type grid_offset, T cell_size);
+		/// Computes the cell index and fraction position inside the cell of the given position. This function
+		/// assumes that the computation won't result in underflow of the cell index.
+		static std::pair<vec3s, vec3_type> compute_cell_index_and_position(
+			vec3_type position, vec3_type grid_offset, T cell_size
+		);
+	};
+
+	/// Stores particles as a structure of arrays, so that passes that only access some of the fields of each
+	/// particle do not need to load the others. Each member of \ref basic_particle has a corresponding array here;
+	/// all arrays always have the same length.
+	///
+	/// \tparam T The scalar type of positions and velocities. Single precision halves the memory used by particles.
+	template <typename T> class basic_particle_storage {
+	public:
+		using particle = basic_particle<T>; ///< The particle type.
+		using vec3_type = vec3<T>; ///< The vector type.
+
+		/// A reference to a particle in a \ref basic_particle_storage. Members of this struct refer to elements in the
+		/// arrays of the storage, and are invalidated when the storage is reallocated.
+		///
+		/// \tparam Const Whether the referenced particle is immutable.
+		template <bool Const> struct basic_reference {
+		public:
+			/// The type of references to vectors.
+			using vec_ref = std::conditional_t<Const, const vec3_type&, vec3_type&>;
+			/// The type of references to indices.
+			using index_ref = std::conditional_t<Const, const std::size_t&, std::size_t&>;
+			/// The type of the storage.
+			using storage_type = std::conditional_t<Const, const basic_particle_storage, basic_particle_storage>;
+
+			/// Initializes this reference to refer to the particle with the given index.
+			basic_reference(storage_type &storage, std::size_t i) :
+				position(storage.positions[i]), velocity(storage.velocities[i]),
+				cx(storage.cx[i]), cy(storage.cy[i]), cz(storage.cz[i]),
+				old_position(storage.old_positions[i]), raw_cell_index(storage.raw_cell_indices[i]) {
+			}
+
+			/// Assigns the values of the given particle to the referenced particle.
+			template <bool Dummy = Const> std::enable_if_t<!Dummy, basic_reference&> operator=(
+				const particle &p
+			) {
+				position = p.position;
+				velocity = p.velocity;
+				cx = p.cx;
+				cy = p.cy;
+				cz = p.cz;
+				old_position = p.old_position;
+				raw_cell_index = p.raw_cell_index;
+				return *this;
+			}
+
+			/// Copies the referenced particle.
+			operator particle() const {
+				particle result;
+				result.position = position;
+				result.velocity = velocity;
+				result.cx = cx;
+				result.cy = cy;
+				result.cz = cz;
+				result.old_position = old_position;
+				result.raw_cell_index = raw_cell_index;
+				return result;
+			}
+
+			vec_ref
+				position, ///< \ref basic_particle::position.
+				velocity, ///< \ref basic_particle::velocity.
+				cx, ///< \ref basic_particle::cx.
+				cy, ///< \ref basic_particle::cy.
+				cz, ///< \ref basic_particle::cz.
+				old_position; ///< \ref basic_particle::old_position.
+			index_ref raw_cell_index; ///< \ref basic_particle::raw_cell_index.
+		};
+		using reference = basic_reference<false>; ///< Reference to a mutable particle.
+		using const_reference = basic_reference<true>; ///< Reference to an immutable particle.
+
+		/// Iterator over the particles of a \ref basic_particle_storage. Dereferencing the iterator yields a
+		/// \ref basic_reference.
+		template <bool Const> struct basic_iterator {
+		public:
+			using iterator_category = std::input_iterator_tag; ///< The iterator category.
+			using value_type = particle; ///< The value type.
+			using difference_type = std::ptrdiff_t; ///< The difference type.
+			using reference = basic_reference<Const>; ///< The reference type.
+			using pointer = void; ///< The pointer type.
+			/// The type of the storage.
+			using storage_type = std::conditional_t<Const, const basic_particle_storage, basic_particle_storage>;
+
+			/// Default constructor.
+			basic_iterator() = default;
+			/// Initializes this iterator to point to the particle with the given index.
+			basic_iterator(storage_type &storage, std::size_t i) : _storage(&storage), _index(i) {
+			}
+
+			/// Dereferencing.
+			reference operator*() const {
+				return reference(*_storage, _index);
+			}
+
+			/// Pre-increment.
+			basic_iterator &operator++() {
+				++_index;
+				return *this;
+			}
+			/// Post-increment.
+			basic_iterator operator++(int) {
+				basic_iterator result = *this;
+				++*this;
+				return result;
+			}
+
+			/// Equality.
+			friend bool operator==(const basic_iterator &lhs, const basic_iterator &rhs) {
+				return lhs._storage == rhs._storage && lhs._index == rhs._index;
+			}
+			/// Inequality.
+			friend bool operator!=(const basic_iterator &lhs, const basic_iterator &rhs) {
+				return !(lhs == rhs);
+			}
+		private:
+			storage_type *_storage = nullptr; ///< The storage.
+			std::size_t _index = 0; ///< The index of the particle.
+		};
+		using iterator = basic_iterator<false>; ///< Iterator over mutable particles.
+		using const_iterator = basic_iterator<true>; ///< Iterator over immutable particles.
+
+		/// Returns the number of particles.
+		[[nodiscard]] std::size_t size() const {
+			return positions.size();
+		}
+		/// Returns whether there are no particles.
+		[[nodiscard]] bool empty() const {
+			return positions.empty();
+		}
+
+		/// Removes all particles.
+		void clear();
+		/// Reserves space for the given number of particles, including the scratch space of \ref permute().
+		void reserve(std::size_t);
+		/// Returns the number of bytes allocated by this storage, including scratch space.
+		[[nodiscard]] std::size_t get_allocated_bytes() const;
+		/// Resizes all arrays. New particles are default-initialized.
+		void resize(std::size_t);
+		/// Adds a particle to the back of this storage.
+		void push_back(const particle&);
+
+		/// Removes the particles at the given indices, which must be sorted and unique, by moving particles from the
+		/// back of the storage into the vacated slots. This changes the order of the remaining particles, and does
+		/// not release memory, so that later insertions can reuse it.
+		void remove_sorted(const std::vector<std::size_t> &indices);
+
+		/// Reorders all particles so that the particle at index \p i is the particle that was previously at index
+		/// <tt>order[i]</tt>. The order must contain exactly as many indices as there are particles. The scratch
+		/// space used for this is kept, so that repeated calls do not allocate.
+		void permute(const std::vector<std::size_t> &order);
+
+		/// Calls the given function for each per-particle array.
+		template <typename Func> void for_each_array(Func &&func) {
+			func(positions);
+			func(velocities);
+			func(cx);
+			func(cy);
+			func(cz);
+			func(old_positions);
+			func(raw_cell_indices);
+		}
+		/// \overload
+		template <typename Func> void for_each_array(Func &&func) const {
+			func(positions);
+			func(velocities);
+			func(cx);
+			func(cy);
+			func(cz);
+			func(old_positions);
+			func(raw_cell_indices);
+		}
+
+		/// Indexing.
+		[[nodiscard]] reference operator[](std::size_t i) {
+			return reference(*this, i);
+		}
+		/// Indexing.
+		[[nodiscard]] const_reference operator[](std::size_t i) const {
+			return const_reference(*this, i);
+		}
+
+		/// Returns an iterator to the first particle.
+		[[nodiscard]] iterator begin() {
+			return iterator(*this, 0);
+		}
+		/// \overload
+		[[nodiscard]] const_iterator begin() const {
+			return const_iterator(*this, 0);
+		}
+		/// Returns an iterator past the last particle.
+		[[nodiscard]] iterator end() {
+			return iterator(*this, size());
+		}
+		/// \overload
+		[[nodiscard]] const_iterator end() const {
+			return const_iterator(*this, size());
+		}
+
+		std::vector<vec3_type>
+			positions, ///< Positions of all particles.
+			velocities, ///< Velocities of all particles.
+			cx, ///< The c vectors used in APIC.
+			cy, ///< The c vectors used in APIC.
+			cz, ///< The c vectors used in APIC.
+			old_positions; ///< Positions of all particles in the previous time step.
+		std::vector<std::size_t> raw_cell_indices; ///< Raw indices of the cells that the particles are in.
+	private:
+		/// Scratch space that \ref permute() gathers vector arrays into. It is swapped with each array in turn, so
+		/// its contents are meaningless.
+		std::vector<vec3_type> _vec_buffer;
+		std::vector<std::size_t> _index_buffer; ///< Scratch space that \ref permute() gathers indices into.
+	};
+
+	using particle = basic_particle<double>; ///< A particle with double precision.
+	using particle_storage = basic_particle_storage<double>; ///< Particle storage with double precision.
+}
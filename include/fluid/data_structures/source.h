@@ -1,7 +1,7 @@
 #pragma once
 
 /// \file
-/// Definition of fluid sources.
+/// Definition of fluid sources and sinks.
 
 #include <vector>
 
@@ -20,4 +20,11 @@ namespace fluid {
 			/// \ref velocity.
 			coerce_velocity = false;
 	};
+
+	/// A fluid sink. Particles that enter its cells are removed, and their storage is reused by sources.
+	class sink {
+	public:
+		std::vector<vec3s> cells; ///< The cells where fluid particles will be removed.
+		bool active = true; ///< Whether or not this sink is active.
+	};
 }
@@ -0,0 +1,194 @@
+#pragma once
+
+/// \file
+/// A sparse 3D grid that stores cells in tiles.
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "../math/vec.h"
+
+namespace fluid {
+	/// A sparse 3D grid that is divided into cubic tiles. Storage for a tile is only allocated when the tile is
+	/// activated; reading a cell in an inactive tile returns the background value. Deactivating a tile keeps its
+	/// storage around so that it can be reused without allocation; \ref release_inactive_tiles() frees the storage
+	/// of all inactive tiles.
+	///
+	/// \tparam Cell The type of a cell.
+	/// \tparam TileSizeLog2 Base 2 logarithm of the number of cells along each axis of a tile.
+	template <typename Cell, std::size_t TileSizeLog2 = 3> class sparse_grid {
+	public:
+		constexpr static std::size_t
+			tile_size = 1 << TileSizeLog2, ///< The number of cells along each axis of a tile.
+			tile_cell_count = tile_size * tile_size * tile_size; ///< The number of cells in each tile.
+
+		/// Default constructor.
+		sparse_grid() = default;
+		/// Initializes the grid with the given size. All tiles are initially inactive.
+		explicit sparse_grid(vec3s size, const Cell &background = Cell{}) :
+			_size(size), _num_tiles(get_tile_count(size)), _background(background) {
+			std::size_t total_tiles = _num_tiles.x * _num_tiles.y * _num_tiles.z;
+			_tiles.resize(total_tiles);
+			_tile_active.resize(total_tiles, 0);
+		}
+
+		/// Returns the number of tiles along each axis for a grid of the given size.
+		[[nodiscard]] inline static vec3s get_tile_count(vec3s size) {
+			return (size + vec3s(tile_size - 1, tile_size - 1, tile_size - 1)) / tile_size;
+		}
+		/// Returns the index of the tile that contains the given cell.
+		[[nodiscard]] inline static vec3s get_tile_of(vec3s cell) {
+			return vec3s(cell.x >> TileSizeLog2, cell.y >> TileSizeLog2, cell.z >> TileSizeLog2);
+		}
+
+		/// Returns the size of this grid.
+		[[nodiscard]] vec3s get_size() const {
+			return _size;
+		}
+		/// Returns the number of tiles along each axis.
+		[[nodiscard]] vec3s get_tile_count() const {
+			return _num_tiles;
+		}
+
+		/// Converts a tile index into a raw tile index.
+		[[nodiscard]] std::size_t tile_index_to_raw(vec3s tile) const {
+			return tile.x + _num_tiles.x * (tile.y + _num_tiles.y * tile.z);
+		}
+		/// Converts a raw tile index into a tile index.
+		[[nodiscard]] vec3s tile_index_from_raw(std::size_t i) const {
+			return vec3s(i % _num_tiles.x, (i / _num_tiles.x) % _num_tiles.y, i / (_num_tiles.x * _num_tiles.y));
+		}
+		/// Returns the raw index of the tile that contains the given cell.
+		[[nodiscard]] std::size_t get_raw_tile_of(vec3s cell) const {
+			return tile_index_to_raw(get_tile_of(cell));
+		}
+
+		/// Returns whether the tile with the given raw index is active.
+		[[nodiscard]] bool is_tile_active(std::size_t tile) const {
+			return _tile_active[tile] != 0;
+		}
+		/// Activates the tile with the given raw index, filling it with the background value if it was inactive.
+		/// Different tiles can be activated concurrently, but \ref get_active_tiles() will only be up-to-date after
+		/// \ref collect_active_tiles() is called.
+		void activate_tile(std::size_t tile) {
+			if (_tile_active[tile]) {
+				return;
+			}
+			if (!_tiles[tile]) {
+				_tiles[tile] = std::make_unique<_tile>();
+			}
+			std::fill(_tiles[tile]->cells, _tiles[tile]->cells + tile_cell_count, _background);
+			_tile_active[tile] = 1;
+		}
+		/// Collects the raw indices of all active tiles into the list returned by \ref get_active_tiles().
+		void collect_active_tiles() {
+			_active_tiles.clear();
+			for (std::size_t i = 0; i < _tile_active.size(); ++i) {
+				if (_tile_active[i]) {
+					_active_tiles.emplace_back(i);
+				}
+			}
+		}
+		/// Deactivates all tiles.
+		void deactivate_all() {
+			std::fill(_tile_active.begin(), _tile_active.end(), static_cast<unsigned char>(0));
+			_active_tiles.clear();
+		}
+		/// Frees the storage of all inactive tiles.
+		void release_inactive_tiles() {
+			for (std::size_t i = 0; i < _tiles.size(); ++i) {
+				if (!_tile_active[i]) {
+					_tiles[i].reset();
+				}
+			}
+		}
+		/// Returns the raw indices of all active tiles, sorted in ascending order.
+		[[nodiscard]] const std::vector<std::size_t> &get_active_tiles() const {
+			return _active_tiles;
+		}
+
+		/// Returns the cell at the given index. The tile that contains the cell must be active.
+		[[nodiscard]] Cell &at_active(vec3s i) {
+			return _tiles[get_raw_tile_of(i)]->cells[_index_in_tile(i)];
+		}
+		/// Returns the cell at the given index, or the background value if the tile that contains it is inactive.
+		[[nodiscard]] const Cell &operator()(vec3s i) const {
+			std::size_t tile = get_raw_tile_of(i);
+			return _tile_active[tile] ? _tiles[tile]->cells[_index_in_tile(i)] : _background;
+		}
+
+		/// Calls the given callback for all cells in the given tile that are inside the grid. The callback receives
+		/// the index of the cell.
+		template <typename Callback> void for_each_cell_in_tile(std::size_t tile, Callback &&cb) const {
+			vec3s
+				min_corner = tile_index_from_raw(tile) * tile_size,
+				max_corner = min_corner + vec3s(tile_size, tile_size, tile_size);
+			max_corner = vec3s(
+				std::min(max_corner.x, _size.x), std::min(max_corner.y, _size.y), std::min(max_corner.z, _size.z)
+			);
+			for (std::size_t z = min_corner.z; z < max_corner.z; ++z) {
+				for (std::size_t y = min_corner.y; y < max_corner.y; ++y) {
+					for (std::size_t x = min_corner.x; x < max_corner.x; ++x) {
+						cb(vec3s(x, y, z));
+					}
+				}
+			}
+		}
+		/// Executes the given callback for the given range of the grid. The callback receives the index and the
+		/// value of each cell; cells in inactive tiles have the background value.
+		template <typename Callback> void for_each_in_range_checked(
+			Callback &&cb, vec3s center, vec3s diffmin, vec3s diffmax
+		) const {
+			vec3s min_corner = vec_ops::apply<vec3s>(
+				[](std::size_t center, std::size_t offset) {
+					return center < offset ? 0 : center - offset;
+				}, center, diffmin
+			);
+			vec3s max_corner = center + diffmax + vec3s(1, 1, 1);
+			max_corner = vec3s(
+				std::min(max_corner.x, _size.x), std::min(max_corner.y, _size.y), std::min(max_corner.z, _size.z)
+			);
+			for (std::size_t z = min_corner.z; z < max_corner.z; ++z) {
+				for (std::size_t y = min_corner.y; y < max_corner.y; ++y) {
+					for (std::size_t x = min_corner.x; x < max_corner.x; ++x) {
+						vec3s cell(x, y, z);
+						cb(cell, (*this)(cell));
+					}
+				}
+			}
+		}
+
+		/// Returns the number of bytes allocated for tiles.
+		[[nodiscard]] std::size_t get_allocated_bytes() const {
+			std::size_t result =
+				_tiles.capacity() * sizeof(std::unique_ptr<_tile>) + _tile_active.capacity() +
+				_active_tiles.capacity() * sizeof(std::size_t);
+			for (const std::unique_ptr<_tile> &tile : _tiles) {
+				if (tile) {
+					result += sizeof(_tile);
+				}
+			}
+			return result;
+		}
+	private:
+		/// Storage for the cells in a tile.
+		struct _tile {
+			Cell cells[tile_cell_count]; ///< The cells, stored in X-Y-Z order.
+		};
+
+		/// Returns the index of the given cell inside its tile.
+		[[nodiscard]] inline static std::size_t _index_in_tile(vec3s i) {
+			constexpr std::size_t mask = tile_size - 1;
+			return (i.x & mask) | ((i.y & mask) << TileSizeLog2) | ((i.z & mask) << (2 * TileSizeLog2));
+		}
+
+		std::vector<std::unique_ptr<_tile>> _tiles; ///< Storage of all tiles.
+		std::vector<unsigned char> _tile_active; ///< Whether each tile is active.
+		std::vector<std::size_t> _active_tiles; ///< Raw indices of all active tiles.
+		vec3s
+			_size, ///< The size of this grid.
+			_num_tiles; ///< The number of tiles along each axis.
+		Cell _background{}; ///< The value of all cells in inactive tiles.
+	};
+}
@@ -6,29 +6,37 @@
 #include "data_structures/grid.h"
 
 namespace fluid {
-	class pressure_solver;
+	/// The type of the contents of a cell in a \ref basic_mac_grid. This is shared by grids of all scalar types, so
+	/// that cell types can be passed around without knowing the precision of the velocities.
+	enum class grid_cell_type : unsigned char {
+		air = 0x1, ///< The cell contains air.
+		fluid = 0x2, ///< The cell contains fluid.
+		solid = 0x4, ///< The cell contains solid.
+	};
 
-	/// Stores a marker-and-cell (MAC) grid.
-	class mac_grid {
+	/// Stores a marker-and-cell (MAC) grid. The three velocity components and the cell types are stored as
+	/// separate arrays, so that passes that only need some of them do not load the others.
+	///
+	/// \tparam T The scalar type of velocities.
+	template <typename T> class basic_mac_grid {
 	public:
-		/// A cell in the simulation grid.
+		using scalar_type = T; ///< The scalar type of velocities.
+		using vec3_type = vec3<T>; ///< The vector type of velocities.
+
+		/// A cell in the simulation grid. Cells are not stored as-is; this is only used to pass all information
+		/// about a single cell around.
 		struct cell {
-			/// The type of this cell's contents.
-			enum class type : unsigned char {
-				air = 0x1, ///< The cell contains air.
-				fluid = 0x2, ///< The cell contains fluid.
-				solid = 0x4, ///< The cell contains solid.
-			};
+			using type = grid_cell_type; ///< The type of this cell's contents.
 
 			/// The velocities sampled at the centers of faces in the positive direction. Or, if this cell is part of
 			/// a fluid source, then this is the velocity of that source.
-			vec3d velocities_posface;
+			vec3_type velocities_posface;
 			type cell_type = type::air; ///< The contents of this cell.
 		};
 		/// Stores velocity samples on faces near a particle. The coordinates of each member does not necessarily
 		/// correspond to that of the same cell.
 		struct face_samples {
-			vec3d
+			vec3_type
 				v000, ///< Velocity at (0, 0, 0).
 				v001, ///< Velocity at (1, 0, 0).
 				v010, ///< Velocity at (0, 1, 0).
@@ -40,35 +48,100 @@ namespace fluid {
 		};
 
 		/// Default constructor.
-		mac_grid() = default;
+		basic_mac_grid() = default;
 		/// Initializes the grid.
-		explicit mac_grid(vec3s grid_count);
+		explicit basic_mac_grid(vec3s grid_count);
 
 		/// Returns the velocities around the given position. Velocities of cells that are out of the grid have their
 		/// corresponding coordinates clamped to zero.
-		[[nodiscard]] std::pair<face_samples, vec3d> get_face_samples(vec3s grid_index, vec3d offset) const;
+		[[nodiscard]] std::pair<face_samples, vec3_type> get_face_samples(vec3s grid_index, vec3_type offset) const;
+
+		/// Returns the size of this grid.
+		[[nodiscard]] vec3s get_size() const {
+			return _cell_types.get_size();
+		}
+		/// Returns the number of cells in this grid.
+		[[nodiscard]] std::size_t get_cell_count() const {
+			return grid3<grid_cell_type>::get_array_size(get_size());
+		}
+		/// Returns whether the given index lies inside this grid. Note that since unsigned overflow is well defined,
+		/// "negative" coordinates work fine.
+		[[nodiscard]] bool is_inside(vec3s i) const {
+			vec3s grid_size = get_size();
+			return i.x < grid_size.x && i.y < grid_size.y && i.z < grid_size.z;
+		}
+		/// Converts a cell index into a raw index that can be used for all arrays of this grid.
+		[[nodiscard]] std::size_t index_to_raw(vec3s i) const {
+			return _cell_types.index_to_raw(i);
+		}
+		/// Converts a raw index into a cell index.
+		[[nodiscard]] vec3s index_from_raw(std::size_t i) const {
+			return _cell_types.index_from_raw(i);
+		}
 
-		/// Returns the cell at the given index, or \p nullptr if the cell is out of bounds. Note that since unsigned
-		/// overflow is well defined, "negative" coordinates works fine.
-		[[nodiscard]] mac_grid::cell *get_cell(vec3s);
+		/// Returns the velocities of the positive direction faces along the given axis.
+		[[nodiscard]] grid3<T> &velocities(std::size_t dim) {
+			return _velocities[dim];
+		}
+		/// \overload
+		[[nodiscard]] const grid3<T> &velocities(std::size_t dim) const {
+			return _velocities[dim];
+		}
+		/// Returns the types of all cells.
+		[[nodiscard]] grid3<grid_cell_type> &cell_types() {
+			return _cell_types;
+		}
 		/// \overload
-		[[nodiscard]] const mac_grid::cell *get_cell(vec3s) const;
+		[[nodiscard]] const grid3<grid_cell_type> &cell_types() const {
+			return _cell_types;
+		}
 
-		/// Returns the cell and its type at the given index. For cells that are outside of the simulation grid, this
-		/// function returns \ref fluid_grid::cell::type::solid.
-		[[nodiscard]] std::pair<mac_grid::cell*, mac_grid::cell::type> get_cell_and_type(vec3s);
+		/// Returns the velocities of the positive direction faces of the cell with the given raw index.
+		[[nodiscard]] vec3_type get_velocities_posface(std::size_t raw) const {
+			return vec3_type(_velocities[0][raw], _velocities[1][raw], _velocities[2][raw]);
+		}
 		/// \overload
-		[[nodiscard]] std::pair<const mac_grid::cell*, mac_grid::cell::type> get_cell_and_type(vec3s) const;
+		[[nodiscard]] vec3_type get_velocities_posface(vec3s i) const {
+			return get_velocities_posface(index_to_raw(i));
+		}
+		/// Sets the velocities of the positive direction faces of the cell with the given raw index.
+		void set_velocities_posface(std::size_t raw, vec3_type vel) {
+			_velocities[0][raw] = vel.x;
+			_velocities[1][raw] = vel.y;
+			_velocities[2][raw] = vel.z;
+		}
+		/// Adds the given value to the velocities of the positive direction faces of the cell with the given raw
+		/// index.
+		void add_velocities_posface(std::size_t raw, vec3_type vel) {
+			_velocities[0][raw] += vel.x;
+			_velocities[1][raw] += vel.y;
+			_velocities[2][raw] += vel.z;
+		}
 
-		/// Returns the simulation grid.
-		[[nodiscard]] grid3<cell> &grid() {
-			return _grid;
+		/// Returns the type of the cell at the given index. For cells that are outside of the simulation grid, this
+		/// function returns \ref grid_cell_type::solid.
+		[[nodiscard]] grid_cell_type get_cell_type(vec3s i) const {
+			return is_inside(i) ? _cell_types(i) : grid_cell_type::solid;
 		}
-		/// Returns the simulation grid.
-		[[nodiscard]] const grid3<cell> &grid() const {
-			return _grid;
+
+		/// Returns all information about the cell at the given index, which must be inside the grid.
+		[[nodiscard]] cell get_cell(vec3s i) const {
+			std::size_t raw = index_to_raw(i);
+			cell result;
+			result.velocities_posface = get_velocities_posface(raw);
+			result.cell_type = _cell_types[raw];
+			return result;
+		}
+		/// Sets all information about the cell at the given index, which must be inside the grid.
+		void set_cell(vec3s i, const cell &c) {
+			std::size_t raw = index_to_raw(i);
+			set_velocities_posface(raw, c.velocities_posface);
+			_cell_types[raw] = c.cell_type;
 		}
 	protected:
-		grid3<cell> _grid; ///< The simulation grid.
+		grid3<T> _velocities[3]; ///< Velocities of the positive direction faces along each axis.
+		grid3<grid_cell_type> _cell_types; ///< The type of each cell.
 	};
+
+	using mac_grid = basic_mac_grid<double>; ///< A MAC grid with double precision velocities.
 }
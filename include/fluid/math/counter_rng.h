@@ -0,0 +1,65 @@
+#pragma once
+
+/// \file
+/// Counter-based random number generation.
+
+#include <cstdint>
+#include <array>
+
+#include "vec.h"
+
+namespace fluid {
+	/// The Philox4x32-10 counter-based random number generator from "Parallel Random Numbers: As Easy as 1, 2, 3"
+	/// by Salmon et al. Each block of random numbers is a pure function of a counter and a key, so random numbers
+	/// for any particle or pair of particles can be generated independently without any shared state, and results
+	/// do not depend on the order in which they are generated.
+	struct philox4x32 {
+		using counter_type = std::array<std::uint32_t, 4>; ///< The type of counters and output blocks.
+		using key_type = std::array<std::uint32_t, 2>; ///< The type of keys.
+
+		/// Returns the block of random numbers for the given counter and key.
+		[[nodiscard]] inline static counter_type generate(counter_type counter, key_type key) {
+			constexpr std::uint64_t multiplier0 = 0xD2511F53, multiplier1 = 0xCD9E8D57;
+			constexpr std::uint32_t weyl0 = 0x9E3779B9, weyl1 = 0xBB67AE85;
+			for (std::size_t round = 0; round < 10; ++round) {
+				std::uint64_t
+					product0 = multiplier0 * counter[0],
+					product1 = multiplier1 * counter[2];
+				counter = {
+					static_cast<std::uint32_t>(product1 >> 32) ^ counter[1] ^ key[0],
+					static_cast<std::uint32_t>(product1),
+					static_cast<std::uint32_t>(product0 >> 32) ^ counter[3] ^ key[1],
+					static_cast<std::uint32_t>(product0)
+				};
+				key[0] += weyl0;
+				key[1] += weyl1;
+			}
+			return counter;
+		}
+		/// Returns the block of random numbers for the given pair of 64-bit counters and the given 64-bit key.
+		[[nodiscard]] inline static counter_type generate(std::uint64_t hi, std::uint64_t lo, std::uint64_t key) {
+			return generate(
+				{
+					static_cast<std::uint32_t>(lo), static_cast<std::uint32_t>(lo >> 32),
+					static_cast<std::uint32_t>(hi), static_cast<std::uint32_t>(hi >> 32)
+				},
+				{ static_cast<std::uint32_t>(key), static_cast<std::uint32_t>(key >> 32) }
+			);
+		}
+
+		/// Converts a random 32-bit integer into a number uniformly distributed in [0, 1).
+		[[nodiscard]] inline static double to_unit(std::uint32_t value) {
+			return static_cast<double>(value) * (1.0 / 4294967296.0);
+		}
+		/// Converts the first three numbers of a block into a vector whose coordinates are uniformly distributed in
+		/// [min, max). The coordinates are computed in double precision, then converted to \p T.
+		template <typename T> [[nodiscard]] inline static vec3<T> to_vec3(const counter_type &block, T min, T max) {
+			double dmin = min, range = static_cast<double>(max) - dmin;
+			return vec3<T>(
+				static_cast<T>(dmin + range * to_unit(block[0])),
+				static_cast<T>(dmin + range * to_unit(block[1])),
+				static_cast<T>(dmin + range * to_unit(block[2]))
+			);
+		}
+	};
+}
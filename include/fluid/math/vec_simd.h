@@ -10,6 +10,8 @@
 namespace fluid {
 	/// 4D double vectors implemented using AVX instructions. The lower bits contain the x value.
 	struct vec4d_avx {
+		/// Default constructor. The contents of the vector are not initialized.
+		vec4d_avx() = default;
 		/// Initializes \ref value.
 		explicit vec4d_avx(__m256d v) : value(v) {
 		}
@@ -22,11 +24,11 @@ namespace fluid {
 			return vec4d_avx(_mm256_setzero_pd());
 		}
 		/// Loads data from four aligned doubles. The input values are stored in xyzw order.
-		inline static vec4d_avx load_aligned(double arr[4]) {
+		inline static vec4d_avx load_aligned(const double arr[4]) {
 			return vec4d_avx(_mm256_load_pd(arr));
 		}
 		/// Loads data from four doubles that may or may not be aligned. The input values are stored in xyzw order.
-		inline static vec4d_avx load_unaligned(double arr[4]) {
+		inline static vec4d_avx load_unaligned(const double arr[4]) {
 			return vec4d_avx(_mm256_loadu_pd(arr));
 		}
 		/// Loads a single double value into all components of the vector.
@@ -92,6 +94,67 @@ namespace fluid {
 		__m256d value; ///< The value of this vector.
 	};
 
+	/// 8D float vectors implemented using AVX instructions. The lower bits contain the first element. This has
+	/// twice as many lanes as \ref vec4d_avx, and is used where single precision is sufficient.
+	struct vec8f_avx {
+		/// Default constructor. The contents of the vector are not initialized.
+		vec8f_avx() = default;
+		/// Initializes \ref value.
+		explicit vec8f_avx(__m256 v) : value(v) {
+		}
+
+		/// Returns the zero vector.
+		inline static vec8f_avx zero() {
+			return vec8f_avx(_mm256_setzero_ps());
+		}
+		/// Loads data from eight aligned floats.
+		inline static vec8f_avx load_aligned(const float arr[8]) {
+			return vec8f_avx(_mm256_load_ps(arr));
+		}
+		/// Loads data from eight floats that may or may not be aligned.
+		inline static vec8f_avx load_unaligned(const float arr[8]) {
+			return vec8f_avx(_mm256_loadu_ps(arr));
+		}
+		/// Loads a single float value into all components of the vector.
+		inline static vec8f_avx uniform(float v) {
+			return vec8f_avx(_mm256_broadcast_ss(&v));
+		}
+
+		/// Returns the first element.
+		float x() const {
+			return _mm256_cvtss_f32(value);
+		}
+		/// Stores the contents of this vector into the given aligned array.
+		void store_aligned(float arr[8]) const {
+			_mm256_store_ps(arr, value);
+		}
+		/// Stores the contents of this vector into the given unaligned array.
+		void store_unaligned(float arr[8]) const {
+			_mm256_storeu_ps(arr, value);
+		}
+
+
+		// arithmetic
+		/// Addition.
+		friend vec8f_avx operator+(vec8f_avx lhs, vec8f_avx rhs) {
+			return vec8f_avx(_mm256_add_ps(lhs.value, rhs.value));
+		}
+		/// In-place addition.
+		vec8f_avx &operator+=(vec8f_avx rhs) {
+			return (*this) = (*this) + rhs;
+		}
+		/// Subtraction.
+		friend vec8f_avx operator-(vec8f_avx lhs, vec8f_avx rhs) {
+			return vec8f_avx(_mm256_sub_ps(lhs.value, rhs.value));
+		}
+		/// In-place subtraction.
+		vec8f_avx &operator-=(vec8f_avx rhs) {
+			return (*this) = (*this) - rhs;
+		}
+
+		__m256 value; ///< The value of this vector.
+	};
+
 	namespace vec_ops {
 		namespace memberwise {
 			/// Memberwise multiplication.
@@ -103,6 +166,11 @@ namespace fluid {
 				return vec4d_avx(_mm256_div_pd(lhs.value, rhs.value));
 			}
 
+			/// Absolute value.
+			inline vec4d_avx abs(vec4d_avx value) {
+				return vec4d_avx(_mm256_andnot_pd(_mm256_set1_pd(-0.0), value.value));
+			}
+
 			/// Square root.
 			inline vec4d_avx sqrt(vec4d_avx value) {
 				return vec4d_avx(_mm256_sqrt_pd(value.value));
@@ -129,6 +197,47 @@ namespace fluid {
 			inline vec4d_avx round(vec4d_avx v) {
 				return vec4d_avx(_mm256_round_pd(v.value, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
 			}
+
+			/// Memberwise multiplication.
+			inline vec8f_avx mul(vec8f_avx lhs, vec8f_avx rhs) {
+				return vec8f_avx(_mm256_mul_ps(lhs.value, rhs.value));
+			}
+			/// Memberwise division.
+			inline vec8f_avx div(vec8f_avx lhs, vec8f_avx rhs) {
+				return vec8f_avx(_mm256_div_ps(lhs.value, rhs.value));
+			}
+
+			/// Absolute value.
+			inline vec8f_avx abs(vec8f_avx value) {
+				return vec8f_avx(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), value.value));
+			}
+
+			/// Square root.
+			inline vec8f_avx sqrt(vec8f_avx value) {
+				return vec8f_avx(_mm256_sqrt_ps(value.value));
+			}
+
+			/// Returns the minimum of each component.
+			inline vec8f_avx min(vec8f_avx lhs, vec8f_avx rhs) {
+				return vec8f_avx(_mm256_min_ps(lhs.value, rhs.value));
+			}
+			/// Returns the maximum of each component.
+			inline vec8f_avx max(vec8f_avx lhs, vec8f_avx rhs) {
+				return vec8f_avx(_mm256_max_ps(lhs.value, rhs.value));
+			}
+
+			/// Flooring.
+			inline vec8f_avx floor(vec8f_avx v) {
+				return vec8f_avx(_mm256_floor_ps(v.value));
+			}
+			/// Ceiling.
+			inline vec8f_avx ceil(vec8f_avx v) {
+				return vec8f_avx(_mm256_ceil_ps(v.value));
+			}
+			/// Rounding.
+			inline vec8f_avx round(vec8f_avx v) {
+				return vec8f_avx(_mm256_round_ps(v.value, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+			}
 		}
 
 		/// Dot product. This is less efficient than performing multiple dot products at once.
@@ -4,15 +4,40 @@
 
 #include <vector>
 #include <tuple>
+#include <limits>
+#include <cstdint>
+#include <type_traits>
 
+#include "misc.h"
 #include "math/vec.h"
 #include "mac_grid.h"
-#include "simulation.h"
+#include "data_structures/grid.h"
 
 namespace fluid {
-	/// A pressure solver.
-	class pressure_solver {
+	template <typename T> class basic_simulation;
+
+	/// A pressure solver. The solver is meant to be kept alive across time steps so that its buffers can be
+	/// reused; they are only reallocated when they need to grow.
+	///
+	/// \tparam Scalar The scalar type of the simulation that this solver is used with. The linear system itself is
+	///                always solved in double precision, or in mixed precision if \ref mixed_precision is set.
+	template <typename Scalar> class basic_pressure_solver {
 	public:
+		/// The preconditioner used by the conjugate gradient solver.
+		enum class preconditioner_type : unsigned char {
+			/// Modified incomplete Cholesky, as described in the book. This needs few iterations on small grids
+			/// but its triangular solves are sequential.
+			modified_incomplete_cholesky,
+			/// The same modified incomplete Cholesky preconditioner, but the factorization and both triangular
+			/// solves process cells in wavefronts of equal <tt>x + y + z</tt>. Cells in the same wavefront do not
+			/// depend on each other and are processed in parallel. The results are identical to
+			/// \ref preconditioner_type::modified_incomplete_cholesky.
+			modified_incomplete_cholesky_wavefront,
+			/// A geometric multigrid V-cycle with red-black Gauss-Seidel smoothing. The number of iterations stays
+			/// mostly constant as the resolution increases, and all smoothing passes run in parallel.
+			multigrid
+		};
+
 		/// Additional data for each cell.
 		struct cell_data {
 			/// Initializes all members to zero.
@@ -24,23 +49,122 @@ namespace fluid {
 				fluid_ypos : 1, ///< Indicates whether the next cell in the Y direction is a fluid cell.
 				fluid_zpos : 1; ///< Indicates whether the next cell in the Z direction is a fluid cell.
 		};
+		/// The neighbors of a fluid cell, stored so that the kernels of the solver do not need to look up
+		/// \ref _fluid_cell_indices or branch on the cell types.
+		struct neighbor_data {
+			/// Indices of the neighbors in the -X, -Y, -Z, +X, +Y, and +Z directions. Neighbors that are not coupled
+			/// to this cell have the index of this cell itself, so that they can be accessed without branching.
+			std::uint32_t indices[6];
+			std::uint32_t mask; ///< Bit \p i is set if the <tt>i</tt>-th neighbor is coupled to this cell.
+		};
 
-		/// Initializes this solver given the \ref fluid_grid.
-		explicit pressure_solver(simulation&, const std::vector<vec3s>&);
-
-		/// Solves for the pressure.
+		/// Solves for the pressure of the given fluid cells. The simulation and the list of fluid cells must be kept
+		/// alive until \ref apply_pressure() is called.
 		///
-		/// \return The pressure vector, the residual, and the number of iterations.
-		[[nodiscard]] std::tuple<std::vector<double>, double, std::size_t> solve(double dt);
-		/// Applies the pressure by updating the velocity field.
+		/// \return The pressure vector, the residual, and the number of iterations. The pressure vector is owned by
+		///         this solver and is only valid until the next call to this function.
+		[[nodiscard]] std::tuple<std::vector<double>&, double, std::size_t> solve(
+			basic_simulation<Scalar>&, const std::vector<vec3s> &fluid_cells, double dt
+		);
+		/// Applies the pressure by updating the velocity field of the simulation passed to the last call to
+		/// \ref solve().
 		void apply_pressure(double dt, const std::vector<double>&) const;
 
+		/// Returns the raw indices of the fluid cells of the last solve. Together with \ref get_last_pressure(),
+		/// this is the state used by \ref warm_start.
+		[[nodiscard]] const std::vector<std::size_t> &get_last_fluid_cells() const {
+			return _indexed_cells;
+		}
+		/// Returns the pressure of each cell in \ref get_last_fluid_cells() computed by the last solve.
+		[[nodiscard]] const std::vector<double> &get_last_pressure() const {
+			return _p;
+		}
+		/// Restores the state returned by \ref get_last_fluid_cells() and \ref get_last_pressure(), so that the
+		/// next solve is warm started exactly as it would have been by the solve that produced them.
+		///
+		/// \param grid_size The size of the simulation grid.
+		/// \param cells Raw indices of the fluid cells.
+		/// \param pressure The pressure of each fluid cell.
+		void set_last_pressure(vec3s grid_size, std::vector<std::size_t> cells, std::vector<double> pressure);
+
+		/// Returns the number of bytes currently allocated by this solver.
+		[[nodiscard]] std::size_t get_allocated_bytes() const;
+		/// Returns the wall time, in seconds, that the last call to \ref solve() spent building the linear system
+		/// and the preconditioner before starting the conjugate gradient iterations.
+		[[nodiscard]] double get_last_setup_seconds() const {
+			return _last_setup_seconds;
+		}
+
 		double
 			tau = 0.97, ///< The tau value.
 			sigma = 0.25, ///< The sigma value.
 			tolerance = 1e-6; ///< The tolerance for terminating the algorithm.
 		std::size_t max_iterations = 200; ///< The maximum number of iterations.
+		/// If \p true, the solve starts from the pressure computed by the previous solve instead of from zero.
+		/// Pressure values are carried over by cell position; cells that were not fluid cells previously start at
+		/// zero. This usually saves many iterations, but changes the results of the solve, so it is disabled by
+		/// default.
+		bool warm_start = false;
+		/// The preconditioner.
+		preconditioner_type preconditioner = preconditioner_type::modified_incomplete_cholesky;
+		/// The number of pre- and post-smoothing iterations in each level of the multigrid V-cycle.
+		std::size_t multigrid_smoothing_iterations = 2;
+		/// The number of symmetric Gauss-Seidel iterations used to solve the coarsest multigrid level.
+		std::size_t multigrid_coarsest_iterations = 10;
+		/// If \p true, the conjugate gradient iterations are carried out in single precision, and their results are
+		/// refined using residuals computed in double precision. Each refinement solves for a correction until its
+		/// residual is reduced by \ref mixed_precision_relative_tolerance.
+		bool mixed_precision = false;
+		/// The factor by which each single-precision solve reduces the residual in mixed precision mode.
+		double mixed_precision_relative_tolerance = 1e-4;
+		/// The maximum number of double-precision refinements in mixed precision mode.
+		std::size_t max_refinement_iterations = 4;
 	protected:
+		/// A read-only view of the linear system on one multigrid level. The finest level refers to the matrix of
+		/// the solver itself.
+		struct _level_view {
+			const grid3<std::size_t> &indices; ///< The index of each cell in \ref cells.
+			const std::vector<vec3s> &cells; ///< All fluid cells on this level.
+			const std::vector<cell_data> &a; ///< The matrix A on this level.
+			double scale; ///< The coefficient that \ref a should be scaled by.
+		};
+		/// Vectors used by the conjugate gradient method.
+		///
+		/// \tparam T The scalar type.
+		template <typename T> struct _pcg_vectors {
+			std::vector<T>
+				correction, ///< The solution of the correction equation in mixed precision mode.
+				r, ///< The residual.
+				z, ///< The auxiliary vector z.
+				s, ///< The search vector s.
+				q_scratch; ///< Scratch space used when applying the preconditioner.
+
+			/// Returns the number of bytes allocated by these vectors.
+			[[nodiscard]] std::size_t get_allocated_bytes() const {
+				return
+					(correction.capacity() + r.capacity() + z.capacity() + s.capacity() + q_scratch.capacity()) *
+					sizeof(T);
+			}
+		};
+		/// A coarse level of the multigrid hierarchy. Each coarse cell covers 2x2x2 cells on the finer level.
+		struct _multigrid_level {
+			grid3<mac_grid::cell::type> types; ///< The type of each cell on this level.
+			grid3<std::size_t> indices; ///< The index of each cell in \ref cells.
+			std::vector<vec3s> cells; ///< All fluid cells on this level, in the order they're stored in the grid.
+			std::vector<cell_data> a; ///< The matrix A on this level.
+			std::vector<double>
+				x, ///< The solution on this level.
+				b, ///< The right hand side on this level.
+				residual; ///< Scratch space for the residual.
+			double scale = 0.0; ///< The coefficient that \ref a should be scaled by.
+
+			/// Returns a \ref _level_view of this level.
+			[[nodiscard]] _level_view view() const {
+				return _level_view{ indices, cells, a, scale };
+			}
+		};
+
+
 		/// Indicates that a cell is not a fluid cell and does not have an index in \ref _fluid_cells.
 		constexpr static std::size_t _not_a_fluid_cell = std::numeric_limits<std::size_t>::max();
 
@@ -50,49 +174,201 @@ namespace fluid {
 		std::vector<cell_data> _a;
 		/// The index of each cell in \ref _fluid_cells. Non-fluid cells have the value \ref _not_a_fluid_cell.
 		grid3<std::size_t> _fluid_cell_indices;
+		/// Raw indices of all cells in \ref _fluid_cell_indices that are not \ref _not_a_fluid_cell, so that they
+		/// can be reset without clearing the entire grid.
+		std::vector<std::size_t> _indexed_cells;
+		std::vector<double>
+			_b, ///< The vector b.
+			_precon, ///< The preconditioner.
+			_p, ///< The pressure.
+			_initial_p, ///< The initial guess of the pressure, when warm starting.
+			_partial_sums; ///< The sum of each chunk in \ref _sum_chunks().
+		std::vector<float> _precon_float; ///< \ref _precon in single precision, used in mixed precision mode.
+		_pcg_vectors<double> _double_vectors; ///< Conjugate gradient vectors in double precision.
+		_pcg_vectors<float> _float_vectors; ///< Conjugate gradient vectors in single precision.
 		double _a_scale = 0.0; ///< The coefficient that \ref _a should be scaled by.
+		double _last_setup_seconds = 0.0; ///< The value returned by \ref get_last_setup_seconds().
 		/// The complete list of cells that contain fluid, sorted in the order they're stored in the grid.
-		const std::vector<vec3s> &_fluid_cells;
-		simulation &_sim; ///< The simulation.
+		const std::vector<vec3s> *_fluid_cells = nullptr;
+		basic_simulation<Scalar> *_sim = nullptr; ///< The simulation.
+
+		std::vector<neighbor_data> _neighbors; ///< The neighbors of all fluid cells.
+		/// Indices of all fluid cells, sorted by the sum of their coordinates.
+		std::vector<std::size_t> _wavefront_cells;
+		/// The index in \ref _wavefront_cells of the first cell of each wavefront. This contains one more element
+		/// than there are wavefronts.
+		std::vector<std::size_t> _wavefront_begin;
+		std::vector<_multigrid_level> _coarse_levels; ///< Coarse levels of the multigrid preconditioner.
+		/// Coarsening stops once the grid is at most this large along all axes.
+		constexpr static std::size_t _coarsest_level_size = 4;
+		/// The number of terms in each chunk of \ref _sum_chunks().
+		constexpr static std::size_t _sum_chunk_size = 4096;
 
 		/// Returns the fluid cell index of a neighboring cell in the negative x-, y-, or z-direction.
 		template <std::size_t Dim> [[nodiscard]] std::size_t _get_neg_neighbor_index(vec3s v) const {
-			if (v[Dim] > 0) {
-				return _fluid_cell_indices(v - vec3s::axis<Dim>());
-			}
-			return _not_a_fluid_cell;
+			return _get_neg_neighbor_index<Dim>(_fluid_cell_indices, v);
 		}
 		/// Returns the fluid cell index of a neighboring cell in the positive x-, y-, or z-direction.
 		template <std::size_t Dim> [[nodiscard]] std::size_t _get_pos_neighbor_index(vec3s v) const {
-			if (v[Dim] + 1 < _sim.grid().grid().get_size()[Dim]) {
-				return _fluid_cell_indices(v + vec3s::axis<Dim>());
-			}
-			return _not_a_fluid_cell;
+			return _get_pos_neighbor_index<Dim>(_fluid_cell_indices, v);
 		}
 
-		/// Fills \ref _fluid_cell_indices.
+		/// Maps the pressure of the previous solve onto the current fluid cells and stores the result in
+		/// \ref _initial_p. This must be called before \ref _compute_fluid_cell_indices().
+		///
+		/// \return Whether any previous pressure value has been carried over.
+		bool _map_previous_pressure();
+		/// Fills \ref _fluid_cell_indices, resizing it if the size of the simulation grid has changed.
 		void _compute_fluid_cell_indices();
 
 		/// Computes the matrix A.
 		void _compute_a_matrix();
-		/// Computes the vector b.
-		[[nodiscard]] std::vector<double> _compute_b_vector() const;
+		/// Computes \ref _neighbors. This requires \ref _a to have been computed.
+		void _compute_neighbors();
+		/// Returns 1 if the given neighbor is coupled to the cell, and 0 otherwise.
+		template <typename T> [[nodiscard]] FLUID_FORCEINLINE static T _coupling(
+			const neighbor_data &nb, std::size_t i
+		) {
+			return static_cast<T>((nb.mask >> i) & 1u);
+		}
+		/// Computes the given row of A times the given vector, without scaling by \ref _a_scale.
+		template <typename T> [[nodiscard]] FLUID_FORCEINLINE T _apply_a_at(
+			std::size_t i, const std::vector<T> &v
+		) const {
+			const neighbor_data &nb = _neighbors[i];
+			T value = static_cast<T>(_a[i].nonsolid_neighbors) * v[i];
+			for (std::size_t k = 0; k < 6; ++k) {
+				value -= _coupling<T>(nb, k) * v[nb.indices[k]];
+			}
+			return value;
+		}
+		/// Computes the vector b and stores it in \ref _b.
+		void _compute_b_vector();
 
-		/// Computes the preconditioner vector. The input vector must have enough space (i.e., must be as long as
-		/// \ref _a).
-		[[nodiscard]] std::vector<double> _compute_preconditioner() const;
+		/// Computes the element of the preconditioner vector that corresponds to the given cell. Elements of all
+		/// neighboring cells in the negative directions must have been computed.
+		void _compute_preconditioner_at(std::size_t);
+		/// Computes the preconditioner vector and stores it in \ref _precon.
+		void _compute_preconditioner();
+		/// Fills \ref _wavefront_cells and \ref _wavefront_begin.
+		void _compute_wavefronts();
+		/// Computes the preconditioner vector in parallel using wavefronts.
+		void _compute_preconditioner_wavefront();
+		/// Returns the preconditioner vector of the given precision.
+		template <typename T> [[nodiscard]] const std::vector<T> &_get_preconditioner() const {
+			if constexpr (std::is_same_v<T, float>) {
+				return _precon_float;
+			} else {
+				return _precon;
+			}
+		}
+		/// Solves for the element of \p q that corresponds to the given cell in <tt>L q = r</tt>.
+		template <typename T> void _forward_substitute_at(
+			std::size_t, std::vector<T> &q, const std::vector<T> &precon, const std::vector<T> &r
+		) const;
+		/// Solves for the element of \p z that corresponds to the given cell in <tt>L^T z = q</tt>.
+		template <typename T> void _backward_substitute_at(
+			std::size_t, std::vector<T> &z, const std::vector<T> &precon, const std::vector<T> &q
+		) const;
 		/// Multiplies the given vector by the preconditioner matrix. The input vectors must have enough space.
-		void _apply_preconditioner(
-			std::vector<double> &z, std::vector<double> &q_scratch,
-			const std::vector<double> &precon, const std::vector<double> &r
+		template <typename T> void _apply_preconditioner(
+			std::vector<T> &z, std::vector<T> &q_scratch, const std::vector<T> &precon, const std::vector<T> &r
 		) const;
-		
-		/// Multiplies the given vector by the A matrix. The out vector must have enough space.
-		void _apply_a(std::vector<double>&, const std::vector<double>&) const;
+		/// \ref _apply_preconditioner() in parallel using wavefronts.
+		template <typename T> void _apply_preconditioner_wavefront(
+			std::vector<T> &z, std::vector<T> &q_scratch, const std::vector<T> &precon, const std::vector<T> &r
+		) const;
+
+		/// Returns the fluid cell index of a neighboring cell in the negative x-, y-, or z-direction using the given
+		/// index grid.
+		template <std::size_t Dim> [[nodiscard]] static std::size_t _get_neg_neighbor_index(
+			const grid3<std::size_t> &indices, vec3s v
+		) {
+			if (v[Dim] > 0) {
+				return indices(v - vec3s::axis<Dim>());
+			}
+			return _not_a_fluid_cell;
+		}
+		/// Returns the fluid cell index of a neighboring cell in the positive x-, y-, or z-direction using the given
+		/// index grid.
+		template <std::size_t Dim> [[nodiscard]] static std::size_t _get_pos_neighbor_index(
+			const grid3<std::size_t> &indices, vec3s v
+		) {
+			if (v[Dim] + 1 < indices.get_size()[Dim]) {
+				return indices(v + vec3s::axis<Dim>());
+			}
+			return _not_a_fluid_cell;
+		}
 
+		/// Builds all levels in \ref _coarse_levels from the finest level.
+		void _build_multigrid_levels();
+		/// Returns a view of the given multigrid level. Level 0 is the finest level.
+		[[nodiscard]] _level_view _get_level_view(std::size_t) const;
+		/// Returns the sum of the values of all fluid neighbors of the given cell, i.e., the negated off-diagonal
+		/// part of one row of A without \ref _level_view::scale.
+		template <typename T> [[nodiscard]] static T _sum_neighbors(
+			const _level_view&, std::size_t, const std::vector<T>&
+		);
+		/// Runs one red-black Gauss-Seidel pass over cells of the given color, i.e., cells where the sum of all
+		/// coordinates modulo 2 equals \p color.
+		template <typename T> static void _smooth(
+			const _level_view&, std::vector<T> &x, const std::vector<T> &b, std::size_t color
+		);
+		/// Solves the given level using symmetric Gauss-Seidel iterations, starting from zero.
+		template <typename T> static void _solve_coarsest(
+			const _level_view&, std::vector<T> &x, const std::vector<T> &b, std::size_t iterations
+		);
+		/// Computes <tt>b - A x</tt> on the given level.
+		template <typename T> static void _compute_residual(
+			const _level_view&, std::vector<T> &residual, const std::vector<T> &x, const std::vector<T> &b
+		);
+		/// Restricts the residual on the given level to the right hand side of the next coarser level.
+		template <typename T> static void _restrict(
+			const _level_view&, const std::vector<T> &residual, _multigrid_level &coarse
+		);
+		/// Adds the solution of the next coarser level to the solution on the given level.
+		template <typename T> static void _prolong(
+			const _level_view&, std::vector<T> &x, const _multigrid_level &coarse
+		);
+		/// Runs a V-cycle starting from the given level, with a zero initial guess. Coarse levels are always
+		/// processed in double precision.
+		template <typename T> void _v_cycle(
+			std::size_t level, std::vector<T> &x, const std::vector<T> &b, std::vector<T> &residual
+		);
+		/// Applies the selected preconditioner to \p r, storing the result in \p z.
+		template <typename T> void _precondition(
+			std::vector<T> &z, const std::vector<T> &r, std::vector<T> &q_scratch
+		);
+
+		/// Runs the preconditioned conjugate gradient method on <tt>A x = b</tt>. The residual
+		/// <tt>b - A x</tt> of the initial guess must have been stored in \ref _pcg_vectors::r.
+		///
+		/// \return The residual and the number of iterations.
+		template <typename T> std::pair<double, std::size_t> _solve_pcg(
+			std::vector<T> &x, _pcg_vectors<T>&, double tolerance, std::size_t iterations
+		);
+
+		/// Multiplies the given vector by the A matrix. The out vector must have enough space.
+		template <typename T> void _apply_a(std::vector<T>&, const std::vector<T>&) const;
+		/// Multiplies the given vector by the A matrix and returns the dot product of the input and the result.
+		template <typename T> [[nodiscard]] double _apply_a_and_dot(std::vector<T>&, const std::vector<T>&);
+		/// Computes <tt>x += alpha * s</tt> and <tt>r -= alpha * z</tt> and returns the maximum absolute value in r.
+		template <typename T> [[nodiscard]] static double _update_solution_and_residual(
+			std::vector<T> &x, _pcg_vectors<T>&, double alpha
+		);
+		/// Computes the dot product of the two vectors in parallel. The result is accumulated in double precision.
+		template <typename T> [[nodiscard]] double _dot(const std::vector<T>&, const std::vector<T>&);
+		/// Computes the sum of <tt>term(i)</tt> for all \p i below \p count in parallel. Chunks of
+		/// \ref _sum_chunk_size terms are summed independently and their sums are then added in order, so that the
+		/// result does not depend on the number of threads.
+		template <typename Term> [[nodiscard]] double _sum_chunks(std::size_t count, Term &&term);
 		/// Calculates <tt>a + s * b</tt>. The three vectors must have the same length.
-		static void _muladd(
-			std::vector<double>&, const std::vector<double> &a, const std::vector<double> &b, double s
+		template <typename T> static void _muladd(
+			std::vector<T>&, const std::vector<T> &a, const std::vector<T> &b, double s
 		);
+		/// Computes the maximum absolute value of the elements of the given vector in parallel.
+		[[nodiscard]] static double _max_abs_element(const std::vector<double>&);
 	};
+
+	using pressure_solver = basic_pressure_solver<double>; ///< The pressure solver of double precision simulations.
 }
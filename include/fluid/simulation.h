@@ -7,39 +7,35 @@
 #include <deque>
 #include <functional>
 #include <memory>
+#include <filesystem>
 
 #include <pcg_random.hpp>
 
 #include "misc.h"
 #include "mac_grid.h"
+#include "pressure_solver.h"
+#include "solid_distance_field.h"
+#include "time_step_statistics.h"
+#include "math/counter_rng.h"
+#include "data_structures/compact_particle_storage.h"
 #include "data_structures/space_hashing.h"
 #include "data_structures/source.h"
 #include "data_structures/grid.h"
+#include "data_structures/sparse_grid.h"
+#include "data_structures/particle_storage.h"
 
 namespace fluid {
 	/// A fluid simulation.
-	class simulation {
+	///
+	/// \tparam T The scalar type of particles, grid velocities, and all parameters. With \p float, particles and
+	///           the grid take half as much memory, and twice as many particles are processed by each SIMD
+	///           instruction when transferring velocities from the grid. The pressure solve is always carried out
+	///           in double precision or in mixed precision.
+	template <typename T> class basic_simulation {
 	public:
-		/// A particle.
-		struct particle {
-			vec3d
-				position, ///< The position of this particle.
-				velocity, ///< The velocity of this particle.
-				cx, ///< The c vector used in APIC.
-				cy, ///< The c vector used in APIC.
-				cz; ///< The c vector used in APIC.
-			/// The final position of this particle in the *previous* time step. This is used for collision
-			/// detection.
-			vec3d old_position;
-			std::size_t raw_cell_index = 0; ///< Raw index of the cell this particle's in.
-
-			/// Computes the cell index of this particle. This function assumes that the computation won't result in
-			/// underflow of the cell index.
-			vec3s compute_cell_index(vec3d grid_offset, double cell_size) const;
-			/// Computes the cell index and fraction position inside the cell of this particle. This function assumes
-			/// that the computation won't result in underflow of the cell index.
-			std::pair<vec3s, vec3d> compute_cell_index_and_position(vec3d grid_offset, double cell_size) const;
-		};
+		using scalar_type = T; ///< The scalar type.
+		using vec3_type = vec3<T>; ///< The vector type.
+		using particle = basic_particle<T>; ///< A particle.
 		/// The simulation method.
 		enum class method : unsigned char {
 			pic, ///< PIC.
@@ -57,9 +53,9 @@ namespace fluid {
 		void resize(vec3s);
 
 		/// Moves the simulation forward in time by the given amount.
-		void update(double);
+		void update(T);
 		/// Takes a single timestep using the given delta time.
-		void time_step(double);
+		void time_step(T);
 		/// Takes a single timestep using the default CFL number.
 		void time_step();
 
@@ -73,38 +69,38 @@ namespace fluid {
 		/// Seeds the given cell so that it has at lest the given number of particles. \ref _space_hash must be valid
 		/// for this function to be effective. This function updates \ref _cell_particles::count but does **not**
 		/// insert the particles at the right position.
-		void seed_cell(vec3s cell, vec3d velocity, std::size_t density = default_seeding_density);
+		void seed_cell(vec3s cell, vec3<T> velocity, std::size_t density = default_seeding_density);
 
 		/// Seeds the given region using the given predicate that indicates whether a point is inside the region to
 		/// be seeded.
 		template <typename Func> void seed_func(
 			vec3s start, vec3s size, const Func &pred,
-			vec3d velocity = vec3d(), std::size_t density = default_seeding_density
+			vec3<T> velocity = vec3<T>(), std::size_t density = default_seeding_density
 		) {
-			double small_cell_size = cell_size / density;
-			std::uniform_real_distribution<double> dist(0.0, small_cell_size);
+			T small_cell_size = cell_size / density;
+			std::uniform_real_distribution<T> dist(0, small_cell_size);
 			vec3s end(vec_ops::apply<vec3s>(
 				static_cast<const std::size_t & (*)(const std::size_t&, const std::size_t&)>(std::min),
-				start + size, grid().grid().get_size()
+				start + size, grid().get_size()
 				));
 			for (std::size_t z = start.z; z < end.z; ++z) {
 				for (std::size_t y = start.y; y < end.y; ++y) {
 					for (std::size_t x = start.x; x < end.x; ++x) {
-						vec3d cell_offset = vec3d(vec3s(x, y, z)) * cell_size;
-						std::size_t cell_index = grid().grid().index_to_raw(vec3s(x, y, z));
+						vec3<T> cell_offset = vec3<T>(vec3s(x, y, z)) * cell_size;
+						std::size_t cell_index = grid().index_to_raw(vec3s(x, y, z));
 						for (std::size_t sx = 0; sx < density; ++sx) {
 							for (std::size_t sy = 0; sy < density; ++sy) {
 								for (std::size_t sz = 0; sz < density; ++sz) {
-									vec3d position =
+									vec3<T> position =
 										grid_offset + cell_offset +
-										vec3d(vec3s(sx, sy, sz)) * small_cell_size +
-										vec3d(dist(random), dist(random), dist(random));
+										vec3<T>(vec3s(sx, sy, sz)) * small_cell_size +
+										vec3<T>(dist(random), dist(random), dist(random));
 									if (pred(position)) {
 										particle p;
 										p.old_position = p.position = position;
 										p.velocity = velocity;
 										p.raw_cell_index = cell_index;
-										_particles.emplace_back(p);
+										_particles.push_back(p);
 									}
 								}
 							}
@@ -115,80 +111,194 @@ namespace fluid {
 		}
 		/// Seeds the simulation with water particles in the given box.
 		void seed_box(
-			vec3d start, vec3d size, vec3d velocity = vec3d(), std::size_t density = default_seeding_density
+			vec3<T> start, vec3<T> size, vec3<T> velocity = vec3<T>(), std::size_t density = default_seeding_density
 		);
 		/// Seeds the simulation with water particles in the given sphere.
 		void seed_sphere(
-			vec3d center, double radius, vec3d velocity = vec3d(), std::size_t density = default_seeding_density
+			vec3<T> center, T radius, vec3<T> velocity = vec3<T>(), std::size_t density = default_seeding_density
 		);
 
+		/// Encodes all particles into the given compact storage using the current grid parameters. This is lossy;
+		/// see \ref compact_particle_storage.
+		void encode_particles(compact_particle_storage&) const;
+		/// Replaces all particles with the ones decoded from the given compact storage, which must have been
+		/// encoded with the current grid parameters. \ref particle::raw_cell_index is valid for the decoded
+		/// particles, so \ref hash_particles() can be called directly afterwards.
+		void decode_particles(const compact_particle_storage&);
+
+		/// Saves the state of this simulation to the given checkpoint file. This includes all parameters,
+		/// particles, the grid, sources and sinks, the random number generators, and all state carried between
+		/// time steps, so that a simulation restored with \ref load_checkpoint() continues exactly as this one
+		/// would, regardless of the number of threads either of them uses. Callbacks and statistics are not saved.
+		/// See \ref checkpoint_header for the file format.
+		///
+		/// \return Whether the file has been written successfully.
+		bool save_checkpoint(const std::filesystem::path&) const;
+		/// Restores the state saved by \ref save_checkpoint(), replacing all sources and sinks. The file must have
+		/// been saved by a simulation of the same scalar type, on a machine with the same byte order. This
+		/// simulation is not modified if the file cannot be loaded. There is no need to hash the particles
+		/// afterwards, since that is done at the start of each time step.
+		///
+		/// \return Whether the file has been loaded successfully.
+		bool load_checkpoint(const std::filesystem::path&);
+
 		/// Converts a world position to a cell index, clamping it to fit in the grid.
-		[[nodiscard]] vec3s world_position_to_cell_index(vec3d) const;
+		[[nodiscard]] vec3s world_position_to_cell_index(vec3<T>) const;
 		/// Converts a world position to a cell index without clamping.
-		[[nodiscard]] vec3s world_position_to_cell_index_unclamped(vec3d) const;
+		[[nodiscard]] vec3s world_position_to_cell_index_unclamped(vec3<T>) const;
 
 		/// Returns the CFL condition value.
-		[[nodiscard]] double cfl() const;
+		[[nodiscard]] T cfl() const;
+		/// Returns the number of bytes currently allocated by this simulation, including the pressure solver.
+		[[nodiscard]] std::size_t get_allocated_bytes() const;
+		/// Returns the statistics of the last time step.
+		[[nodiscard]] const time_step_statistics &get_last_statistics() const {
+			return _last_statistics;
+		}
+		/// Returns the statistics of at most \ref statistics_history_length recent time steps, oldest first.
+		[[nodiscard]] const std::deque<time_step_statistics> &get_statistics_history() const {
+			return _statistics_history;
+		}
+		/// Returns the number of time steps that have been taken.
+		[[nodiscard]] std::uint64_t get_time_step_index() const {
+			return _time_step_index;
+		}
 
 		/// Returns the velocity grid.
-		[[nodiscard]] mac_grid &grid() {
+		[[nodiscard]] basic_mac_grid<T> &grid() {
 			return _grid;
 		}
 		/// \overload
-		[[nodiscard]] const mac_grid &grid() const {
+		[[nodiscard]] const basic_mac_grid<T> &grid() const {
 			return _grid;
 		}
-		/// Returns the list of particles. Do not store references to these particles.
-		[[nodiscard]] std::vector<particle> &particles() {
+		/// Returns the particles. Do not store references to these particles.
+		[[nodiscard]] basic_particle_storage<T> &particles() {
 			return _particles;
 		}
 		/// \overload
-		[[nodiscard]] const std::vector<particle> &particles() const {
+		[[nodiscard]] const basic_particle_storage<T> &particles() const {
 			return _particles;
 		}
+		/// Returns the pressure solver. Its parameters can be modified freely between time steps.
+		[[nodiscard]] basic_pressure_solver<T> &solver() {
+			return _solver;
+		}
+		/// \overload
+		[[nodiscard]] const basic_pressure_solver<T> &solver() const {
+			return _solver;
+		}
 
 		// callbacks
 		// the order in which they're defined is the order in which they'll be called
 		/// The function that will be called as soon as a new time step begins. The parameter is the delta time.
-		std::function<void(double)> pre_time_step_callback;
+		std::function<void(T)> pre_time_step_callback;
 		/// The function that will be called in each time step after particles have been advected. The parameter is
 		/// the delta time.
-		std::function<void(double)> post_advection_callback;
+		std::function<void(T)> post_advection_callback;
 		/// The function that will be called in each time step after particles have been hashed and their velocities
 		/// have been transferred to the grid. The parameter is the delta time.
-		std::function<void(double)> post_particle_to_grid_transfer_callback;
+		std::function<void(T)> post_particle_to_grid_transfer_callback;
 		/// The function that will be called in each time step after gravity has been added to the velocities. The
 		/// parameter is the delta time.
-		std::function<void(double)> post_gravity_callback;
+		std::function<void(T)> post_gravity_callback;
 		/// The function that will be called in each time step after solving for pressure but before the pressure is
 		/// applied. The parameter is the delta time, while the rest correspond to the return values of
 		/// \ref pressure_solver::solve().
-		std::function<void(double, std::vector<double>&, double, std::size_t)> post_pressure_solve_callback;
+		std::function<void(T, std::vector<double>&, double, std::size_t)> post_pressure_solve_callback;
 		/// The function that will be called in each time step after pressure has been applied. The parameter is the
 		/// delta time.
-		std::function<void(double)> post_apply_pressure_callback;
+		std::function<void(T)> post_apply_pressure_callback;
 		/// The function that will be called in each time step after particle positions have been corrected. The
 		/// parameter is the delta time.
-		std::function<void(double)> post_correction_callback;
+		std::function<void(T)> post_correction_callback;
 		/// The function that will be called in each time step after velocities have been transferred from the grid
 		/// to the particles. The parameter is the delta time.
-		std::function<void(double)> post_grid_to_particle_transfer_callback;
+		std::function<void(T)> post_grid_to_particle_transfer_callback;
 
 		pcg32 random; ///< The random engine for the simulation.
-		std::vector<std::unique_ptr<source>> sources;
-		vec3d
+		/// The key of the counter-based random numbers used during time steps. These random numbers only depend on
+		/// this key, the time step index, and particle indices, so results do not depend on the number of threads.
+		std::uint64_t random_key = 0;
+		std::vector<std::unique_ptr<source>> sources; ///< Fluid sources.
+		std::vector<std::unique_ptr<sink>> sinks; ///< Fluid sinks.
+		vec3<T>
 			grid_offset, ///< The offset of the grid's origin.
 			gravity; ///< The gravity.
-		double
+		T
 			cfl_number = 3.0, ///< The CFL number.
 			blending_factor = 1.0, ///< The factor used when blending different method together.
-			cell_size = std::numeric_limits<double>::quiet_NaN(), ///< The size of each grid cell.
+			cell_size = std::numeric_limits<T>::quiet_NaN(), ///< The size of each grid cell.
 			density = 1.0, ///< The density of the fluid.
 			boundary_skin_width = 0.1, ///< The "skin width" at boundaries to prevent particles from "sticking".
 			correction_stiffness = 5.0; ///< The stiffness used when correcting particle positions.
 		std::size_t velocity_extrapolation_iterations = 1; ///< The number of velocity extrapolation iterations.
+		/// The number of recent time steps whose statistics are kept in \ref get_statistics_history().
+		std::size_t statistics_history_length = 256;
+		/// If \p true, velocities are extrapolated at least as far as the fastest particle travels in one time
+		/// step, plus one cell for the interpolation stencil. \ref velocity_extrapolation_iterations is then only
+		/// the minimum distance.
+		bool adaptive_velocity_extrapolation = false;
+		/// If \p true, collisions are detected by marching each particle through the grid along its displacement,
+		/// which also catches solids that are thin enough for particles to tunnel through in one time step.
+		/// Otherwise particles are pushed out of solids along the gradient of \ref _solid_sdf, which is cheaper
+		/// but only approximate near the edges and corners of solids.
+		bool continuous_collision_detection = true;
+		/// If this is not zero, particles are only kept within this many cells of the liquid surface. Deeper liquid
+		/// cells have no particles; the liquid region is tracked with a level set, and their velocities are advected
+		/// on the grid. This should be at least 3, so that the transfer stencils of particles near the bottom of the
+		/// band do not reach deep cells. Note that the level set is recomputed and advected over the whole grid in
+		/// every time step, so this adds a per-step cost proportional to the number of grid cells, not just the
+		/// number of cells near the liquid; it pays off when the liquid is deep compared to the band.
+		std::size_t narrow_band_width = 0;
+		/// If \p true, the number of particles in each cell is kept between \ref min_particles_per_cell and
+		/// \ref max_particles_per_cell in each time step.
+		bool particle_density_control = false;
+		std::size_t
+			/// The minimum number of particles in interior cells when \ref particle_density_control is enabled.
+			min_particles_per_cell = 4,
+			/// The maximum number of particles in a cell when \ref particle_density_control is enabled.
+			max_particles_per_cell = 16;
 		method simulation_method = method::apic; ///< The simulation method.
 	private:
+		/// The thickness, in cells, of the slabs used when transferring velocities to the grid and when correcting
+		/// particle positions in parallel. This must be at least 2 so that slabs of the same parity never write to
+		/// the same face.
+		constexpr static std::size_t _transfer_slab_thickness = 2;
+
+		/// When particle storage needs to grow for new particles, capacity is reserved for this many more time steps of
+		/// inflow at the current rate.
+		constexpr static std::size_t _source_reserve_steps = 32;
+		/// Random number streams used in a time step, stored in the high bits of the counter so that different
+		/// uses never share random numbers.
+		enum class _random_stream : std::uint64_t {
+			position_correction, ///< Random forces between coincident particles.
+			particle_seeding ///< Positions of particles spawned by sources and density control.
+		};
+
+		/// A cell that new particles are spawned in during this time step.
+		struct _particle_seed {
+			vec3<T> velocity; ///< The velocity of the new particles.
+			std::size_t
+				raw_cell = 0, ///< Raw index of the cell.
+				/// The number of particles in the cell before these particles are added. This identifies the random
+				/// numbers used by the new particles.
+				first_in_cell = 0,
+				count = 0; ///< The number of new particles in the cell.
+		};
+
+		/// Scratch space of \ref hash_particles(), kept across calls so that hashing does not allocate.
+		struct _hash_buffers {
+			/// The histogram of each chunk of particles over layers of cells, and then the offset of the particles
+			/// of each chunk in each layer.
+			std::vector<std::size_t> chunk_offsets;
+			/// The index of the first particle of each layer in \ref layer_sorted, and the number of particles.
+			std::vector<std::size_t> layer_begin;
+			std::vector<std::size_t> layer_sorted; ///< Indices of all particles, sorted by layer.
+			std::vector<std::size_t> order; ///< Indices of all particles, sorted by cell.
+			std::vector<std::vector<std::size_t>> layer_fluid_cells; ///< The cells of each layer with particles.
+		};
+
 		/// Information about all particles in a cell.
 		struct _cell_particles {
 			std::size_t
@@ -196,26 +306,107 @@ namespace fluid {
 				count = 0; ///< The number of particles.
 		};
 
-		std::vector<particle> _particles; ///< All particles.
-		mac_grid
+		basic_particle_storage<T> _particles; ///< All particles.
+		basic_mac_grid<T>
 			_grid, ///< The grid.
-			_old_grid; ///< Grid that stores old velocities used for FLIP.
+			/// Grid that stores old velocities used for FLIP. Only the velocities of active cells are copied, and
+			/// the cell types are unused.
+			_old_grid;
+		basic_pressure_solver<T> _solver; ///< The pressure solver, which keeps its buffers across time steps.
+		/// Signed distance field of solid cells. This is updated at the start of each time step unless
+		/// \ref continuous_collision_detection is set, and is only recomputed when solid cells among the active
+		/// cells of the previous time step have changed.
+		solid_distance_field _solid_sdf;
 
 		/// Space hashing. This is computed by \ref hash_particles(). The way this is computed is that all particles
 		/// are sorted according to \ref particle::raw_cell_index, then particles in each cell are recorded in this
-		/// grid.
-		grid3<_cell_particles> _space_hash;
+		/// grid. Only tiles that contain particles are active.
+		sparse_grid<_cell_particles> _space_hash;
 		/// Cells that contain fluid particles. This is computed by \ref hash_particles().
 		std::vector<std::size_t> _fluid_cells;
+		/// Sum of kernel weights of each face. This is only used as scratch space when transferring velocities to
+		/// the grid.
+		grid3<vec3<T>> _face_weights;
+		/// Marks cells that have a valid velocity during velocity extrapolation. All entries are zero outside of
+		/// \ref _extrapolate_velocities().
+		grid3<unsigned char> _extrapolation_valid;
+
+		constexpr static unsigned char
+			_active_current = 1, ///< Flag of tiles and cells that are near particles in this time step.
+			_active_previous = 2; ///< Flag of tiles and cells that were near particles in the previous time step.
+		/// Flags of all tiles, using the tile layout of \ref _space_hash.
+		std::vector<unsigned char> _grid_tile_flags;
+		/// Raw indices of tiles that contain cells in \ref _active_cells.
+		std::vector<std::size_t> _active_grid_tiles;
+		/// Flags of all cells. Cells outside of \ref _active_grid_tiles have no flags set, except after the grid is
+		/// resized, when all cells are flagged so that the first time step processes the entire grid.
+		grid3<unsigned char> _active_cell_flags;
+		/// Scratch space used when dilating the set of fluid cells along the X and Y axes. Entries outside of
+		/// \ref _active_grid_tiles are always zero.
+		grid3<unsigned char> _band_scratch[2];
+		/// Raw indices of all cells that are processed by the grid stages of this time step. These are all cells that
+		/// are close enough to fluid cells in this time step or the previous one to be affected by particle
+		/// transfers or velocity extrapolation; cells only affected in the previous time step are included so that
+		/// velocities and cell types left behind by the fluid are reset.
+		std::vector<std::size_t> _active_cells;
 
-		/// Calls the callback function for all particles in the specified region.
+		std::uint64_t _time_step_index = 0; ///< The number of time steps that have been taken.
+		time_step_statistics _last_statistics; ///< Statistics of the last time step.
+		std::deque<time_step_statistics> _statistics_history; ///< Statistics of recent time steps.
+		/// Sorted indices of particles removed by sinks in this time step, whose slots are reused by sources.
+		std::vector<std::size_t> _free_particles;
+		std::vector<_particle_seed> _particle_seeds; ///< Cells that new particles are spawned in this time step.
+		_hash_buffers _hash_scratch; ///< Scratch space of \ref hash_particles().
+		/// The number of layers of cells that velocities are extrapolated to in this time step. This is computed at
+		/// the start of each time step from \ref velocity_extrapolation_iterations and
+		/// \ref adaptive_velocity_extrapolation.
+		std::size_t _extrapolation_distance = 1;
+
+		/// Returns the radius, in cells, of the band around fluid cells that is included in \ref _active_cells.
+		/// This covers the transfer stencil, particles moving to neighboring cells during position correction, and
+		/// velocity extrapolation.
+		[[nodiscard]] std::size_t _get_active_band_radius() const {
+			return _extrapolation_distance + 2;
+		}
+		constexpr static unsigned char
+			_deep_current = 1, ///< Flag of deep liquid cells in this time step.
+			_deep_previous = 2; ///< Flag of deep liquid cells in the previous time step.
+		/// Flags of deep liquid cells in narrow band mode, which are liquid cells more than
+		/// \ref narrow_band_width cells below the surface. These cells contain no particles.
+		grid3<unsigned char> _narrow_band_flags;
+		/// Signed distance to the liquid surface in cells, negative inside the liquid, advected to the end of this
+		/// time step. This is only computed in narrow band mode.
+		grid3<T> _liquid_phi;
+		/// The velocities of the faces of deep liquid cells, advected on the grid. These are used for faces that
+		/// receive no contribution from particles.
+		grid3<T> _deep_velocities[3];
+		/// Raw indices of all deep liquid cells in this time step in ascending order, gathered by
+		/// \ref _advect_narrow_band().
+		std::vector<std::size_t> _deep_cells;
+		/// Scratch space of \ref _advect_narrow_band() that holds the label of each cell.
+		grid3<unsigned char> _band_labels;
+		/// Scratch space of \ref _advect_narrow_band() that holds the squared distances to air and liquid cells.
+		grid3<double> _band_distances[2];
+		/// Scratch space of \ref _advect_narrow_band() that holds the level set before advection.
+		grid3<T> _band_phi;
+
+		/// Returns whether the cell with the given raw index is a deep liquid cell in this time step.
+		[[nodiscard]] bool _is_deep_liquid(std::size_t raw) const {
+			return narrow_band_width > 0 && (_narrow_band_flags[raw] & _deep_current) != 0;
+		}
+
+		/// Computes \ref _active_grid_tiles from the active tiles of \ref _space_hash, then \ref _active_cells
+		/// by dilating fluid cells inside those tiles one axis at a time.
+		void _update_active_cells();
+
+		/// Calls the callback function with the indices of all particles in the specified region.
 		template <typename Cb> void _for_all_nearby_particles(
 			vec3s center, vec3s diffmin, vec3s diffmax, Cb &&callback
 		) {
 			_space_hash.for_each_in_range_checked(
-				[this, &callback](vec3s, const _cell_particles &cell) {
+				[&callback](vec3s, const _cell_particles &cell) {
 					for (std::size_t c = cell.begin, i = 0; i < cell.count; ++c, ++i) {
-						callback(_particles[c]);
+						callback(c);
 					}
 				},
 				center, diffmin, diffmax
@@ -223,20 +414,20 @@ namespace fluid {
 		}
 
 		/// Returns the velocities of the negative direction faces of the given cell.
-		[[nodiscard]] static vec3d _get_negative_face_velocities(const mac_grid&, vec3s);
+		[[nodiscard]] static vec3<T> _get_negative_face_velocities(const basic_mac_grid<T>&, vec3s);
 		/// Zeros the velocities at the boundaries of the grid.
-		static void _remove_boundary_velocities(mac_grid&);
-
-		/// The kernel function used when transfering velocities to and from the grid. It is assumed that the input
-		/// vector has already been divided by \ref cell_size.
-		[[nodiscard]] FLUID_FORCEINLINE double _kernel(vec3d) const;
-		/// Computes the gradient of the kernel function. It is assumed that the input vector has already been divided by
-		/// \ref cell_size and has no coordinate that lies out of [-cell_size, cell_size].
-		[[nodiscard]] FLUID_FORCEINLINE vec3d _grad_kernel(vec3d) const;
+		static void _remove_boundary_velocities(basic_mac_grid<T>&);
 
 		/// Advects particles. Fluid sources that coerce particle velocities are processed here.
-		void _advect_particles(double);
+		void _advect_particles(T);
 
+		/// Transfers velocities from particles to the grid by scattering the velocity of each particle to the faces
+		/// around it, then normalizing the result and updating cell types. The grid is split into slabs along the Z
+		/// axis that are processed in parallel; since each particle only affects faces in neighboring cells,
+		/// processing every other slab at once guarantees that no two threads write to the same face.
+		///
+		/// \tparam Affine Whether to include the affine velocity used by APIC.
+		template <bool Affine> void _scatter_to_grid();
 		/// Transfers velocities from particles to the grid using PIC.
 		void _transfer_to_grid_pic();
 		/// Transfers velocities from particles to the grid using FLIP.
@@ -246,18 +437,24 @@ namespace fluid {
 		/// Transfers velocities from particles to the grid using \ref simulation_method.
 		void _transfer_to_grid();
 
+		/// Transfers velocities from the grid back to a group of consecutive particles. Each of the eight faces
+		/// around a particle is read directly from the grid for each velocity component, and the interpolation is
+		/// carried out for all particles in the group at once using the given lane type.
+		///
+		/// \tparam Method The transfer method.
+		/// \tparam Lane Either \p T, or a SIMD vector type whose lanes correspond to different particles.
+		/// \param first Index of the first particle in the group.
+		/// \param blend The blend factor used by FLIP.
+		template <method Method, typename Lane> void _transfer_from_grid_lanes(std::size_t first, T blend);
+		/// Transfers velocities from the grid back to all particles in parallel, in groups of particles that are as
+		/// large as the SIMD width.
+		template <method Method> void _transfer_from_grid_batched(T blend);
 		/// Transfers velocities from the grid back to particles using PIC.
 		void _transfer_from_grid_pic();
 		/// Transfers velocities from the grid back to particles using a blend between PIC and FLIP.
 		///
 		/// \param blend The blend factor. 1.0 means fully FLIP.
-		void _transfer_from_grid_flip(double blend);
-		/// Calculates the c vector.
-		[[nodiscard]] vec3d _calculate_c_vector(
-			double v000, double v001, double v010, double v011,
-			double v100, double v101, double v110, double v111,
-			double tx, double ty, double tz
-		) const;
+		void _transfer_from_grid_flip(T blend);
 		/// Transfers velocities from the grid back to particles using APIC.
 		void _transfer_from_grid_apic();
 		/// Transfers velocities from the grid back to particles using \ref simulation_method.
@@ -265,17 +462,55 @@ namespace fluid {
 
 		/// Adds spring forces between particles to reduce clumping. \ref _space_hash must have been filled before
 		/// this is called. This is taken from "Preserving Fluid Sheets with Adaptively Sampled Anisotropic
-		/// Particles". After this function returns, \ref particle::raw_cell_index and \ref _space_hash are **not**
-		/// valid.
-		void _correct_positions(double dt);
+		/// Particles". Each pair of nearby particles is visited once, by the cell of one of the two particles, and
+		/// the force is added to both particles. Cells are processed in slabs along the Z axis; since pairs only
+		/// span neighboring cells, processing every other slab at once guarantees that no two threads write to the
+		/// same particle, and the result does not depend on the number of threads. After this function returns,
+		/// \ref particle::raw_cell_index and \ref _space_hash are **not** valid.
+		void _correct_positions(T dt);
 
-		/// Detects collisions.
+		/// Detects collisions using either \ref _detect_collisions_continuous() or \ref _solid_sdf.
 		void _detect_collisions();
+		/// Detects collisions by marching each particle through the grid from its old position to its new position.
+		void _detect_collisions_continuous();
 
-		/// Velocity extrapolation.
+		/// Extrapolates velocities from the given fluid cells by \ref _extrapolation_distance layers of cells. Each
+		/// layer consists of the cells next to the previous layer that are not yet valid, and is processed in
+		/// parallel; cells further away are never visited.
 		void _extrapolate_velocities(const std::vector<vec3s> &fluid_cells);
 
-		/// Seeds all fluid sources.
+		/// Removes all particles in the cells of fluid sinks, adding their indices to \ref _free_particles.
+		/// \ref _space_hash must be valid; the particles are not removed from it.
+		void _update_sinks();
+		/// Computes the level set of the liquid from the cell types of the previous time step, advects it and the
+		/// velocities of the grid by the given time step, and updates \ref _narrow_band_flags accordingly. This must
+		/// be called before particles are transferred to the grid. All passes, including the two distance transforms,
+		/// cover the whole grid.
+		void _advect_narrow_band(T dt);
+		/// Removes particles in deep liquid cells, adding their indices to \ref _free_particles, and adds liquid
+		/// cells that were deep in the previous time step but are now in the band to \ref _particle_seeds.
+		/// \ref _space_hash must be valid. The search for cells to reseed scans the whole grid.
+		void _update_narrow_band_particles();
+		/// Adds deep liquid cells to \ref _fluid_cells and activates their tiles in \ref _space_hash, so that they
+		/// are processed by the grid stages like cells with particles. This is called after \ref hash_particles().
+		void _add_deep_liquid_cells();
+		/// Removes particles from cells that contain more than \ref max_particles_per_cell particles, and adds
+		/// particles to interior cells that contain fewer than \ref min_particles_per_cell particles. Removed
+		/// particles are merged into the remaining ones by averaging velocities. A cell is in the interior if each of
+		/// its neighbors contains particles or is a solid cell. \ref _space_hash must be valid; removed particles are
+		/// added to \ref _free_particles and new particles to \ref _particle_seeds.
+		void _control_particle_density();
+		/// Adds all cells of fluid sources that need new particles to \ref _particle_seeds.
 		void _update_sources();
+		/// Spawns the particles in \ref _particle_seeds in parallel, then removes the particles in
+		/// \ref _free_particles that have not been reused. New particles are first written to the slots in
+		/// \ref _free_particles, then appended. This clears both lists.
+		void _spawn_particles();
+		/// Returns the counter used to generate random numbers for the given stream in this time step.
+		[[nodiscard]] std::uint64_t _get_random_counter(_random_stream stream) const {
+			return (static_cast<std::uint64_t>(stream) << 56) ^ _time_step_index;
+		}
 	};
+
+	using simulation = basic_simulation<double>; ///< A fluid simulation in double precision.
 }
@@ -0,0 +1,47 @@
+#pragma once
+
+/// \file
+/// Signed distance field of the solid cells of a MAC grid.
+
+#include <vector>
+
+#include "math/vec.h"
+#include "data_structures/grid.h"
+#include "mac_grid.h"
+
+namespace fluid {
+	/// Signed distance field of the solid cells of a \ref basic_mac_grid, sampled at cell centers. Everything
+	/// outside of the grid is treated as solid, so the field also keeps particles away from the boundaries of the
+	/// grid. Distances are measured in cells, and are positive outside of solids.
+	class solid_distance_field {
+	public:
+		/// Recomputes this field if the set of solid cells in the given cell types of a grid differs from the one
+		/// that this field was computed from. Returns whether the field has been recomputed.
+		bool update(const grid3<grid_cell_type>&);
+		/// Similar to the other overload, but only compares the cells with the given raw indices. Changes to other
+		/// cells are ignored until they are included in a later call.
+		bool update(const grid3<grid_cell_type>&, const std::vector<std::size_t> &cells);
+
+		/// Samples the distance and its gradient at the given position, which is in cells relative to the origin of
+		/// the grid. The gradient is that of the trilinear interpolation of the field and is not normalized.
+		[[nodiscard]] std::pair<double, vec3d> sample(vec3d grid_pos) const;
+
+		/// Returns the distances at all cell centers. This grid has an additional layer of solid cells on each side.
+		[[nodiscard]] const grid3<double> &get_distances() const {
+			return _distances;
+		}
+
+		/// Computes the squared distance, in cells, from each cell center to the nearest cell center where
+		/// \p labels is equal to the given value. Cells are very far away from all others if no cell has that
+		/// value. The storage of \p result is reused if it already has the right size.
+		static void compute_squared_distances(
+			const grid3<unsigned char> &labels, unsigned char target, grid3<double> &result
+		);
+	private:
+		grid3<double> _distances; ///< The signed distances, with one layer of padding on each side.
+		grid3<unsigned char> _solid; ///< Whether each cell is solid, with one layer of padding on each side.
+
+		/// Recomputes \ref _solid and \ref _distances from the given cell types.
+		void _recompute(const grid3<grid_cell_type>&);
+	};
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/// \file
+/// Timings and counters collected during each time step of a simulation.
+
+#include <cstdint>
+#include <cstddef>
+
+namespace fluid {
+	/// Timings and counters of a single time step of a \ref simulation.
+	struct time_step_statistics {
+		/// The stages of a time step. Stages that are run multiple times in a time step accumulate their timings.
+		enum class stage : unsigned char {
+			hashing, ///< Computing cell indices of particles, sorting them, and updating the active cells.
+			advection, ///< Advecting particles.
+			collision_detection, ///< Updating the solid distance field and detecting collisions.
+			narrow_band, ///< Advecting the level set and deep velocities in narrow band mode.
+			seeding, ///< Sinks, narrow band reseeding, density control, and sources.
+			particle_to_grid, ///< Transferring velocities from particles to the grid.
+			gravity, ///< Adding gravity.
+			pressure_build, ///< Building the linear system and the preconditioner.
+			pressure_solve, ///< The conjugate gradient iterations.
+			pressure_apply, ///< Applying the pressure.
+			position_correction, ///< Correcting particle positions.
+			velocity_extrapolation, ///< Extrapolating velocities.
+			grid_to_particle, ///< Transferring velocities from the grid to particles.
+
+			count ///< The number of stages.
+		};
+		constexpr static std::size_t num_stages = static_cast<std::size_t>(stage::count); ///< The number of stages.
+
+		/// Returns the wall time, in seconds, spent in the given stage.
+		[[nodiscard]] double get_stage_seconds(stage s) const {
+			return stage_seconds[static_cast<std::size_t>(s)];
+		}
+		/// Returns the name of the given stage.
+		[[nodiscard]] static const char *get_stage_name(stage s) {
+			constexpr const char *names[num_stages]{
+				"hashing", "advection", "collision_detection", "narrow_band", "seeding", "particle_to_grid",
+				"gravity", "pressure_build", "pressure_solve", "pressure_apply", "position_correction",
+				"velocity_extrapolation", "grid_to_particle"
+			};
+			return names[static_cast<std::size_t>(s)];
+		}
+
+		double stage_seconds[num_stages]{}; ///< Wall time spent in each stage, in seconds.
+		/// Wall time of the entire time step in seconds, including callbacks, which are not part of any stage.
+		double total_seconds = 0.0;
+		double dt = 0.0; ///< The delta time of this time step.
+		double pressure_residual = 0.0; ///< The residual of the pressure solve.
+		std::uint64_t time_step_index = 0; ///< The index of this time step.
+		std::size_t
+			num_particles = 0, ///< The number of particles at the end of this time step.
+			num_fluid_cells = 0, ///< The number of fluid cells in the pressure solve.
+			num_active_cells = 0, ///< The number of cells processed by the grid stages.
+			pressure_iterations = 0, ///< The number of conjugate gradient iterations.
+			allocated_bytes = 0; ///< The number of bytes allocated by the simulation at the end of this time step.
+	};
+}
@@ -335,7 +335,7 @@ namespace fluid::maya {
 							cell_index.x = static_cast<std::size_t>(obstacle_cells[int_index++]);
 							cell_index.y = static_cast<std::size_t>(obstacle_cells[int_index++]);
 							cell_index.z = static_cast<std::size_t>(obstacle_cells[int_index++]);
-							sim.grid().grid()(cell_index).cell_type = mac_grid::cell::type::solid;
+							sim.grid().cell_types()(cell_index) = mac_grid::cell::type::solid;
 						}
 					}
 
@@ -357,8 +357,8 @@ namespace fluid::maya {
 				sim.update(frame_time);
 				MPointArray &array = _particle_cache.emplace_back(static_cast<unsigned int>(sim.particles().size()));
 				std::size_t i = 0;
-				for (const simulation::particle &p : sim.particles()) {
-					array.set(static_cast<unsigned int>(i), p.position.x, p.position.y, p.position.z);
+				for (vec3d p : sim.particles().positions) {
+					array.set(static_cast<unsigned int>(i), p.x, p.y, p.z);
 					++i;
 				}
 			} while (frame >= _particle_cache.size());
@@ -52,6 +52,6 @@ namespace fluid::maya {
 	private:
 		// deque to reduce move operations
 		std::deque<MPointArray> _particle_cache; ///< Cached particle positions for each frame.
-		std::vector<simulation::particle> _last_frame_particles; ///< Saved particles from the last cached frame.
+		particle_storage _last_frame_particles; ///< Saved particles from the last cached frame.
 	};
 }
@@ -0,0 +1,538 @@
+#include "fluid/checkpoint.h"
+
+/// \file
+/// Implementation of checkpoint files, and of saving and loading simulations using them.
+
+#include <fstream>
+#include <algorithm>
+#include <memory>
+
+#if defined(__unix__) || defined(__APPLE__)
+#	define FLUID_CHECKPOINT_USE_MMAP
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+#include "fluid/simulation.h"
+
+namespace fluid {
+	/// Rounds the given offset up to the alignment of section payloads.
+	[[nodiscard]] std::uint64_t _align_payload_offset(std::uint64_t offset) {
+		constexpr std::uint64_t alignment = checkpoint_header::payload_alignment;
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+
+	bool checkpoint_writer::write(const std::filesystem::path &path, std::uint32_t scalar_size) const {
+		// lay out the file
+		std::vector<checkpoint_section> table(_sections.size());
+		std::uint64_t offset = sizeof(checkpoint_header) + sizeof(checkpoint_section) * _sections.size();
+		for (std::size_t i = 0; i < _sections.size(); ++i) {
+			offset = _align_payload_offset(offset);
+			table[i].id = _sections[i].id;
+			table[i].element_size = _sections[i].element_size;
+			table[i].offset = offset;
+			table[i].count = _sections[i].count;
+			offset += static_cast<std::uint64_t>(_sections[i].element_size) * _sections[i].count;
+		}
+
+		checkpoint_header header;
+		std::memset(&header, 0, sizeof(header)); // so that padding bytes are deterministic
+		std::memcpy(header.magic, checkpoint_header::magic_value, sizeof(header.magic));
+		header.version = checkpoint_header::current_version;
+		header.byte_order = checkpoint_header::byte_order_mark;
+		header.scalar_size = scalar_size;
+		header.section_count = static_cast<std::uint32_t>(_sections.size());
+		header.file_size = offset;
+
+		std::filesystem::path temp_path = path;
+		temp_path += ".tmp";
+		{
+			std::ofstream fout(temp_path, std::ios::binary | std::ios::trunc);
+			if (!fout) {
+				return false;
+			}
+			fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			fout.write(reinterpret_cast<const char*>(table.data()), sizeof(checkpoint_section) * table.size());
+			std::uint64_t written = sizeof(checkpoint_header) + sizeof(checkpoint_section) * table.size();
+			const char padding[checkpoint_header::payload_alignment]{};
+			for (std::size_t i = 0; i < _sections.size(); ++i) {
+				fout.write(padding, static_cast<std::streamsize>(table[i].offset - written));
+				auto size = static_cast<std::streamsize>(table[i].element_size * table[i].count);
+				fout.write(static_cast<const char*>(_sections[i].data), size);
+				written = table[i].offset + static_cast<std::uint64_t>(size);
+			}
+			if (!fout.flush()) {
+				return false;
+			}
+		}
+		std::error_code error;
+		std::filesystem::rename(temp_path, path, error);
+		return !error;
+	}
+
+	checkpoint_reader::checkpoint_reader(const std::filesystem::path &path, std::uint32_t scalar_size) {
+#ifdef FLUID_CHECKPOINT_USE_MMAP
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			void *mapping = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				_data = static_cast<const char*>(mapping);
+				_size = static_cast<std::size_t>(info.st_size);
+				_mapped = true;
+			}
+		}
+		close(fd); // the mapping stays valid after the file is closed
+#else
+		std::ifstream fin(path, std::ios::binary | std::ios::ate);
+		if (!fin) {
+			return;
+		}
+		_buffer.resize(static_cast<std::size_t>(fin.tellg()));
+		fin.seekg(0);
+		if (!fin.read(_buffer.data(), static_cast<std::streamsize>(_buffer.size()))) {
+			return;
+		}
+		_data = _buffer.data();
+		_size = _buffer.size();
+#endif
+		if (_data != nullptr) {
+			_validate(scalar_size);
+		}
+	}
+
+	checkpoint_reader::~checkpoint_reader() {
+#ifdef FLUID_CHECKPOINT_USE_MMAP
+		if (_mapped) {
+			munmap(const_cast<char*>(_data), _size);
+		}
+#endif
+	}
+
+	const checkpoint_section *checkpoint_reader::find_section(std::uint32_t id) const {
+		if (_header == nullptr) {
+			return nullptr;
+		}
+		for (std::size_t i = 0; i < _header->section_count; ++i) {
+			if (_sections[i].id == id) {
+				return &_sections[i];
+			}
+		}
+		return nullptr;
+	}
+
+	void checkpoint_reader::_validate(std::uint32_t scalar_size) {
+		if (_size < sizeof(checkpoint_header)) {
+			return;
+		}
+		// mappings and vector storage are suitably aligned for the header
+		auto *header = reinterpret_cast<const checkpoint_header*>(_data);
+		if (
+			std::memcmp(header->magic, checkpoint_header::magic_value, sizeof(header->magic)) != 0 ||
+			header->version != checkpoint_header::current_version ||
+			header->byte_order != checkpoint_header::byte_order_mark ||
+			header->scalar_size != scalar_size ||
+			header->file_size != _size
+		) {
+			return;
+		}
+		std::uint64_t table_end =
+			sizeof(checkpoint_header) + sizeof(checkpoint_section) * static_cast<std::uint64_t>(header->section_count);
+		if (table_end > _size) {
+			return;
+		}
+		auto *sections = reinterpret_cast<const checkpoint_section*>(_data + sizeof(checkpoint_header));
+		for (std::size_t i = 0; i < header->section_count; ++i) {
+			const checkpoint_section &section = sections[i];
+			if (
+				section.offset < table_end || section.offset > _size ||
+				(section.element_size > 0 && section.count > (_size - section.offset) / section.element_size)
+			) {
+				return;
+			}
+		}
+		_header = header;
+		_sections = sections;
+	}
+
+
+	/// IDs of the sections of a simulation checkpoint. New sections must be added at the end.
+	enum class _checkpoint_section : std::uint32_t {
+		parameters, ///< A single \ref _checkpoint_parameters.
+		random_engine, ///< \ref basic_simulation::random.
+		particle_positions, ///< \ref basic_particle_storage::positions.
+		particle_velocities, ///< \ref basic_particle_storage::velocities.
+		particle_cx, ///< \ref basic_particle_storage::cx.
+		particle_cy, ///< \ref basic_particle_storage::cy.
+		particle_cz, ///< \ref basic_particle_storage::cz.
+		particle_old_positions, ///< \ref basic_particle_storage::old_positions.
+		particle_raw_cell_indices, ///< \ref basic_particle_storage::raw_cell_indices.
+		grid_velocities_x, ///< Velocities of the grid along the X axis.
+		grid_velocities_y, ///< Velocities of the grid along the Y axis.
+		grid_velocities_z, ///< Velocities of the grid along the Z axis.
+		grid_cell_types, ///< Cell types of the grid.
+		grid_tile_flags, ///< Flags of active tiles.
+		active_cell_flags, ///< Flags of active cells.
+		narrow_band_flags, ///< Flags of deep liquid cells.
+		liquid_phi, ///< The level set of narrow band mode. This is empty if it has not been computed.
+		deep_velocities_x, ///< Velocities of deep cells along the X axis. Empty if not computed.
+		deep_velocities_y, ///< Velocities of deep cells along the Y axis. Empty if not computed.
+		deep_velocities_z, ///< Velocities of deep cells along the Z axis. Empty if not computed.
+		pressure_cells, ///< Fluid cells of the last pressure solve.
+		pressure_values, ///< Pressure of the last pressure solve.
+		sources, ///< A \ref _checkpoint_source for each source.
+		source_cells, ///< The cells of all sources, one after another.
+		sinks, ///< A \ref _checkpoint_sink for each sink.
+		sink_cells ///< The cells of all sinks, one after another.
+	};
+	/// Returns the ID of the given checkpoint section.
+	[[nodiscard]] constexpr std::uint32_t _section_id(_checkpoint_section section) {
+		return static_cast<std::uint32_t>(section);
+	}
+
+	/// Parameters of a simulation and its pressure solver stored in a checkpoint.
+	template <typename T> struct _checkpoint_parameters {
+		vec3s grid_size; ///< The size of the grid.
+		vec3<T>
+			grid_offset, ///< \ref basic_simulation::grid_offset.
+			gravity; ///< \ref basic_simulation::gravity.
+		T
+			cfl_number, ///< \ref basic_simulation::cfl_number.
+			blending_factor, ///< \ref basic_simulation::blending_factor.
+			cell_size, ///< \ref basic_simulation::cell_size.
+			density, ///< \ref basic_simulation::density.
+			boundary_skin_width, ///< \ref basic_simulation::boundary_skin_width.
+			correction_stiffness; ///< \ref basic_simulation::correction_stiffness.
+		std::uint64_t
+			random_key, ///< \ref basic_simulation::random_key.
+			time_step_index, ///< The number of time steps that have been taken.
+			num_particles, ///< The number of particles.
+			velocity_extrapolation_iterations, ///< \ref basic_simulation::velocity_extrapolation_iterations.
+			statistics_history_length, ///< \ref basic_simulation::statistics_history_length.
+			narrow_band_width, ///< \ref basic_simulation::narrow_band_width.
+			min_particles_per_cell, ///< \ref basic_simulation::min_particles_per_cell.
+			max_particles_per_cell; ///< \ref basic_simulation::max_particles_per_cell.
+		std::uint8_t
+			adaptive_velocity_extrapolation, ///< \ref basic_simulation::adaptive_velocity_extrapolation.
+			continuous_collision_detection, ///< \ref basic_simulation::continuous_collision_detection.
+			particle_density_control, ///< \ref basic_simulation::particle_density_control.
+			simulation_method; ///< \ref basic_simulation::simulation_method.
+
+		double
+			solver_tau, ///< \ref basic_pressure_solver::tau.
+			solver_sigma, ///< \ref basic_pressure_solver::sigma.
+			solver_tolerance, ///< \ref basic_pressure_solver::tolerance.
+			/// \ref basic_pressure_solver::mixed_precision_relative_tolerance.
+			solver_mixed_precision_relative_tolerance;
+		std::uint64_t
+			solver_max_iterations, ///< \ref basic_pressure_solver::max_iterations.
+			/// \ref basic_pressure_solver::multigrid_smoothing_iterations.
+			solver_multigrid_smoothing_iterations,
+			/// \ref basic_pressure_solver::multigrid_coarsest_iterations.
+			solver_multigrid_coarsest_iterations,
+			solver_max_refinement_iterations; ///< \ref basic_pressure_solver::max_refinement_iterations.
+		std::uint8_t
+			solver_warm_start, ///< \ref basic_pressure_solver::warm_start.
+			solver_preconditioner, ///< \ref basic_pressure_solver::preconditioner.
+			solver_mixed_precision; ///< \ref basic_pressure_solver::mixed_precision.
+	};
+	/// A fluid source stored in a checkpoint. Its cells are stored in a separate section.
+	struct _checkpoint_source {
+		vec3d velocity; ///< \ref source::velocity.
+		std::uint64_t
+			num_cells, ///< The number of cells.
+			target_density_cubic_root; ///< \ref source::target_density_cubic_root.
+		std::uint8_t
+			active, ///< \ref source::active.
+			coerce_velocity; ///< \ref source::coerce_velocity.
+	};
+	/// A fluid sink stored in a checkpoint. Its cells are stored in a separate section.
+	struct _checkpoint_sink {
+		std::uint64_t num_cells; ///< The number of cells.
+		std::uint8_t active; ///< \ref sink::active.
+	};
+
+	template <typename T> bool basic_simulation<T>::save_checkpoint(const std::filesystem::path &path) const {
+		using _section = _checkpoint_section;
+
+		// value-initialization zeroes padding bytes, so that the contents of the file are deterministic
+		auto params = _checkpoint_parameters<T>();
+		params.grid_size = grid().get_size();
+		params.grid_offset = grid_offset;
+		params.gravity = gravity;
+		params.cfl_number = cfl_number;
+		params.blending_factor = blending_factor;
+		params.cell_size = cell_size;
+		params.density = density;
+		params.boundary_skin_width = boundary_skin_width;
+		params.correction_stiffness = correction_stiffness;
+		params.random_key = random_key;
+		params.time_step_index = _time_step_index;
+		params.num_particles = _particles.size();
+		params.velocity_extrapolation_iterations = velocity_extrapolation_iterations;
+		params.statistics_history_length = statistics_history_length;
+		params.narrow_band_width = narrow_band_width;
+		params.min_particles_per_cell = min_particles_per_cell;
+		params.max_particles_per_cell = max_particles_per_cell;
+		params.adaptive_velocity_extrapolation = adaptive_velocity_extrapolation;
+		params.continuous_collision_detection = continuous_collision_detection;
+		params.particle_density_control = particle_density_control;
+		params.simulation_method = static_cast<std::uint8_t>(simulation_method);
+		params.solver_tau = _solver.tau;
+		params.solver_sigma = _solver.sigma;
+		params.solver_tolerance = _solver.tolerance;
+		params.solver_mixed_precision_relative_tolerance = _solver.mixed_precision_relative_tolerance;
+		params.solver_max_iterations = _solver.max_iterations;
+		params.solver_multigrid_smoothing_iterations = _solver.multigrid_smoothing_iterations;
+		params.solver_multigrid_coarsest_iterations = _solver.multigrid_coarsest_iterations;
+		params.solver_max_refinement_iterations = _solver.max_refinement_iterations;
+		params.solver_warm_start = _solver.warm_start;
+		params.solver_preconditioner = static_cast<std::uint8_t>(_solver.preconditioner);
+		params.solver_mixed_precision = _solver.mixed_precision;
+
+		std::vector<_checkpoint_source> source_records;
+		std::vector<vec3s> source_cells;
+		for (const std::unique_ptr<source> &src : sources) {
+			_checkpoint_source &record = source_records.emplace_back(); // value-initialized
+			record.velocity = src->velocity;
+			record.num_cells = src->cells.size();
+			record.target_density_cubic_root = src->target_density_cubic_root;
+			record.active = src->active;
+			record.coerce_velocity = src->coerce_velocity;
+			source_cells.insert(source_cells.end(), src->cells.begin(), src->cells.end());
+		}
+		std::vector<_checkpoint_sink> sink_records;
+		std::vector<vec3s> sink_cells;
+		for (const std::unique_ptr<sink> &snk : sinks) {
+			_checkpoint_sink &record = sink_records.emplace_back(); // value-initialized
+			record.num_cells = snk->cells.size();
+			record.active = snk->active;
+			sink_cells.insert(sink_cells.end(), snk->cells.begin(), snk->cells.end());
+		}
+
+		auto add_grid = [](checkpoint_writer &writer, _section section, const auto &grid) {
+			writer.add(_section_id(section), grid.data(), grid.get_storage_size());
+		};
+		checkpoint_writer writer;
+		writer.add_value(_section_id(_section::parameters), params);
+		writer.add_value(_section_id(_section::random_engine), random);
+		writer.add(_section_id(_section::particle_positions), _particles.positions);
+		writer.add(_section_id(_section::particle_velocities), _particles.velocities);
+		writer.add(_section_id(_section::particle_cx), _particles.cx);
+		writer.add(_section_id(_section::particle_cy), _particles.cy);
+		writer.add(_section_id(_section::particle_cz), _particles.cz);
+		writer.add(_section_id(_section::particle_old_positions), _particles.old_positions);
+		writer.add(_section_id(_section::particle_raw_cell_indices), _particles.raw_cell_indices);
+		add_grid(writer, _section::grid_velocities_x, grid().velocities(0));
+		add_grid(writer, _section::grid_velocities_y, grid().velocities(1));
+		add_grid(writer, _section::grid_velocities_z, grid().velocities(2));
+		add_grid(writer, _section::grid_cell_types, grid().cell_types());
+		writer.add(_section_id(_section::grid_tile_flags), _grid_tile_flags);
+		add_grid(writer, _section::active_cell_flags, _active_cell_flags);
+		add_grid(writer, _section::narrow_band_flags, _narrow_band_flags);
+		add_grid(writer, _section::liquid_phi, _liquid_phi);
+		add_grid(writer, _section::deep_velocities_x, _deep_velocities[0]);
+		add_grid(writer, _section::deep_velocities_y, _deep_velocities[1]);
+		add_grid(writer, _section::deep_velocities_z, _deep_velocities[2]);
+		writer.add(_section_id(_section::pressure_cells), _solver.get_last_fluid_cells());
+		writer.add(_section_id(_section::pressure_values), _solver.get_last_pressure());
+		writer.add(_section_id(_section::sources), source_records);
+		writer.add(_section_id(_section::source_cells), source_cells);
+		writer.add(_section_id(_section::sinks), sink_records);
+		writer.add(_section_id(_section::sink_cells), sink_cells);
+		return writer.write(path, sizeof(T));
+	}
+
+	template <typename T> bool basic_simulation<T>::load_checkpoint(const std::filesystem::path &path) {
+		using _section = _checkpoint_section;
+
+		checkpoint_reader reader(path, sizeof(T));
+		_checkpoint_parameters<T> params;
+		if (!reader.is_valid() || !reader.read_value(_section_id(_section::parameters), params)) {
+			return false;
+		}
+
+		// check all sections before modifying anything, so that the reads below cannot fail
+		vec3s size = params.grid_size;
+		std::size_t
+			num_cells = grid3<unsigned char>::get_array_size(size),
+			num_particles = static_cast<std::size_t>(params.num_particles);
+		vec3s num_tiles = sparse_grid<_cell_particles>::get_tile_count(size);
+		auto check = [&reader](_section section, std::size_t element_size, std::size_t count) {
+			const checkpoint_section *entry = reader.find_section(_section_id(section));
+			return entry != nullptr && entry->element_size == element_size && entry->count == count;
+		};
+		auto check_optional = [&reader, num_cells](_section section, std::size_t element_size) {
+			const checkpoint_section *entry = reader.find_section(_section_id(section));
+			return
+				entry != nullptr && entry->element_size == element_size &&
+				(entry->count == 0 || entry->count == num_cells);
+		};
+		auto check_any = [&reader](_section section, std::size_t element_size) {
+			const checkpoint_section *entry = reader.find_section(_section_id(section));
+			return entry != nullptr && entry->element_size == element_size;
+		};
+		bool valid =
+			check(_section::random_engine, sizeof(pcg32), 1) &&
+			check(_section::particle_positions, sizeof(vec3<T>), num_particles) &&
+			check(_section::particle_velocities, sizeof(vec3<T>), num_particles) &&
+			check(_section::particle_cx, sizeof(vec3<T>), num_particles) &&
+			check(_section::particle_cy, sizeof(vec3<T>), num_particles) &&
+			check(_section::particle_cz, sizeof(vec3<T>), num_particles) &&
+			check(_section::particle_old_positions, sizeof(vec3<T>), num_particles) &&
+			check(_section::particle_raw_cell_indices, sizeof(std::size_t), num_particles) &&
+			check(_section::grid_velocities_x, sizeof(T), num_cells) &&
+			check(_section::grid_velocities_y, sizeof(T), num_cells) &&
+			check(_section::grid_velocities_z, sizeof(T), num_cells) &&
+			check(_section::grid_cell_types, sizeof(grid_cell_type), num_cells) &&
+			check(_section::grid_tile_flags, sizeof(unsigned char), num_tiles.x * num_tiles.y * num_tiles.z) &&
+			check(_section::active_cell_flags, sizeof(unsigned char), num_cells) &&
+			check(_section::narrow_band_flags, sizeof(unsigned char), num_cells) &&
+			check_optional(_section::liquid_phi, sizeof(T)) &&
+			check_optional(_section::deep_velocities_x, sizeof(T)) &&
+			check_optional(_section::deep_velocities_y, sizeof(T)) &&
+			check_optional(_section::deep_velocities_z, sizeof(T)) &&
+			check_any(_section::pressure_cells, sizeof(std::size_t)) &&
+			check_any(_section::pressure_values, sizeof(double)) &&
+			check_any(_section::sources, sizeof(_checkpoint_source)) &&
+			check_any(_section::source_cells, sizeof(vec3s)) &&
+			check_any(_section::sinks, sizeof(_checkpoint_sink)) &&
+			check_any(_section::sink_cells, sizeof(vec3s));
+		std::vector<std::size_t> pressure_cells;
+		std::vector<double> pressure_values;
+		std::vector<_checkpoint_source> source_records;
+		std::vector<_checkpoint_sink> sink_records;
+		std::vector<vec3s> source_cells, sink_cells;
+		valid =
+			valid &&
+			reader.read(_section_id(_section::pressure_cells), pressure_cells) &&
+			reader.read(_section_id(_section::pressure_values), pressure_values) &&
+			pressure_cells.size() == pressure_values.size() &&
+			reader.read(_section_id(_section::sources), source_records) &&
+			reader.read(_section_id(_section::source_cells), source_cells) &&
+			reader.read(_section_id(_section::sinks), sink_records) &&
+			reader.read(_section_id(_section::sink_cells), sink_cells);
+		if (valid) {
+			std::size_t total_source_cells = 0, total_sink_cells = 0;
+			for (const _checkpoint_source &record : source_records) {
+				total_source_cells += static_cast<std::size_t>(record.num_cells);
+			}
+			for (const _checkpoint_sink &record : sink_records) {
+				total_sink_cells += static_cast<std::size_t>(record.num_cells);
+			}
+			valid =
+				total_source_cells == source_cells.size() && total_sink_cells == sink_cells.size() &&
+				std::all_of(pressure_cells.begin(), pressure_cells.end(), [num_cells](std::size_t raw) {
+					return raw < num_cells;
+				});
+		}
+		if (!valid) {
+			return false;
+		}
+
+		// parameters
+		resize(size);
+		grid_offset = params.grid_offset;
+		gravity = params.gravity;
+		cfl_number = params.cfl_number;
+		blending_factor = params.blending_factor;
+		cell_size = params.cell_size;
+		density = params.density;
+		boundary_skin_width = params.boundary_skin_width;
+		correction_stiffness = params.correction_stiffness;
+		random_key = params.random_key;
+		_time_step_index = params.time_step_index;
+		velocity_extrapolation_iterations = static_cast<std::size_t>(params.velocity_extrapolation_iterations);
+		statistics_history_length = static_cast<std::size_t>(params.statistics_history_length);
+		narrow_band_width = static_cast<std::size_t>(params.narrow_band_width);
+		min_particles_per_cell = static_cast<std::size_t>(params.min_particles_per_cell);
+		max_particles_per_cell = static_cast<std::size_t>(params.max_particles_per_cell);
+		adaptive_velocity_extrapolation = params.adaptive_velocity_extrapolation != 0;
+		continuous_collision_detection = params.continuous_collision_detection != 0;
+		particle_density_control = params.particle_density_control != 0;
+		simulation_method = static_cast<method>(params.simulation_method);
+		_solver.tau = params.solver_tau;
+		_solver.sigma = params.solver_sigma;
+		_solver.tolerance = params.solver_tolerance;
+		_solver.mixed_precision_relative_tolerance = params.solver_mixed_precision_relative_tolerance;
+		_solver.max_iterations = static_cast<std::size_t>(params.solver_max_iterations);
+		_solver.multigrid_smoothing_iterations = static_cast<std::size_t>(params.solver_multigrid_smoothing_iterations);
+		_solver.multigrid_coarsest_iterations = static_cast<std::size_t>(params.solver_multigrid_coarsest_iterations);
+		_solver.max_refinement_iterations = static_cast<std::size_t>(params.solver_max_refinement_iterations);
+		_solver.warm_start = params.solver_warm_start != 0;
+		_solver.preconditioner =
+			static_cast<typename basic_pressure_solver<T>::preconditioner_type>(params.solver_preconditioner);
+		_solver.mixed_precision = params.solver_mixed_precision != 0;
+		_solver.set_last_pressure(size, std::move(pressure_cells), std::move(pressure_values));
+		reader.read_value(_section_id(_section::random_engine), random);
+
+		// particles and grids
+		_particles.resize(num_particles);
+		reader.read(_section_id(_section::particle_positions), _particles.positions);
+		reader.read(_section_id(_section::particle_velocities), _particles.velocities);
+		reader.read(_section_id(_section::particle_cx), _particles.cx);
+		reader.read(_section_id(_section::particle_cy), _particles.cy);
+		reader.read(_section_id(_section::particle_cz), _particles.cz);
+		reader.read(_section_id(_section::particle_old_positions), _particles.old_positions);
+		reader.read(_section_id(_section::particle_raw_cell_indices), _particles.raw_cell_indices);
+		auto read_grid = [&reader](_section section, auto &grid) {
+			reader.read(_section_id(section), grid.data(), grid.get_storage_size());
+		};
+		read_grid(_section::grid_velocities_x, grid().velocities(0));
+		read_grid(_section::grid_velocities_y, grid().velocities(1));
+		read_grid(_section::grid_velocities_z, grid().velocities(2));
+		read_grid(_section::grid_cell_types, grid().cell_types());
+		reader.read(_section_id(_section::grid_tile_flags), _grid_tile_flags);
+		read_grid(_section::active_cell_flags, _active_cell_flags);
+		read_grid(_section::narrow_band_flags, _narrow_band_flags);
+		auto read_optional_grid = [&](_section section, grid3<T> &grid) {
+			bool present = reader.find_section(_section_id(section))->count > 0;
+			grid = present ? grid3<T>(size) : grid3<T>();
+			read_grid(section, grid);
+		};
+		read_optional_grid(_section::liquid_phi, _liquid_phi);
+		read_optional_grid(_section::deep_velocities_x, _deep_velocities[0]);
+		read_optional_grid(_section::deep_velocities_y, _deep_velocities[1]);
+		read_optional_grid(_section::deep_velocities_z, _deep_velocities[2]);
+
+		// sources and sinks
+		sources.clear();
+		auto source_cell = source_cells.begin();
+		for (const _checkpoint_source &record : source_records) {
+			auto src = std::make_unique<source>();
+			src->velocity = record.velocity;
+			src->target_density_cubic_root = static_cast<std::size_t>(record.target_density_cubic_root);
+			src->active = record.active != 0;
+			src->coerce_velocity = record.coerce_velocity != 0;
+			auto cells_end = source_cell + static_cast<std::ptrdiff_t>(record.num_cells);
+			src->cells.assign(source_cell, cells_end);
+			source_cell = cells_end;
+			sources.emplace_back(std::move(src));
+		}
+		sinks.clear();
+		auto sink_cell = sink_cells.begin();
+		for (const _checkpoint_sink &record : sink_records) {
+			auto snk = std::make_unique<sink>();
+			snk->active = record.active != 0;
+			auto cells_end = sink_cell + static_cast<std::ptrdiff_t>(record.num_cells);
+			snk->cells.assign(sink_cell, cells_end);
+			sink_cell = cells_end;
+			sinks.emplace_back(std::move(snk));
+		}
+
+		reset_space_hash();
+		_last_statistics = time_step_statistics();
+		_statistics_history.clear();
+		return true;
+	}
+
+	template bool basic_simulation<float>::save_checkpoint(const std::filesystem::path&) const;
+	template bool basic_simulation<double>::save_checkpoint(const std::filesystem::path&) const;
+	template bool basic_simulation<float>::load_checkpoint(const std::filesystem::path&);
+	template bool basic_simulation<double>::load_checkpoint(const std::filesystem::path&);
+}
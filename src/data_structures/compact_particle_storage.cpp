@@ -0,0 +1,189 @@
+#include "fluid/data_structures/compact_particle_storage.h"
+
+/// \file
+/// Implementation of compact particle storage.
+
+#include <cassert>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#ifdef __F16C__
+#	include <immintrin.h>
+#endif
+
+namespace fluid {
+	// the c vectors are converted in bulk as flat arrays of halves
+	static_assert(sizeof(compact_particle_storage::half_vec3) == 3 * sizeof(std::uint16_t));
+
+	void compact_particle_storage::clear() {
+		*this = compact_particle_storage();
+	}
+
+	void compact_particle_storage::resize(std::size_t count) {
+		cell_indices.resize(count);
+		offsets.resize(count);
+		velocities.resize(count);
+		cx.resize(count);
+		cy.resize(count);
+		cz.resize(count);
+	}
+
+	std::size_t compact_particle_storage::get_allocated_bytes() const {
+		return
+			cell_indices.capacity() * sizeof(std::uint32_t) +
+			offsets.capacity() * sizeof(fixed_vec3) +
+			velocities.capacity() * sizeof(vec3f) +
+			(cx.capacity() + cy.capacity() + cz.capacity()) * sizeof(half_vec3);
+	}
+
+	/// Converts the given vector to half precision.
+	template <typename T> compact_particle_storage::half_vec3 _to_half_vec3(vec3<T> v) {
+		return {
+			compact_particle_storage::to_half(static_cast<float>(v.x)),
+			compact_particle_storage::to_half(static_cast<float>(v.y)),
+			compact_particle_storage::to_half(static_cast<float>(v.z))
+		};
+	}
+
+	template <typename T> void compact_particle_storage::encode(
+		const basic_particle_storage<T> &particles, vec3s grid_size, vec3<T> grid_offset, T cell_size
+	) {
+		assert(grid_size.x * grid_size.y * grid_size.z <= std::numeric_limits<std::uint32_t>::max());
+
+		resize(particles.size());
+		int count = static_cast<int>(particles.size());
+#pragma omp parallel for
+		for (int i = 0; i < count; ++i) {
+			vec3<T> grid_pos = (particles.positions[i] - grid_offset) / cell_size;
+			vec3s cell;
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				auto max_coord = static_cast<double>(grid_size[dim]);
+				double
+					coord = std::clamp(static_cast<double>(grid_pos[dim]), 0.0, max_coord),
+					floor_coord = std::min(std::floor(coord), max_coord - 1.0),
+					step = std::floor((coord - floor_coord) * offset_steps);
+				cell[dim] = static_cast<std::size_t>(floor_coord);
+				offsets[i][dim] = static_cast<std::uint16_t>(std::min(step, offset_steps - 1.0));
+			}
+			cell_indices[i] = static_cast<std::uint32_t>(cell.x + grid_size.x * (cell.y + grid_size.y * cell.z));
+			velocities[i] = vec3f(particles.velocities[i]);
+			cx[i] = _to_half_vec3(particles.cx[i]);
+			cy[i] = _to_half_vec3(particles.cy[i]);
+			cz[i] = _to_half_vec3(particles.cz[i]);
+		}
+	}
+
+	template <typename T> void compact_particle_storage::decode(
+		basic_particle_storage<T> &particles, vec3s grid_size, vec3<T> grid_offset, T cell_size
+	) const {
+		// particles are decoded in blocks, so that the c vectors can be converted in bulk into a small buffer
+		constexpr std::size_t block_size = 256;
+
+		std::size_t count = size();
+		particles.resize(count);
+		const half_vec3 *c_arrays[3]{ cx.data(), cy.data(), cz.data() };
+		std::vector<vec3<T>> *c_results[3]{ &particles.cx, &particles.cy, &particles.cz };
+		int num_blocks = static_cast<int>((count + block_size - 1) / block_size);
+#pragma omp parallel for
+		for (int block = 0; block < num_blocks; ++block) {
+			std::size_t begin = static_cast<std::size_t>(block) * block_size, end = std::min(begin + block_size, count);
+			float c_values[3][3 * block_size];
+			for (std::size_t c = 0; c < 3; ++c) {
+				from_half(c_arrays[c][begin].data(), c_values[c], 3 * (end - begin));
+			}
+			for (std::size_t i = begin; i < end; ++i) {
+				std::size_t raw = cell_indices[i];
+				vec3s cell(raw % grid_size.x, (raw / grid_size.x) % grid_size.y, raw / (grid_size.x * grid_size.y));
+				vec3<T> in_cell(
+					static_cast<T>(offsets[i][0]), static_cast<T>(offsets[i][1]), static_cast<T>(offsets[i][2])
+				);
+				// reconstruct the center of the quantization step
+				in_cell = (in_cell + vec3<T>(0.5, 0.5, 0.5)) / static_cast<T>(offset_steps);
+				particles.positions[i] = particles.old_positions[i] =
+					grid_offset + (vec3<T>(cell) + in_cell) * cell_size;
+				particles.velocities[i] = vec3<T>(velocities[i]);
+				particles.raw_cell_indices[i] = raw;
+				std::size_t local = 3 * (i - begin);
+				for (std::size_t c = 0; c < 3; ++c) {
+					const float *values = c_values[c] + local;
+					(*c_results[c])[i] = vec3<T>(values[0], values[1], values[2]);
+				}
+			}
+		}
+	}
+
+	std::uint16_t compact_particle_storage::to_half(float value) {
+		std::uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		auto sign = static_cast<std::uint16_t>((bits >> 16) & 0x8000);
+		std::uint32_t abs = bits & 0x7FFFFFFF;
+		if (abs >= 0x7F800000) { // infinity or NaN
+			return static_cast<std::uint16_t>(sign | (abs > 0x7F800000 ? 0x7E00 : 0x7C00));
+		}
+		if (abs >= 0x477FF000) { // rounds to a value larger than the largest half, 65504
+			return static_cast<std::uint16_t>(sign | 0x7C00);
+		}
+		if (abs < 0x38800000) { // the result is subnormal
+			if (abs < 0x33000000) { // less than half of the smallest subnormal half
+				return sign;
+			}
+			std::uint32_t
+				mantissa = (abs & 0x7FFFFF) | 0x800000,
+				shift = 126 - (abs >> 23),
+				result = mantissa >> shift,
+				remainder = mantissa & ((1u << shift) - 1),
+				halfway = 1u << (shift - 1);
+			if (remainder > halfway || (remainder == halfway && (result & 1) != 0)) { // round to nearest even
+				++result;
+			}
+			return static_cast<std::uint16_t>(sign | result);
+		}
+		// rebias the exponent, then round to nearest even; a carry out of the mantissa increments the exponent
+		std::uint32_t rebiased = abs - 0x38000000;
+		rebiased += 0xFFF + ((rebiased >> 13) & 1);
+		return static_cast<std::uint16_t>(sign | (rebiased >> 13));
+	}
+
+	float compact_particle_storage::from_half(std::uint16_t value) {
+		std::uint32_t
+			sign = static_cast<std::uint32_t>(value & 0x8000) << 16,
+			exponent = (value >> 10) & 0x1F,
+			mantissa = value & 0x3FF;
+		if (exponent == 0) { // zero or subnormal
+			float result = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+			return sign != 0 ? -result : result;
+		}
+		std::uint32_t bits = exponent == 0x1F ?
+			sign | 0x7F800000 | (mantissa << 13) : // infinity or NaN
+			sign | ((exponent + 112) << 23) | (mantissa << 13);
+		float result;
+		std::memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+
+	void compact_particle_storage::from_half(const std::uint16_t *halves, float *result, std::size_t count) {
+		std::size_t i = 0;
+#ifdef __F16C__
+		for (; i + 8 <= count; i += 8) {
+			__m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(halves + i));
+			_mm256_storeu_ps(result + i, _mm256_cvtph_ps(packed));
+		}
+#endif
+		for (; i < count; ++i) {
+			result[i] = from_half(halves[i]);
+		}
+	}
+
+	template void compact_particle_storage::encode(
+		const basic_particle_storage<float>&, vec3s, vec3<float>, float
+	);
+	template void compact_particle_storage::encode(
+		const basic_particle_storage<double>&, vec3s, vec3<double>, double
+	);
+	template void compact_particle_storage::decode(basic_particle_storage<float>&, vec3s, vec3<float>, float) const;
+	template void compact_particle_storage::decode(
+		basic_particle_storage<double>&, vec3s, vec3<double>, double
+	) const;
+}
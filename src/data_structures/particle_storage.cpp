@@ -0,0 +1,129 @@
+#include "fluid/data_structures/particle_storage.h"
+
+/// \file
+/// Implementation of particle storage.
+
+namespace fluid {
+	template <typename T> vec3s basic_particle<T>::compute_cell_index(vec3_type grid_offset, T cell_size) const {
+		return compute_cell_index(position, grid_offset, cell_size);
+	}
+
+	template <typename T> std::pair<vec3s, vec3<T>> basic_particle<T>::compute_cell_index_and_position(
+		vec3_type grid_offset, T cell_size
+	) const {
+		return compute_cell_index_and_position(position, grid_offset, cell_size);
+	}
+
+	template <typename T> vec3s basic_particle<T>::compute_cell_index(
+		vec3_type position, vec3_type grid_offset, T cell_size
+	) {
+		return vec3s((position - grid_offset) / cell_size);
+	}
+
+	template <typename T> std::pair<vec3s, vec3<T>> basic_particle<T>::compute_cell_index_and_position(
+		vec3_type position, vec3_type grid_offset, T cell_size
+	) {
+		vec3_type float_index = (position - grid_offset) / cell_size;
+		vec3s cell_index(float_index);
+		return { cell_index, float_index - vec3_type(cell_index) };
+	}
+
+
+	template <typename T> void basic_particle_storage<T>::clear() {
+		for_each_array(
+			[](auto &arr) {
+				arr.clear();
+			}
+		);
+	}
+
+	template <typename T> void basic_particle_storage<T>::reserve(std::size_t count) {
+		for_each_array(
+			[count](auto &arr) {
+				arr.reserve(count);
+			}
+		);
+		// the buffers are swapped with the arrays in permute(), so they need the same capacity
+		_vec_buffer.reserve(count);
+		_index_buffer.reserve(count);
+	}
+
+	template <typename T> std::size_t basic_particle_storage<T>::get_allocated_bytes() const {
+		std::size_t result = 0;
+		for_each_array(
+			[&result](const auto &arr) {
+				result += arr.capacity() * sizeof(arr[0]);
+			}
+		);
+		return
+			result + _vec_buffer.capacity() * sizeof(vec3_type) + _index_buffer.capacity() * sizeof(std::size_t);
+	}
+
+	template <typename T> void basic_particle_storage<T>::resize(std::size_t count) {
+		for_each_array(
+			[count](auto &arr) {
+				arr.resize(count);
+			}
+		);
+	}
+
+	template <typename T> void basic_particle_storage<T>::push_back(const particle &p) {
+		positions.emplace_back(p.position);
+		velocities.emplace_back(p.velocity);
+		cx.emplace_back(p.cx);
+		cy.emplace_back(p.cy);
+		cz.emplace_back(p.cz);
+		old_positions.emplace_back(p.old_position);
+		raw_cell_indices.emplace_back(p.raw_cell_index);
+	}
+
+	template <typename T> void basic_particle_storage<T>::remove_sorted(const std::vector<std::size_t> &indices) {
+		std::size_t count = size(), first_hole = 0, last_hole = indices.size();
+		while (first_hole < last_hole) {
+			if (indices[last_hole - 1] == count - 1) { // the last particle is removed
+				--last_hole;
+			} else {
+				std::size_t hole = indices[first_hole++];
+				for_each_array(
+					[hole, last = count - 1](auto &arr) {
+						arr[hole] = arr[last];
+					}
+				);
+			}
+			--count;
+		}
+		resize(count);
+	}
+
+	/// Gathers the elements of \p arr into \p buffer according to \p order, then swaps the two arrays. The buffer
+	/// is first grown to the capacity of the array, so that the array keeps the space reserved for it.
+	template <typename T> void _permute_array(
+		std::vector<T> &arr, std::vector<T> &buffer, const std::vector<std::size_t> &order
+	) {
+		if (buffer.capacity() < arr.capacity()) {
+			buffer.reserve(arr.capacity());
+		}
+		buffer.resize(arr.size());
+		int count = static_cast<int>(arr.size());
+#pragma omp parallel for
+		for (int i = 0; i < count; ++i) {
+			buffer[i] = arr[order[i]];
+		}
+		arr.swap(buffer);
+	}
+	template <typename T> void basic_particle_storage<T>::permute(const std::vector<std::size_t> &order) {
+		assert(order.size() == size());
+		_permute_array(positions, _vec_buffer, order);
+		_permute_array(velocities, _vec_buffer, order);
+		_permute_array(cx, _vec_buffer, order);
+		_permute_array(cy, _vec_buffer, order);
+		_permute_array(cz, _vec_buffer, order);
+		_permute_array(old_positions, _vec_buffer, order);
+		_permute_array(raw_cell_indices, _index_buffer, order);
+	}
+
+	template struct basic_particle<float>;
+	template struct basic_particle<double>;
+	template class basic_particle_storage<float>;
+	template class basic_particle_storage<double>;
+}
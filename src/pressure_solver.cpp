@@ -3,369 +3,863 @@
 /// \file
 /// Implementation of the pressure solver.
 
+#include <cmath>
 #include <algorithm>
 #include <iostream>
+#include <chrono>
+
+#include "fluid/simulation.h"
 
 namespace fluid {
-	pressure_solver::cell_data::cell_data() : nonsolid_neighbors(0), fluid_xpos(0), fluid_ypos(0), fluid_zpos(0) {
+	template <typename Scalar> basic_pressure_solver<Scalar>::cell_data::cell_data() :
+		nonsolid_neighbors(0), fluid_xpos(0), fluid_ypos(0), fluid_zpos(0) {
 	}
 
 
-	pressure_solver::pressure_solver(simulation &sim, const std::vector<vec3s> &fluid_cells) :
-		_fluid_cell_indices(sim.grid().grid().get_size(), _not_a_fluid_cell),
-		_fluid_cells(fluid_cells), _sim(sim) {
-	}
-
-	std::tuple<std::vector<double>, double, std::size_t> pressure_solver::solve(double dt) {
+	template <typename Scalar>
+	std::tuple<std::vector<double>&, double, std::size_t> basic_pressure_solver<Scalar>::solve(
+		basic_simulation<Scalar> &sim, const std::vector<vec3s> &fluid_cells, double dt
+	) {
+		auto setup_start = std::chrono::steady_clock::now();
+		_sim = &sim;
+		_fluid_cells = &fluid_cells;
+		bool warm_started = warm_start && _map_previous_pressure();
 		_compute_fluid_cell_indices();
 
-		_a_scale = dt / (_sim.density * _sim.cell_size * _sim.cell_size);
+		_a_scale = dt / (_sim->density * _sim->cell_size * _sim->cell_size);
 		_compute_a_matrix();
-		std::vector<double> b = _compute_b_vector();
-		std::vector<double> precon = _compute_preconditioner();
-		double residual = 0.0;
+		_compute_neighbors();
+		_compute_b_vector();
+		switch (preconditioner) {
+		case preconditioner_type::modified_incomplete_cholesky:
+			_compute_preconditioner();
+			break;
+		case preconditioner_type::modified_incomplete_cholesky_wavefront:
+			_compute_preconditioner_wavefront();
+			break;
+		case preconditioner_type::multigrid:
+			_build_multigrid_levels();
+			break;
+		}
+		if (mixed_precision && preconditioner != preconditioner_type::multigrid) {
+			_precon_float.assign(_precon.begin(), _precon.end());
+		}
+		_last_setup_seconds =
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - setup_start).count();
 
-		std::vector<double> p(_fluid_cells.size(), 0.0);
+		std::size_t num_cells = _fluid_cells->size();
+		_p.assign(num_cells, 0.0);
 		double tot = 0.0;
-		for (double bval : b) {
+		for (double bval : _b) {
 			tot += bval * bval;
 		}
 		if (tot < 1e-6) {
-			return { p, 0.0, 0 };
+			return { _p, 0.0, 0 };
+		}
+		if (warm_started) {
+			_p.swap(_initial_p);
 		}
-		std::vector<double> r = b;
 
-		std::vector<double> z(_fluid_cells.size(), 0.0), q_scratch(_fluid_cells.size(), 0.0);
-		_apply_preconditioner(z, q_scratch, precon, r);
-		std::vector<double> s = z;
+		std::vector<double> &r = _double_vectors.r;
+		if (!mixed_precision) {
+			if (warm_started) {
+				// r = b - A p
+				r.resize(num_cells);
+				_apply_a(r, _p);
+				_muladd(r, _b, r, -1.0);
+			} else {
+				r = _b;
+			}
+			auto [residual, iterations] = _solve_pcg(_p, _double_vectors, tolerance, max_iterations);
+			return { _p, residual, iterations };
+		}
 
-		double sigma_ps = vec_ops::dynamic::dot(z, r);
+		// mixed precision: solve for corrections in single precision and accumulate them in double precision
+		r.resize(num_cells);
+		std::vector<float> &correction = _float_vectors.correction, &float_r = _float_vectors.r;
+		float_r.resize(num_cells);
+		double residual = 0.0;
+		std::size_t iterations = 0;
+		for (std::size_t refinement = 0; ; ++refinement) {
+			_apply_a(r, _p);
+			_muladd(r, _b, r, -1.0);
+			residual = _max_abs_element(r);
+			if (residual < tolerance || refinement == max_refinement_iterations || iterations >= max_iterations) {
+				break;
+			}
 
-		std::size_t i = 0;
-		for (; i < max_iterations; ++i) {
+			int size = static_cast<int>(num_cells);
+#pragma omp parallel for
+			for (int i = 0; i < size; ++i) {
+				float_r[static_cast<std::size_t>(i)] = static_cast<float>(r[static_cast<std::size_t>(i)]);
+			}
+			correction.assign(num_cells, 0.0f);
+			double inner_tolerance = std::max(tolerance, mixed_precision_relative_tolerance * residual);
+			iterations += _solve_pcg(correction, _float_vectors, inner_tolerance, max_iterations - iterations).second;
+#pragma omp parallel for
+			for (int i = 0; i < size; ++i) {
+				_p[static_cast<std::size_t>(i)] += correction[static_cast<std::size_t>(i)];
+			}
+		}
+		return { _p, residual, iterations };
+	}
 
-			_apply_a(z, s);
+	template <typename Scalar> template <typename T>
+	std::pair<double, std::size_t> basic_pressure_solver<Scalar>::_solve_pcg(
+		std::vector<T> &x, _pcg_vectors<T> &vecs, double tol, std::size_t iterations
+	) {
+		std::size_t num_cells = _fluid_cells->size();
+		vecs.z.assign(num_cells, 0);
+		vecs.q_scratch.assign(num_cells, 0);
+		_precondition(vecs.z, vecs.r, vecs.q_scratch);
+		vecs.s = vecs.z;
 
-			double alpha = sigma_ps / vec_ops::dynamic::dot(z, s);
+		double sigma_ps = _dot(vecs.z, vecs.r);
 
-			_muladd(p, p, s, alpha);
-			_muladd(r, r, z, -alpha);
+		double residual = 0.0;
+		std::size_t i = 0;
+		for (; i < iterations; ++i) {
 
-			residual = *std::max_element(r.begin(), r.end());
-			if (residual < tolerance) {
+			double alpha = sigma_ps / _apply_a_and_dot(vecs.z, vecs.s);
+
+			residual = _update_solution_and_residual(x, vecs, alpha);
+			if (residual < tol) {
 				++i;
 				break;
 			}
 
-			_apply_preconditioner(z, q_scratch, precon, r);
+			_precondition(vecs.z, vecs.r, vecs.q_scratch);
 
-			double sigma_new = vec_ops::dynamic::dot(z, r);
+			double sigma_new = _dot(vecs.z, vecs.r);
 
 			double beta = sigma_new / sigma_ps;
 
-			_muladd(s, z, s, beta);
+			_muladd(vecs.s, vecs.z, vecs.s, beta);
 
 			sigma_ps = sigma_new;
 		}
-		return { p, residual, i };
+		return { residual, i };
 	}
 
-	void pressure_solver::apply_pressure(double dt, const std::vector<double> &p) const {
-		double _coeff = dt / (_sim.density * _sim.cell_size);
+	template <typename Scalar> void basic_pressure_solver<Scalar>::apply_pressure(
+		double dt, const std::vector<double> &p
+	) const {
+		double _coeff = dt / (_sim->density * _sim->cell_size);
+		basic_mac_grid<Scalar> &grid = _sim->grid();
 
-		for (std::size_t i = 0; i < _fluid_cells.size(); ++i) {
-			vec3s pos = _fluid_cells[i];
+		for (std::size_t i = 0; i < _fluid_cells->size(); ++i) {
+			vec3s pos = (*_fluid_cells)[i];
 			double cur_pressure = p[i];
-			mac_grid::cell &cell = _sim.grid().grid()(pos);
+			std::size_t raw = grid.index_to_raw(pos);
 
-			{
-				vec3s xpos = pos + vec3s::axis<0>();
-				auto [other_cell, type] = _sim.grid().get_cell_and_type(xpos);
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				vec3s other = pos;
+				++other[dim];
+				Scalar &vel = grid.velocities(dim)[raw];
+				mac_grid::cell::type type = grid.get_cell_type(other);
 				if (type != mac_grid::cell::type::solid) {
 					double otherp = 0.0;
 					if (type == mac_grid::cell::type::fluid) {
-						otherp = p[_fluid_cell_indices(xpos)];
+						otherp = p[_fluid_cell_indices(other)];
 					}
-					cell.velocities_posface.x -= _coeff * (otherp - cur_pressure);
+					vel -= _coeff * (otherp - cur_pressure);
 				} else {
-					cell.velocities_posface.x = other_cell ? /*usolid*/ 0.0 : 0.0;
+					vel = 0.0; /*usolid*/
 				}
 			}
 
-			{
-				vec3s ypos = pos + vec3s::axis<1>();
-				auto [other_cell, type] = _sim.grid().get_cell_and_type(ypos);
-				if (type != mac_grid::cell::type::solid) {
-					double otherp = 0.0;
-					if (type == mac_grid::cell::type::fluid) {
-						otherp = p[_fluid_cell_indices(ypos)];
+			// since non-fluid cells are not updated above, we update them here
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				vec3s neg = pos;
+				--neg[dim];
+				if (grid.is_inside(neg)) {
+					std::size_t neg_raw = grid.index_to_raw(neg);
+					mac_grid::cell::type type = grid.cell_types()[neg_raw];
+					if (type == mac_grid::cell::type::air) {
+						grid.velocities(dim)[neg_raw] -= _coeff * cur_pressure;
+					} else if (type == mac_grid::cell::type::solid) {
+						grid.velocities(dim)[neg_raw] = 0.0; /*usolid;*/
 					}
-					cell.velocities_posface.y -= _coeff * (otherp - cur_pressure);
-				} else {
-					cell.velocities_posface.y = other_cell ? /*usolid*/ 0.0 : 0.0;
-				}
-			}
-
-			{
-				vec3s zpos = pos + vec3s::axis<2>();
-				auto [other_cell, type] = _sim.grid().get_cell_and_type(zpos);
-				if (type != mac_grid::cell::type::solid) {
-					double otherp = 0.0;
-					if (type == mac_grid::cell::type::fluid) {
-						otherp = p[_fluid_cell_indices(zpos)];
-					}
-					cell.velocities_posface.z -= _coeff * (otherp - cur_pressure);
-				} else {
-					cell.velocities_posface.z = other_cell ? /*usolid*/ 0.0 : 0.0;
 				}
 			}
+		}
+	}
 
-			// since non-fluid cells are not updated above, we update them here
-			if (auto [xneg_cell, type] = _sim.grid().get_cell_and_type(pos - vec3s::axis<0>()); xneg_cell) {
-				if (type == mac_grid::cell::type::air) {
-					xneg_cell->velocities_posface.x -= _coeff * cur_pressure;
-				} else if (type == mac_grid::cell::type::solid) {
-					xneg_cell->velocities_posface.x = 0.0; /*usolid;*/
-				}
-			}
+	template <typename Scalar> void basic_pressure_solver<Scalar>::set_last_pressure(
+		vec3s grid_size, std::vector<std::size_t> cells, std::vector<double> pressure
+	) {
+		assert(cells.size() == pressure.size());
+		_fluid_cell_indices = grid3<std::size_t>(grid_size, _not_a_fluid_cell);
+		for (std::size_t i = 0; i < cells.size(); ++i) {
+			_fluid_cell_indices[cells[i]] = i;
+		}
+		_indexed_cells = std::move(cells);
+		_p = std::move(pressure);
+	}
 
-			if (auto [yneg_cell, type] = _sim.grid().get_cell_and_type(pos - vec3s::axis<1>()); yneg_cell) {
-				if (type == mac_grid::cell::type::air) {
-					yneg_cell->velocities_posface.y -= _coeff * cur_pressure;
-				} else if (type == mac_grid::cell::type::solid) {
-					yneg_cell->velocities_posface.y = 0.0; /*usolid;*/
-				}
-			}
+	template <typename Scalar> std::size_t basic_pressure_solver<Scalar>::get_allocated_bytes() const {
+		std::size_t result =
+			grid3<std::size_t>::get_array_size(_fluid_cell_indices.get_size()) * sizeof(std::size_t) +
+			(_indexed_cells.capacity() + _wavefront_cells.capacity() + _wavefront_begin.capacity()) *
+			sizeof(std::size_t) +
+			_a.capacity() * sizeof(cell_data) +
+			_neighbors.capacity() * sizeof(neighbor_data);
+		for (const std::vector<double> *vec : { &_b, &_precon, &_p, &_initial_p, &_partial_sums }) {
+			result += vec->capacity() * sizeof(double);
+		}
+		result +=
+			_precon_float.capacity() * sizeof(float) +
+			_double_vectors.get_allocated_bytes() + _float_vectors.get_allocated_bytes();
+		for (const _multigrid_level &level : _coarse_levels) {
+			std::size_t num_cells = grid3<std::size_t>::get_array_size(level.indices.get_size());
+			result +=
+				num_cells * (sizeof(std::size_t) + sizeof(mac_grid::cell::type)) +
+				level.cells.capacity() * sizeof(vec3s) +
+				level.a.capacity() * sizeof(cell_data) +
+				(level.x.capacity() + level.b.capacity() + level.residual.capacity()) * sizeof(double);
+		}
+		return result;
+	}
 
-			if (auto [zneg_cell, type] = _sim.grid().get_cell_and_type(pos - vec3s::axis<2>()); zneg_cell) {
-				if (type == mac_grid::cell::type::air) {
-					zneg_cell->velocities_posface.z -= _coeff * cur_pressure;
-				} else if (type == mac_grid::cell::type::solid) {
-					zneg_cell->velocities_posface.z = 0.0; /*usolid;*/
-				}
+	template <typename Scalar> bool basic_pressure_solver<Scalar>::_map_previous_pressure() {
+		if (_indexed_cells.empty() || _fluid_cell_indices.get_size() != _sim->grid().get_size()) {
+			return false;
+		}
+		bool any_mapped = false;
+		_initial_p.resize(_fluid_cells->size());
+		for (std::size_t i = 0; i < _fluid_cells->size(); ++i) {
+			// _fluid_cell_indices still contains the indices from the previous solve
+			std::size_t old_index = _fluid_cell_indices((*_fluid_cells)[i]);
+			if (old_index != _not_a_fluid_cell) {
+				_initial_p[i] = _p[old_index];
+				any_mapped = true;
+			} else {
+				_initial_p[i] = 0.0;
 			}
 		}
+		return any_mapped;
 	}
 
-	void pressure_solver::_compute_fluid_cell_indices() {
-		_fluid_cell_indices.fill(_not_a_fluid_cell);
-		for (std::size_t i = 0; i < _fluid_cells.size(); ++i) {
-			_fluid_cell_indices(_fluid_cells[i]) = i;
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_fluid_cell_indices() {
+		vec3s grid_size = _sim->grid().get_size();
+		if (_fluid_cell_indices.get_size() != grid_size) {
+			_fluid_cell_indices = grid3<std::size_t>(grid_size, _not_a_fluid_cell);
+		} else {
+			// only reset the cells that were indexed in the previous solve
+			for (std::size_t raw : _indexed_cells) {
+				_fluid_cell_indices[raw] = _not_a_fluid_cell;
+			}
+		}
+		_indexed_cells.clear();
+		for (std::size_t i = 0; i < _fluid_cells->size(); ++i) {
+			std::size_t raw = _fluid_cell_indices.index_to_raw((*_fluid_cells)[i]);
+			_fluid_cell_indices[raw] = i;
+			_indexed_cells.emplace_back(raw);
 		}
 	}
 
 	const std::vector<vec3s> _offsets{
 		{ 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { -1, 0, 0 }, { 0, -1, 0 }, { 0, 0, -1 }
 	};
-	void pressure_solver::_compute_a_matrix() {
-		_a.clear();
-		_a.reserve(_fluid_cells.size());
-		for (std::size_t i = 0; i < _fluid_cells.size(); ++i) { // border cells
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_a_matrix() {
+		_a.resize(_fluid_cells->size());
+		int num_cells = static_cast<int>(_fluid_cells->size());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) { // border cells
 			cell_data data;
-			vec3s pos = _fluid_cells[i];
+			vec3s pos = (*_fluid_cells)[static_cast<std::size_t>(i)];
 			for (vec3s o : _offsets) {
 				data.nonsolid_neighbors +=
-					_sim.grid().get_cell_and_type(pos + o).second != mac_grid::cell::type::solid ? 1 : 0;
+					_sim->grid().get_cell_type(pos + o) != mac_grid::cell::type::solid ? 1 : 0;
 			}
 			data.fluid_xpos =
-				_sim.grid().get_cell_and_type(pos + vec3s::axis<0>()).second == mac_grid::cell::type::fluid ? 1 : 0;
+				_sim->grid().get_cell_type(pos + vec3s::axis<0>()) == mac_grid::cell::type::fluid ? 1 : 0;
 			data.fluid_ypos =
-				_sim.grid().get_cell_and_type(pos + vec3s::axis<1>()).second == mac_grid::cell::type::fluid ? 1 : 0;
+				_sim->grid().get_cell_type(pos + vec3s::axis<1>()) == mac_grid::cell::type::fluid ? 1 : 0;
 			data.fluid_zpos =
-				_sim.grid().get_cell_and_type(pos + vec3s::axis<2>()).second == mac_grid::cell::type::fluid ? 1 : 0;
-			_a.emplace_back(data);
+				_sim->grid().get_cell_type(pos + vec3s::axis<2>()) == mac_grid::cell::type::fluid ? 1 : 0;
+			_a[static_cast<std::size_t>(i)] = data;
+		}
+	}
+
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_neighbors() {
+		_neighbors.resize(_fluid_cells->size());
+		int num_cells = static_cast<int>(_fluid_cells->size());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			vec3s pos = (*_fluid_cells)[id];
+			const cell_data &current = _a[id];
+			std::size_t indices[6]{
+				_get_neg_neighbor_index<0>(pos), _get_neg_neighbor_index<1>(pos), _get_neg_neighbor_index<2>(pos),
+				_get_pos_neighbor_index<0>(pos), _get_pos_neighbor_index<1>(pos), _get_pos_neighbor_index<2>(pos)
+			};
+			// the coupling between two cells is determined by the flag of the cell in the negative direction
+			bool coupled[6]{
+				indices[0] != _not_a_fluid_cell && _a[indices[0]].fluid_xpos,
+				indices[1] != _not_a_fluid_cell && _a[indices[1]].fluid_ypos,
+				indices[2] != _not_a_fluid_cell && _a[indices[2]].fluid_zpos,
+				indices[3] != _not_a_fluid_cell && current.fluid_xpos,
+				indices[4] != _not_a_fluid_cell && current.fluid_ypos,
+				indices[5] != _not_a_fluid_cell && current.fluid_zpos
+			};
+			neighbor_data &data = _neighbors[id];
+			data.mask = 0;
+			for (std::size_t k = 0; k < 6; ++k) {
+				data.indices[k] = static_cast<std::uint32_t>(coupled[k] ? indices[k] : id);
+				data.mask |= (coupled[k] ? 1u : 0u) << k;
+			}
 		}
 	}
 
-	std::vector<double> pressure_solver::_compute_b_vector() const {
-		std::vector<double> b(_fluid_cells.size(), 0.0);
-		double scale = 1.0 / _sim.cell_size;
-		for (std::size_t i = 0; i < _fluid_cells.size(); ++i) {
-			vec3s pos = _fluid_cells[i];
-			vec3d vel = _sim.grid().grid()(pos).velocities_posface;
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_b_vector() {
+		_b.resize(_fluid_cells->size());
+		double scale = 1.0 / _sim->cell_size;
+		const basic_mac_grid<Scalar> &grid = _sim->grid();
+		for (std::size_t i = 0; i < _fluid_cells->size(); ++i) {
+			vec3s pos = (*_fluid_cells)[i];
+			vec3d vel(grid.get_velocities_posface(pos));
 
 			double value = -(vel.x + vel.y + vel.z);
 
-			if (pos.x > 0) {
-				const mac_grid::cell &cell = _sim.grid().grid()(pos.x - 1, pos.y, pos.z);
-				value += cell.velocities_posface.x;
-				if (cell.cell_type == mac_grid::cell::type::solid) {
-					value -= cell.velocities_posface.x; /* - usolid;*/
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				if (pos[dim] > 0) {
+					vec3s neg = pos;
+					--neg[dim];
+					std::size_t neg_raw = grid.index_to_raw(neg);
+					double neg_vel = grid.velocities(dim)[neg_raw];
+					value += neg_vel;
+					if (grid.cell_types()[neg_raw] == mac_grid::cell::type::solid) {
+						value -= neg_vel; /* - usolid;*/
+					}
 				}
 			}
-			if (pos.y > 0) {
-				const mac_grid::cell &cell = _sim.grid().grid()(pos.x, pos.y - 1, pos.z);
-				value += cell.velocities_posface.y;
-				if (cell.cell_type == mac_grid::cell::type::solid) {
-					value -= cell.velocities_posface.y; /* - usolid;*/
+
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				vec3s other = pos;
+				++other[dim];
+				if (grid.get_cell_type(other) == mac_grid::cell::type::solid) {
+					value += vel[dim];
+					/*if (grid.is_inside(other)) {
+						value -= grid.velocities(dim)(other);
+					}*/
 				}
 			}
-			if (pos.z > 0) {
-				const mac_grid::cell &cell = _sim.grid().grid()(pos.x, pos.y, pos.z - 1);
-				value += cell.velocities_posface.z;
-				if (cell.cell_type == mac_grid::cell::type::solid) {
-					value -= cell.velocities_posface.z; /* - usolid*/
+
+			_b[i] = scale * value;
+		}
+	}
+
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_preconditioner_at(std::size_t i) {
+		const neighbor_data &nb = _neighbors[i];
+		double
+			neg_e = 0.0, // the negative part of e without tau that needs to be scaled by _a_scale^2
+			neg_e_tau = 0.0; // the negative part of e with tau that needs to be scaled by tau * _a_scale^2
+
+		// for each neighbor in the negative direction, the coupling coefficient is either 1 or 0, and the rest of
+		// the off-diagonal elements are those of the other two axes
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			const cell_data &neg_cell = _a[nb.indices[dim]];
+			double
+				neg_precon = _coupling<double>(nb, dim) * _precon[nb.indices[dim]],
+				neg_other = static_cast<double>(
+					neg_cell.fluid_xpos + neg_cell.fluid_ypos + neg_cell.fluid_zpos
+				) - 1.0;
+			neg_e += neg_precon * neg_precon;
+			neg_e_tau += neg_other * neg_precon * neg_precon;
+		}
+
+		// still needs to be scaled by _a_scale later
+		double e = _a[i].nonsolid_neighbors - (neg_e + tau * neg_e_tau) * _a_scale;
+
+		if (e < sigma * _a[i].nonsolid_neighbors) {
+			e = static_cast<double>(_a[i].nonsolid_neighbors);
+		}
+		_precon[i] = 1.0 / std::sqrt(e * _a_scale);
+	}
+
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_forward_substitute_at(
+		std::size_t i, std::vector<T> &q, const std::vector<T> &precon, const std::vector<T> &r
+	) const {
+		const neighbor_data &nb = _neighbors[i];
+		T neg_t = 0; // the negative part of t that needs to be scaled by _a_scale
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			neg_t += _coupling<T>(nb, dim) * precon[nb.indices[dim]] * q[nb.indices[dim]];
+		}
+		q[i] = (r[i] + static_cast<T>(_a_scale) * neg_t) * precon[i];
+	}
+
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_backward_substitute_at(
+		std::size_t i, std::vector<T> &z, const std::vector<T> &precon, const std::vector<T> &q
+	) const {
+		const neighbor_data &nb = _neighbors[i];
+		T neg_t = 0; // the negative part of t that needs to be scaled by _a_scale * precon[i]
+		for (std::size_t dim = 3; dim < 6; ++dim) {
+			neg_t += _coupling<T>(nb, dim) * z[nb.indices[dim]];
+		}
+		z[i] = (q[i] + static_cast<T>(_a_scale) * precon[i] * neg_t) * precon[i];
+	}
+
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_preconditioner() {
+		_precon.assign(_fluid_cells->size(), 0.0);
+		for (std::size_t i = 0; i < _fluid_cells->size(); ++i) {
+			_compute_preconditioner_at(i);
+		}
+	}
+
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_apply_preconditioner(
+		std::vector<T> &z, std::vector<T> &q_scratch, const std::vector<T> &precon, const std::vector<T> &r
+	) const {
+		// first solve L q = r
+		for (std::size_t i = 0; i < _fluid_cells->size(); ++i) {
+			_forward_substitute_at(i, q_scratch, precon, r);
+		}
+		// next solve L^T z = q
+		for (std::size_t i = _fluid_cells->size(); i > 0; ) {
+			--i;
+			_backward_substitute_at(i, z, precon, q_scratch);
+		}
+	}
+
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_wavefronts() {
+		// counting sort by x + y + z; the cells are already sorted by raw index, so each wavefront stays sorted
+		vec3s size = _fluid_cell_indices.get_size();
+		_wavefront_begin.assign(size.x + size.y + size.z + 1, 0);
+		for (vec3s pos : *_fluid_cells) {
+			++_wavefront_begin[pos.x + pos.y + pos.z + 1];
+		}
+		for (std::size_t i = 1; i < _wavefront_begin.size(); ++i) {
+			_wavefront_begin[i] += _wavefront_begin[i - 1];
+		}
+		_wavefront_cells.resize(_fluid_cells->size());
+		for (std::size_t i = 0; i < _fluid_cells->size(); ++i) {
+			vec3s pos = (*_fluid_cells)[i];
+			_wavefront_cells[_wavefront_begin[pos.x + pos.y + pos.z]++] = i;
+		}
+		// restore the beginning of each wavefront
+		for (std::size_t i = _wavefront_begin.size() - 1; i > 0; --i) {
+			_wavefront_begin[i] = _wavefront_begin[i - 1];
+		}
+		_wavefront_begin[0] = 0;
+	}
+
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_compute_preconditioner_wavefront() {
+		_compute_wavefronts();
+		_precon.assign(_fluid_cells->size(), 0.0);
+		int num_wavefronts = static_cast<int>(_wavefront_begin.size() - 1);
+#pragma omp parallel
+		for (int front = 0; front < num_wavefronts; ++front) {
+			int
+				begin = static_cast<int>(_wavefront_begin[front]),
+				end = static_cast<int>(_wavefront_begin[front + 1]);
+#pragma omp for
+			for (int i = begin; i < end; ++i) {
+				_compute_preconditioner_at(_wavefront_cells[i]);
+			}
+		}
+	}
+
+	template <typename Scalar> template <typename T>
+	void basic_pressure_solver<Scalar>::_apply_preconditioner_wavefront(
+		std::vector<T> &z, std::vector<T> &q_scratch, const std::vector<T> &precon, const std::vector<T> &r
+	) const {
+		int num_wavefronts = static_cast<int>(_wavefront_begin.size() - 1);
+#pragma omp parallel
+		{
+			// first solve L q = r
+			for (int front = 0; front < num_wavefronts; ++front) {
+				int
+					begin = static_cast<int>(_wavefront_begin[front]),
+					end = static_cast<int>(_wavefront_begin[front + 1]);
+#pragma omp for
+				for (int i = begin; i < end; ++i) {
+					_forward_substitute_at(_wavefront_cells[i], q_scratch, precon, r);
+				}
+			}
+			// next solve L^T z = q
+			for (int front = num_wavefronts; front > 0; ) {
+				--front;
+				int
+					begin = static_cast<int>(_wavefront_begin[front]),
+					end = static_cast<int>(_wavefront_begin[front + 1]);
+#pragma omp for
+				for (int i = begin; i < end; ++i) {
+					_backward_substitute_at(_wavefront_cells[i], z, precon, q_scratch);
 				}
 			}
+		}
+	}
+
+	template <typename Scalar> void basic_pressure_solver<Scalar>::_build_multigrid_levels() {
+		std::size_t num_levels = 0;
+		vec3s size = _fluid_cell_indices.get_size();
+		double scale = _a_scale;
+		while (size.x > _coarsest_level_size || size.y > _coarsest_level_size || size.z > _coarsest_level_size) {
+			vec3s fine_size = size;
+			size = (size + vec3s(1, 1, 1)) / 2;
+			// with piecewise constant interpolation, the Galerkin coarse operator is half of the fine operator
+			scale *= 0.5;
+
+			if (num_levels == _coarse_levels.size()) {
+				_coarse_levels.emplace_back();
+			}
+			_multigrid_level &level = _coarse_levels[num_levels];
+			const _multigrid_level *finer = num_levels > 0 ? &_coarse_levels[num_levels - 1] : nullptr;
+			level.scale = scale;
+			if (level.types.get_size() != size) {
+				level.types = grid3<mac_grid::cell::type>(size);
+				level.indices = grid3<std::size_t>(size);
+			}
 
-			{
-				auto [cell, type] = _sim.grid().get_cell_and_type(pos + vec3s::axis<0>());
-				if (type == mac_grid::cell::type::solid) {
-					value += vel.x;
-					if (cell) {
-						/*value -= cell->velocities_posface.x;*/
+			// a coarse cell is air if any of its children is air, otherwise it's fluid if any child is fluid
+			auto get_fine_type = [&](vec3s fine) {
+				if (finer) {
+					return finer->types(fine);
+				}
+				if (_fluid_cell_indices(fine) != _not_a_fluid_cell) {
+					return mac_grid::cell::type::fluid;
+				}
+				return
+					_sim->grid().cell_types()(fine) == mac_grid::cell::type::solid ?
+					mac_grid::cell::type::solid :
+					mac_grid::cell::type::air;
+			};
+			int size_z = static_cast<int>(size.z);
+#pragma omp parallel for
+			for (int z = 0; z < size_z; ++z) {
+				for (std::size_t y = 0; y < size.y; ++y) {
+					for (std::size_t x = 0; x < size.x; ++x) {
+						vec3s coarse(x, y, static_cast<std::size_t>(z));
+						bool any_fluid = false, any_air = false;
+						for (std::size_t child = 0; child < 8; ++child) {
+							vec3s fine = coarse * 2 + vec3s(child & 1, (child >> 1) & 1, child >> 2);
+							if (fine.x < fine_size.x && fine.y < fine_size.y && fine.z < fine_size.z) {
+								mac_grid::cell::type type = get_fine_type(fine);
+								any_fluid = any_fluid || type == mac_grid::cell::type::fluid;
+								any_air = any_air || type == mac_grid::cell::type::air;
+							}
+						}
+						level.types(coarse) =
+							any_air ? mac_grid::cell::type::air :
+							any_fluid ? mac_grid::cell::type::fluid :
+							mac_grid::cell::type::solid;
 					}
 				}
 			}
-			{
-				auto [cell, type] = _sim.grid().get_cell_and_type(pos + vec3s::axis<1>());
-				if (type == mac_grid::cell::type::solid) {
-					value += vel.y;
-					if (cell) {
-						/*value -= cell->velocities_posface.y;*/
-					}
+
+			level.cells.clear();
+			for (std::size_t i = 0; i < level.types.get_array_size(size); ++i) {
+				if (level.types[i] == mac_grid::cell::type::fluid) {
+					level.indices[i] = level.cells.size();
+					level.cells.emplace_back(level.types.index_from_raw(i));
+				} else {
+					level.indices[i] = _not_a_fluid_cell;
 				}
 			}
-			{
-				auto [cell, type] = _sim.grid().get_cell_and_type(pos + vec3s::axis<2>());
-				if (type == mac_grid::cell::type::solid) {
-					value += vel.z;
-					if (cell) {
-						/*value -= cell->velocities_posface.z;*/
+
+			level.a.resize(level.cells.size());
+			int num_cells = static_cast<int>(level.cells.size());
+#pragma omp parallel for
+			for (int i = 0; i < num_cells; ++i) {
+				auto id = static_cast<std::size_t>(i);
+				vec3s pos = level.cells[id];
+				auto get_type = [&](vec3s cell) {
+					if (cell.x >= size.x || cell.y >= size.y || cell.z >= size.z) {
+						return mac_grid::cell::type::solid;
 					}
+					return level.types(cell);
+				};
+				cell_data data;
+				for (vec3s o : _offsets) {
+					data.nonsolid_neighbors += get_type(pos + o) != mac_grid::cell::type::solid ? 1 : 0;
 				}
+				data.fluid_xpos = get_type(pos + vec3s::axis<0>()) == mac_grid::cell::type::fluid ? 1 : 0;
+				data.fluid_ypos = get_type(pos + vec3s::axis<1>()) == mac_grid::cell::type::fluid ? 1 : 0;
+				data.fluid_zpos = get_type(pos + vec3s::axis<2>()) == mac_grid::cell::type::fluid ? 1 : 0;
+				level.a[id] = data;
 			}
 
-			b[i] = scale * value;
+			level.x.resize(level.cells.size());
+			level.b.resize(level.cells.size());
+			level.residual.resize(level.cells.size());
+			++num_levels;
 		}
-		return b;
+		_coarse_levels.resize(num_levels);
 	}
 
-	std::vector<double> pressure_solver::_compute_preconditioner() const {
-		std::vector<double> precon(_fluid_cells.size(), 0.0);
-		for (std::size_t i = 0; i < _fluid_cells.size(); ++i) {
-			vec3s pos = _fluid_cells[i];
-			double
-				neg_e = 0.0, // the negative part of e without tau that needs to be scaled by _a_scale^2
-				neg_e_tau = 0.0; // the negative part of e with tau that needs to be scaled by tau * _a_scale^2
-
-			if (std::size_t xneg_index = _get_neg_neighbor_index<0>(pos); xneg_index != _not_a_fluid_cell) {
-				const cell_data &xneg_cell = _a[xneg_index];
-				double
-					xneg_precon = precon[xneg_index],
-					a_times_precon = xneg_cell.fluid_xpos * xneg_precon;
-				neg_e += a_times_precon * a_times_precon;
-				neg_e_tau +=
-					(xneg_cell.fluid_xpos * (xneg_cell.fluid_ypos + xneg_cell.fluid_zpos)) *
-					xneg_precon * xneg_precon;
-			}
+	template <typename Scalar> auto basic_pressure_solver<Scalar>::_get_level_view(
+		std::size_t level
+	) const -> _level_view {
+		if (level == 0) {
+			return _level_view{ _fluid_cell_indices, *_fluid_cells, _a, _a_scale };
+		}
+		return _coarse_levels[level - 1].view();
+	}
+
+	template <typename Scalar> template <typename T> T basic_pressure_solver<Scalar>::_sum_neighbors(
+		const _level_view &level, std::size_t i, const std::vector<T> &v
+	) {
+		vec3s pos = level.cells[i];
+		const cell_data &current = level.a[i];
+		T sum = 0;
+		if (std::size_t xneg_id = _get_neg_neighbor_index<0>(level.indices, pos); xneg_id != _not_a_fluid_cell) {
+			sum += level.a[xneg_id].fluid_xpos * v[xneg_id];
+		}
+		if (std::size_t yneg_id = _get_neg_neighbor_index<1>(level.indices, pos); yneg_id != _not_a_fluid_cell) {
+			sum += level.a[yneg_id].fluid_ypos * v[yneg_id];
+		}
+		if (std::size_t zneg_id = _get_neg_neighbor_index<2>(level.indices, pos); zneg_id != _not_a_fluid_cell) {
+			sum += level.a[zneg_id].fluid_zpos * v[zneg_id];
+		}
+		if (std::size_t xpos_id = _get_pos_neighbor_index<0>(level.indices, pos); xpos_id != _not_a_fluid_cell) {
+			sum += current.fluid_xpos * v[xpos_id];
+		}
+		if (std::size_t ypos_id = _get_pos_neighbor_index<1>(level.indices, pos); ypos_id != _not_a_fluid_cell) {
+			sum += current.fluid_ypos * v[ypos_id];
+		}
+		if (std::size_t zpos_id = _get_pos_neighbor_index<2>(level.indices, pos); zpos_id != _not_a_fluid_cell) {
+			sum += current.fluid_zpos * v[zpos_id];
+		}
+		return sum;
+	}
 
-			if (std::size_t yneg_index = _get_neg_neighbor_index<1>(pos); yneg_index != _not_a_fluid_cell) {
-				const cell_data &yneg_cell = _a[yneg_index];
-				double
-					yneg_precon = precon[yneg_index],
-					a_times_precon = yneg_cell.fluid_ypos * yneg_precon;
-				neg_e += a_times_precon * a_times_precon;
-				neg_e_tau +=
-					(yneg_cell.fluid_ypos * (yneg_cell.fluid_xpos + yneg_cell.fluid_zpos)) *
-					yneg_precon * yneg_precon;
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_smooth(
+		const _level_view &level, std::vector<T> &x, const std::vector<T> &b, std::size_t color
+	) {
+		auto inv_scale = static_cast<T>(1.0 / level.scale);
+		int num_cells = static_cast<int>(level.cells.size());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			vec3s pos = level.cells[id];
+			if ((pos.x + pos.y + pos.z) % 2 != color) {
+				continue;
 			}
+			auto diagonal = static_cast<T>(level.a[id].nonsolid_neighbors);
+			x[id] = diagonal > 0 ? (b[id] * inv_scale + _sum_neighbors(level, id, x)) / diagonal : 0;
+		}
+	}
 
-			if (std::size_t zneg_index = _get_neg_neighbor_index<2>(pos); zneg_index != _not_a_fluid_cell) {
-				const cell_data &zneg_cell = _a[zneg_index];
-				double
-					zneg_precon = precon[zneg_index],
-					a_times_precon = zneg_cell.fluid_zpos * zneg_precon;
-				neg_e += a_times_precon * a_times_precon;
-				neg_e_tau +=
-					(zneg_cell.fluid_zpos * (zneg_cell.fluid_xpos + zneg_cell.fluid_ypos)) *
-					zneg_precon * zneg_precon;
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_solve_coarsest(
+		const _level_view &level, std::vector<T> &x, const std::vector<T> &b, std::size_t iterations
+	) {
+		auto inv_scale = static_cast<T>(1.0 / level.scale);
+		auto update = [&](std::size_t i) {
+			auto diagonal = static_cast<T>(level.a[i].nonsolid_neighbors);
+			x[i] = diagonal > 0 ? (b[i] * inv_scale + _sum_neighbors(level, i, x)) / diagonal : 0;
+		};
+		for (std::size_t iter = 0; iter < iterations; ++iter) {
+			for (std::size_t i = 0; i < level.cells.size(); ++i) {
+				update(i);
 			}
+			for (std::size_t i = level.cells.size(); i > 0; ) {
+				update(--i);
+			}
+		}
+	}
 
-			// still needs to be scaled by _a_scale later
-			double e = _a[i].nonsolid_neighbors - (neg_e + tau * neg_e_tau) * _a_scale;
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_compute_residual(
+		const _level_view &level, std::vector<T> &residual, const std::vector<T> &x, const std::vector<T> &b
+	) {
+		auto scale = static_cast<T>(level.scale);
+		int num_cells = static_cast<int>(level.cells.size());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			T ax = static_cast<T>(level.a[id].nonsolid_neighbors) * x[id] - _sum_neighbors(level, id, x);
+			residual[id] = b[id] - scale * ax;
+		}
+	}
 
-			if (e < sigma * _a[i].nonsolid_neighbors) {
-				e = static_cast<double>(_a[i].nonsolid_neighbors);
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_restrict(
+		const _level_view &level, const std::vector<T> &residual, _multigrid_level &coarse
+	) {
+		vec3s fine_size = level.indices.get_size();
+		int num_cells = static_cast<int>(coarse.cells.size());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			double sum = 0.0;
+			for (std::size_t child = 0; child < 8; ++child) {
+				vec3s fine = coarse.cells[id] * 2 + vec3s(child & 1, (child >> 1) & 1, child >> 2);
+				if (fine.x < fine_size.x && fine.y < fine_size.y && fine.z < fine_size.z) {
+					if (std::size_t fine_id = level.indices(fine); fine_id != _not_a_fluid_cell) {
+						sum += residual[fine_id];
+					}
+				}
 			}
-			precon[i] = 1.0 / std::sqrt(e * _a_scale);
+			coarse.b[id] = 0.125 * sum;
 		}
-		return precon;
 	}
 
-	void pressure_solver::_apply_preconditioner(
-		std::vector<double> &z, std::vector<double> &q_scratch,
-		const std::vector<double> &precon, const std::vector<double> &r
-	) const {
-		// first solve L q = r
-		for (std::size_t i = 0; i < _fluid_cells.size(); ++i) {
-			vec3s pos = _fluid_cells[i];
-			double neg_t = 0.0; // the negative part of t that needs to be scaled by _a_scale
-			if (std::size_t xneg_index = _get_neg_neighbor_index<0>(pos); xneg_index != _not_a_fluid_cell) {
-				neg_t += _a[xneg_index].fluid_xpos * precon[xneg_index] * q_scratch[xneg_index];
-			}
-			if (std::size_t yneg_index = _get_neg_neighbor_index<1>(pos); yneg_index != _not_a_fluid_cell) {
-				neg_t += _a[yneg_index].fluid_ypos * precon[yneg_index] * q_scratch[yneg_index];
-			}
-			if (std::size_t zneg_index = _get_neg_neighbor_index<2>(pos); zneg_index != _not_a_fluid_cell) {
-				neg_t += _a[zneg_index].fluid_zpos * precon[zneg_index] * q_scratch[zneg_index];
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_prolong(
+		const _level_view &level, std::vector<T> &x, const _multigrid_level &coarse
+	) {
+		int num_cells = static_cast<int>(level.cells.size());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			if (std::size_t coarse_id = coarse.indices(level.cells[id] / 2); coarse_id != _not_a_fluid_cell) {
+				x[id] += static_cast<T>(coarse.x[coarse_id]);
 			}
-			q_scratch[i] = (r[i] + _a_scale * neg_t) * precon[i];
 		}
-		// next solve L^T z = q
-		for (std::size_t i = _fluid_cells.size(); i > 0; ) {
-			--i;
-			vec3s pos = _fluid_cells[i];
-			const cell_data &cell = _a[i];
-			double neg_t = 0.0; // the negative part of t that needs to be scaled by _a_scale * precon[i]
-			if (std::size_t xpos_index = _get_pos_neighbor_index<0>(pos); xpos_index != _not_a_fluid_cell) {
-				neg_t += cell.fluid_xpos * z[xpos_index];
-			}
-			if (std::size_t ypos_index = _get_pos_neighbor_index<1>(pos); ypos_index != _not_a_fluid_cell) {
-				neg_t += cell.fluid_ypos * z[ypos_index];
-			}
-			if (std::size_t zpos_index = _get_pos_neighbor_index<2>(pos); zpos_index != _not_a_fluid_cell) {
-				neg_t += cell.fluid_zpos * z[zpos_index];
-			}
-			z[i] = (q_scratch[i] + _a_scale * precon[i] * neg_t) * precon[i];
+	}
+
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_v_cycle(
+		std::size_t level, std::vector<T> &x, const std::vector<T> &b, std::vector<T> &residual
+	) {
+		_level_view view = _get_level_view(level);
+		std::fill(x.begin(), x.end(), static_cast<T>(0));
+		if (level == _coarse_levels.size()) {
+			_solve_coarsest(view, x, b, multigrid_coarsest_iterations);
+			return;
+		}
+		// the post-smoothing passes are in the reverse order of the pre-smoothing passes so that the V-cycle is
+		// symmetric, which is required by the conjugate gradient method
+		for (std::size_t i = 0; i < multigrid_smoothing_iterations; ++i) {
+			_smooth(view, x, b, 0);
+			_smooth(view, x, b, 1);
+		}
+		_compute_residual(view, residual, x, b);
+		_multigrid_level &coarse = _coarse_levels[level];
+		_restrict(view, residual, coarse);
+		_v_cycle(level + 1, coarse.x, coarse.b, coarse.residual);
+		_prolong(view, x, coarse);
+		for (std::size_t i = 0; i < multigrid_smoothing_iterations; ++i) {
+			_smooth(view, x, b, 1);
+			_smooth(view, x, b, 0);
 		}
 	}
 
-	void pressure_solver::_apply_a(std::vector<double> &out, const std::vector<double> &v) const {
-		for (std::size_t i = 0; i < _fluid_cells.size(); ++i) {
-			vec3s pos = _fluid_cells[i];
-			const cell_data &current = _a[i];
-			double value = current.nonsolid_neighbors * v[i];
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_precondition(
+		std::vector<T> &z, const std::vector<T> &r, std::vector<T> &q_scratch
+	) {
+		switch (preconditioner) {
+		case preconditioner_type::modified_incomplete_cholesky:
+			_apply_preconditioner(z, q_scratch, _get_preconditioner<T>(), r);
+			break;
+		case preconditioner_type::modified_incomplete_cholesky_wavefront:
+			_apply_preconditioner_wavefront(z, q_scratch, _get_preconditioner<T>(), r);
+			break;
+		case preconditioner_type::multigrid:
+			_v_cycle(0, z, r, q_scratch);
+			break;
+		}
+	}
 
-			if (std::size_t xneg_id = _get_neg_neighbor_index<0>(pos); xneg_id != _not_a_fluid_cell) {
-				value -= _a[xneg_id].fluid_xpos * v[xneg_id];
-			}
-			if (std::size_t yneg_id = _get_neg_neighbor_index<1>(pos); yneg_id != _not_a_fluid_cell) {
-				value -= _a[yneg_id].fluid_ypos * v[yneg_id];
-			}
-			if (std::size_t zneg_id = _get_neg_neighbor_index<2>(pos); zneg_id != _not_a_fluid_cell) {
-				value -= _a[zneg_id].fluid_zpos * v[zneg_id];
-			}
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_apply_a(
+		std::vector<T> &out, const std::vector<T> &v
+	) const {
+		auto scale = static_cast<T>(_a_scale);
+		int num_cells = static_cast<int>(_fluid_cells->size());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			out[id] = scale * _apply_a_at(id, v);
+		}
+	}
 
-			if (std::size_t xpos_id = _get_pos_neighbor_index<0>(pos); xpos_id != _not_a_fluid_cell) {
-				value -= current.fluid_xpos * v[xpos_id];
+	template <typename Scalar> template <typename T> double basic_pressure_solver<Scalar>::_apply_a_and_dot(
+		std::vector<T> &out, const std::vector<T> &v
+	) {
+		auto scale = static_cast<T>(_a_scale);
+		return _sum_chunks(
+			_fluid_cells->size(),
+			[&](std::size_t id) {
+				T value = scale * _apply_a_at(id, v);
+				out[id] = value;
+				return static_cast<double>(value * v[id]);
 			}
-			if (std::size_t ypos_id = _get_pos_neighbor_index<1>(pos); ypos_id != _not_a_fluid_cell) {
-				value -= current.fluid_ypos * v[ypos_id];
+		);
+	}
+
+	template <typename Scalar> template <typename T>
+	double basic_pressure_solver<Scalar>::_update_solution_and_residual(
+		std::vector<T> &x, _pcg_vectors<T> &vecs, double alpha
+	) {
+		auto t_alpha = static_cast<T>(alpha);
+		T result = 0;
+		int num_cells = static_cast<int>(x.size());
+#pragma omp parallel
+		{
+			T thread_max = 0;
+#pragma omp for
+			for (int i = 0; i < num_cells; ++i) {
+				auto id = static_cast<std::size_t>(i);
+				x[id] += t_alpha * vecs.s[id];
+				vecs.r[id] -= t_alpha * vecs.z[id];
+				// the magnitude is used so that large negative residuals also keep the solver iterating; this also
+				// applies to double precision solves, which may now run more iterations than before
+				thread_max = std::max(thread_max, std::abs(vecs.r[id]));
 			}
-			if (std::size_t zpos_id = _get_pos_neighbor_index<2>(pos); zpos_id != _not_a_fluid_cell) {
-				value -= current.fluid_zpos * v[zpos_id];
+#pragma omp critical
+			result = std::max(result, thread_max);
+		}
+		return static_cast<double>(result);
+	}
+
+	template <typename Scalar> template <typename T> double basic_pressure_solver<Scalar>::_dot(
+		const std::vector<T> &a, const std::vector<T> &b
+	) {
+		return _sum_chunks(
+			a.size(),
+			[&a, &b](std::size_t i) {
+				return static_cast<double>(a[i] * b[i]);
 			}
+		);
+	}
 
-			out[i] = _a_scale * value;
+	template <typename Scalar> template <typename Term> double basic_pressure_solver<Scalar>::_sum_chunks(
+		std::size_t count, Term &&term
+	) {
+		std::size_t num_chunks = (count + _sum_chunk_size - 1) / _sum_chunk_size;
+		_partial_sums.resize(num_chunks);
+		int inum_chunks = static_cast<int>(num_chunks);
+#pragma omp parallel for
+		for (int i = 0; i < inum_chunks; ++i) {
+			auto chunk = static_cast<std::size_t>(i);
+			std::size_t end = std::min(count, (chunk + 1) * _sum_chunk_size);
+			double sum = 0.0;
+			for (std::size_t id = chunk * _sum_chunk_size; id < end; ++id) {
+				sum += term(id);
+			}
+			_partial_sums[chunk] = sum;
+		}
+		double result = 0.0;
+		for (double sum : _partial_sums) {
+			result += sum;
 		}
+		return result;
 	}
 
-	void pressure_solver::_muladd(
-		std::vector<double> &out, const std::vector<double> &a, const std::vector<double> &b, double s
+	template <typename Scalar> template <typename T> void basic_pressure_solver<Scalar>::_muladd(
+		std::vector<T> &out, const std::vector<T> &a, const std::vector<T> &b, double s
 	) {
-		for (std::size_t i = 0; i < a.size(); ++i) {
-			out[i] = a[i] + s * b[i];
+		auto t_s = static_cast<T>(s);
+		int size = static_cast<int>(a.size());
+#pragma omp parallel for
+		for (int i = 0; i < size; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			out[id] = a[id] + t_s * b[id];
 		}
 	}
+
+	template <typename Scalar> double basic_pressure_solver<Scalar>::_max_abs_element(const std::vector<double> &v) {
+		double result = 0.0;
+		int size = static_cast<int>(v.size());
+#pragma omp parallel
+		{
+			double thread_max = 0.0;
+#pragma omp for
+			for (int i = 0; i < size; ++i) {
+				thread_max = std::max(thread_max, std::abs(v[static_cast<std::size_t>(i)]));
+			}
+#pragma omp critical
+			result = std::max(result, thread_max);
+		}
+		return result;
+	}
+
+	template class basic_pressure_solver<float>;
+	template class basic_pressure_solver<double>;
 }
@@ -6,31 +6,40 @@
 #include <cmath>
 #include <algorithm>
 #include <random>
+#include <limits>
+#include <chrono>
 
-#include "fluid/pressure_solver.h"
+#ifdef __AVX2__
+#	include "fluid/math/vec_simd.h"
+#endif
 
 namespace fluid {
-	vec3s simulation::particle::compute_cell_index(vec3d grid_offset, double cell_size) const {
-		return vec3s((position - grid_offset) / cell_size);
+	template <typename T> void basic_simulation<T>::resize(vec3s sz) {
+		_grid = basic_mac_grid<T>(sz);
+		_old_grid = basic_mac_grid<T>(sz);
+		_solid_sdf = solid_distance_field();
+		_space_hash = sparse_grid<_cell_particles>(sz);
+		_face_weights = grid3<vec3<T>>(sz);
+		_extrapolation_valid = grid3<unsigned char>(sz, 0);
+		// process the entire grid in the first time step
+		vec3s num_tiles = _space_hash.get_tile_count();
+		_grid_tile_flags.assign(num_tiles.x * num_tiles.y * num_tiles.z, _active_current);
+		_active_grid_tiles.clear();
+		_active_cell_flags = grid3<unsigned char>(sz, _active_current);
+		_band_scratch[0] = grid3<unsigned char>(sz, 0);
+		_band_scratch[1] = grid3<unsigned char>(sz, 0);
+		_active_cells.clear();
+		_narrow_band_flags = grid3<unsigned char>(sz, 0);
+		_band_labels = grid3<unsigned char>(sz);
+		_band_distances[0] = grid3<double>(sz);
+		_band_distances[1] = grid3<double>(sz);
+		_band_phi = grid3<T>(sz);
+		_deep_cells.clear();
 	}
 
-	std::pair<vec3s, vec3d> simulation::particle::compute_cell_index_and_position(
-		vec3d grid_offset, double cell_size
-	) const {
-		vec3d float_index = (position - grid_offset) / cell_size;
-		vec3s cell_index(float_index);
-		return { cell_index, float_index - vec3d(cell_index) };
-	}
-
-
-	void simulation::resize(vec3s sz) {
-		_grid = mac_grid(sz);
-		_space_hash = grid3<_cell_particles>(sz);
-	}
-
-	void simulation::update(double dt) {
+	template <typename T> void basic_simulation<T>::update(T dt) {
 		while (true) {
-			double ts = cfl_number * cfl();
+			T ts = cfl_number * cfl();
 			if (ts > dt) {
 				time_step(dt);
 				break;
@@ -40,124 +49,226 @@ namespace fluid {
 		}
 	}
 
-	void simulation::time_step(double dt) {
+	/// Accumulates the wall time between consecutive calls into the stages of a \ref time_step_statistics.
+	class _stage_timer {
+	public:
+		/// Starts timing.
+		explicit _stage_timer(time_step_statistics &stats) : _stats(stats), _last(std::chrono::steady_clock::now()) {
+		}
+
+		/// Adds the time since the last call to the given stage.
+		void lap(time_step_statistics::stage s) {
+			auto now = std::chrono::steady_clock::now();
+			_stats.stage_seconds[static_cast<std::size_t>(s)] += std::chrono::duration<double>(now - _last).count();
+			_last = now;
+		}
+		/// Discards the time since the last call. This is used to exclude callbacks from all stages.
+		void skip() {
+			_last = std::chrono::steady_clock::now();
+		}
+	private:
+		time_step_statistics &_stats; ///< The statistics.
+		std::chrono::steady_clock::time_point _last; ///< The time of the last call.
+	};
+
+	template <typename T> void basic_simulation<T>::time_step(T dt) {
+		using _stage = time_step_statistics::stage;
+		time_step_statistics stats;
+		stats.dt = dt;
+		stats.time_step_index = _time_step_index;
+		auto step_start = std::chrono::steady_clock::now();
+		_stage_timer timer(stats);
+
 		if (pre_time_step_callback) {
 			pre_time_step_callback(dt);
 		}
+		timer.skip();
+
+		if (!continuous_collision_detection) {
+			// solids are only compared near the fluid; collision detection does not rely on the field elsewhere
+			_solid_sdf.update(grid().cell_types(), _active_cells);
+		}
+		timer.lap(_stage::collision_detection);
+		if (narrow_band_width > 0) {
+			_advect_narrow_band(dt);
+			timer.lap(_stage::narrow_band);
+		}
 
 		// store old positions for collision detection
 		update_and_hash_particles();
+		timer.lap(_stage::hashing);
 		_advect_particles(dt);
+		timer.lap(_stage::advection);
 		if (post_advection_callback) {
 			post_advection_callback(dt);
 		}
+		timer.skip();
 
 		if constexpr (precise_collision_detection) {
 			_detect_collisions();
-			for (particle &p : _particles) {
-				p.old_position = p.position;
-			}
+			_particles.old_positions = _particles.positions;
+			timer.lap(_stage::collision_detection);
 		}
 
 		update_and_hash_particles();
+		timer.lap(_stage::hashing);
+		_update_sinks();
+		if (narrow_band_width > 0) {
+			_update_narrow_band_particles();
+		}
+		if (particle_density_control) {
+			_control_particle_density();
+		}
 		_update_sources();
+		_spawn_particles();
+		timer.lap(_stage::seeding);
 		hash_particles();
+		if (narrow_band_width > 0) {
+			_add_deep_liquid_cells();
+		}
+
+		_extrapolation_distance = velocity_extrapolation_iterations;
+		if (adaptive_velocity_extrapolation) {
+			// the number of cells that the fastest particle travels in this time step
+			auto travel = static_cast<std::size_t>(std::ceil(dt / cfl()));
+			_extrapolation_distance = std::max(_extrapolation_distance, travel + 1);
+		}
+		_update_active_cells();
+		timer.lap(_stage::hashing);
 
 		_transfer_to_grid();
+		timer.lap(_stage::particle_to_grid);
 		if (post_particle_to_grid_transfer_callback) {
 			post_particle_to_grid_transfer_callback(dt);
 		}
+		timer.skip();
 
 		// add gravity
-		for (std::size_t z = 0; z < grid().grid().get_size().z; ++z) {
-			for (std::size_t y = 0; y < grid().grid().get_size().y; ++y) {
-				for (std::size_t x = 0; x < grid().grid().get_size().x; ++x) {
-					grid().grid()(x, y, z).velocities_posface += gravity * dt;
+		vec3<T> gravity_dt = gravity * dt;
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			grid().velocities(dim).for_each_in_list_parallel(
+				_active_cells,
+				[delta = gravity_dt[dim]](std::size_t, T &vel) {
+					vel += delta;
 				}
-			}
+			);
 		}
+		timer.lap(_stage::gravity);
 		if (post_gravity_callback) {
 			post_gravity_callback(dt);
 		}
+		timer.skip();
 
 		std::vector<vec3s> fluid_cells;
 		if constexpr (precise_collision_detection) {
 			for (std::size_t raw : _fluid_cells) {
-				fluid_cells.emplace_back(grid().grid().index_from_raw(raw));
+				fluid_cells.emplace_back(grid().index_from_raw(raw));
 			}
 		} else {
 			for (std::size_t raw : _fluid_cells) {
-				if (grid().grid()[raw].cell_type != mac_grid::cell::type::solid) {
-					fluid_cells.emplace_back(grid().grid().index_from_raw(raw));
+				if (grid().cell_types()[raw] != mac_grid::cell::type::solid) {
+					fluid_cells.emplace_back(grid().index_from_raw(raw));
 				}
 			}
 		}
 
+		timer.lap(_stage::pressure_build);
+
 		// solve and apply pressure
 		{
-			pressure_solver solver(*this, fluid_cells);
-			auto [pressure, residual, iters] = solver.solve(dt);
+			auto [pressure, residual, iters] = _solver.solve(*this, fluid_cells, dt);
+			timer.lap(_stage::pressure_solve);
+			// the solver reports how much of the solve was spent building the system
+			double setup = _solver.get_last_setup_seconds();
+			stats.stage_seconds[static_cast<std::size_t>(_stage::pressure_solve)] -= setup;
+			stats.stage_seconds[static_cast<std::size_t>(_stage::pressure_build)] += setup;
+			stats.pressure_residual = residual;
+			stats.pressure_iterations = iters;
 			if (post_pressure_solve_callback) {
 				post_pressure_solve_callback(dt, pressure, residual, iters);
 			}
+			timer.skip();
 
-			solver.apply_pressure(dt, pressure);
+			_solver.apply_pressure(dt, pressure);
+			timer.lap(_stage::pressure_apply);
 			if (post_apply_pressure_callback) {
 				post_apply_pressure_callback(dt);
 			}
+			timer.skip();
 		}
 
 		_correct_positions(dt);
+		timer.lap(_stage::position_correction);
 		if (post_correction_callback) {
 			post_correction_callback(dt);
 		}
+		timer.skip();
 		_detect_collisions();
-		for (particle &p : _particles) {
-			p.old_position = p.position;
-		}
+		_particles.old_positions = _particles.positions;
+		timer.lap(_stage::collision_detection);
 
 		_extrapolate_velocities(fluid_cells);
+		timer.lap(_stage::velocity_extrapolation);
 
 		_transfer_from_grid();
+		timer.lap(_stage::grid_to_particle);
 		if (post_grid_to_particle_transfer_callback) {
 			post_grid_to_particle_transfer_callback(dt);
 		}
+
+		++_time_step_index;
+
+		stats.total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - step_start).count();
+		stats.num_particles = _particles.size();
+		stats.num_fluid_cells = fluid_cells.size();
+		stats.num_active_cells = _active_cells.size();
+		stats.allocated_bytes = get_allocated_bytes();
+		_last_statistics = stats;
+		if (statistics_history_length > 0) {
+			_statistics_history.emplace_back(stats);
+			while (_statistics_history.size() > statistics_history_length) {
+				_statistics_history.pop_front();
+			}
+		}
 	}
 
-	void simulation::time_step() {
-		time_step(std::min(cfl_number * cfl(), 0.033));
+	template <typename T> void basic_simulation<T>::time_step() {
+		time_step(std::min(cfl_number * cfl(), static_cast<T>(0.033)));
 	}
 
-	void simulation::reset_space_hash() {
-		_space_hash.fill(_cell_particles());
+	template <typename T> void basic_simulation<T>::reset_space_hash() {
+		_space_hash.deactivate_all();
 		_fluid_cells.clear();
 	}
 
-	void simulation::seed_cell(vec3s cell, vec3d velocity, std::size_t dens) {
+	template <typename T> void basic_simulation<T>::seed_cell(vec3s cell, vec3<T> velocity, std::size_t dens) {
 		std::size_t
-			index = grid().grid().index_to_raw(cell),
+			index = grid().index_to_raw(cell),
 			num = _space_hash(cell).count,
 			target = dens * dens * dens;
-		std::uniform_real_distribution<double> dist(0.0, cell_size);
-		vec3d offset = grid_offset + vec3d(cell) * cell_size;
+		std::uniform_real_distribution<T> dist(0.0, cell_size);
+		vec3<T> offset = grid_offset + vec3<T>(cell) * cell_size;
 		for (; num < target; ++num) {
 			particle p;
-			p.old_position = p.position = offset + vec3d(dist(random), dist(random), dist(random));
+			p.old_position = p.position = offset + vec3<T>(dist(random), dist(random), dist(random));
 			p.velocity = velocity;
 			p.raw_cell_index = index;
-			_particles.emplace_back(p);
+			_particles.push_back(p);
 		}
-		_space_hash(cell).count = target;
+		_space_hash.activate_tile(_space_hash.get_raw_tile_of(cell));
+		_space_hash.at_active(cell).count = target;
 	}
 
-	void simulation::seed_box(vec3d start, vec3d size, vec3d vel, std::size_t dens) {
-		vec3d end = start + size;
+	template <typename T> void basic_simulation<T>::seed_box(
+		vec3<T> start, vec3<T> size, vec3<T> vel, std::size_t dens
+	) {
+		vec3<T> end = start + size;
 		vec3s
 			start_cell = world_position_to_cell_index_unclamped(start),
 			end_cell = world_position_to_cell_index_unclamped(end);
 		seed_func(
 			start_cell, end_cell - start_cell + vec3s(1, 1, 1),
-			[&](vec3d pos) {
+			[&](vec3<T> pos) {
 				return
 					pos.x > start.x && pos.y > start.y && pos.z > start.z &&
 					pos.x < end.x && pos.y < end.y && pos.z < end.z;
@@ -166,238 +277,519 @@ namespace fluid {
 				);
 	}
 
-	void simulation::seed_sphere(vec3d center, double radius, vec3d vel, std::size_t dens) {
+	template <typename T> void basic_simulation<T>::seed_sphere(
+		vec3<T> center, T radius, vec3<T> vel, std::size_t dens
+	) {
 		vec3s
-			start_cell = world_position_to_cell_index_unclamped(center - vec3d(radius, radius, radius)),
-			end_cell = world_position_to_cell_index_unclamped(center + vec3d(radius, radius, radius));
-		double sqr_radius = radius * radius;
+			start_cell = world_position_to_cell_index_unclamped(center - vec3<T>(radius, radius, radius)),
+			end_cell = world_position_to_cell_index_unclamped(center + vec3<T>(radius, radius, radius));
+		T sqr_radius = radius * radius;
 		seed_func(
 			start_cell, end_cell - start_cell + vec3s(1, 1, 1),
-			[&](vec3d pos) {
+			[&](vec3<T> pos) {
 				return (pos - center).squared_length() < sqr_radius;
 			},
 			vel, dens
 				);
 	}
 
-	vec3s simulation::world_position_to_cell_index(vec3d pos) const {
+	template <typename T> void basic_simulation<T>::encode_particles(compact_particle_storage &result) const {
+		result.encode(_particles, grid().get_size(), grid_offset, cell_size);
+	}
+
+	template <typename T> void basic_simulation<T>::decode_particles(const compact_particle_storage &source) {
+		source.decode(_particles, grid().get_size(), grid_offset, cell_size);
+	}
+
+	template <typename T> vec3s basic_simulation<T>::world_position_to_cell_index(vec3<T> pos) const {
 		return vec_ops::apply<vec3s>(
 			static_cast<const std::size_t & (*)(const std::size_t&, const std::size_t&)>(std::min),
-			world_position_to_cell_index_unclamped(pos), grid().grid().get_size()
+			world_position_to_cell_index_unclamped(pos), grid().get_size()
 		);
 	}
 
-	vec3s simulation::world_position_to_cell_index_unclamped(vec3d pos) const {
+	template <typename T> vec3s basic_simulation<T>::world_position_to_cell_index_unclamped(vec3<T> pos) const {
 		return vec_ops::apply<vec3s>(
-			[](double v) {
-				return static_cast<std::size_t>(std::max(v, 0.0));
+			[](T v) {
+				return static_cast<std::size_t>(std::max(v, static_cast<T>(0)));
 			},
 			(pos - grid_offset) / cell_size
 				);
 	}
 
-	double simulation::cfl() const {
-		double maxlen = 0.0;
-		for (const particle &p : particles()) {
-			maxlen = std::max(maxlen, p.velocity.squared_length());
-		}
-		return cell_size / std::sqrt(maxlen);
+	/// Returns the number of bytes used by the storage of the given grid.
+	template <typename Cell> [[nodiscard]] std::size_t _get_grid_bytes(const grid3<Cell> &grid) {
+		return grid.get_storage_size() * sizeof(Cell);
 	}
-
-	double simulation::_kernel(vec3d p) const {
-		// linear kernel
-		return
-			std::max(0.0, 1.0 - std::abs(p.x)) *
-			std::max(0.0, 1.0 - std::abs(p.y)) *
-			std::max(0.0, 1.0 - std::abs(p.z));
+	/// Returns the number of bytes allocated by the given vector.
+	template <typename T> [[nodiscard]] std::size_t _get_vector_bytes(const std::vector<T> &vec) {
+		return vec.capacity() * sizeof(T);
+	}
+	template <typename T> std::size_t basic_simulation<T>::get_allocated_bytes() const {
+		std::size_t result = 0;
+		result += _particles.get_allocated_bytes();
+		for (const std::vector<std::size_t> &cells : _hash_scratch.layer_fluid_cells) {
+			result += _get_vector_bytes(cells);
+		}
+		for (const basic_mac_grid<T> *g : { &_grid, &_old_grid }) {
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				result += _get_grid_bytes(g->velocities(dim));
+			}
+			result += _get_grid_bytes(g->cell_types());
+		}
+		for (const grid3<T> &vel : _deep_velocities) {
+			result += _get_grid_bytes(vel);
+		}
+		for (const grid3<double> &distances : _band_distances) {
+			result += _get_grid_bytes(distances);
+		}
+		result +=
+			_solver.get_allocated_bytes() + _space_hash.get_allocated_bytes() +
+			_get_grid_bytes(_solid_sdf.get_distances()) + _get_grid_bytes(_face_weights) +
+			_get_grid_bytes(_extrapolation_valid) + _get_grid_bytes(_active_cell_flags) +
+			_get_grid_bytes(_band_scratch[0]) + _get_grid_bytes(_band_scratch[1]) +
+			_get_grid_bytes(_narrow_band_flags) + _get_grid_bytes(_liquid_phi) +
+			_get_grid_bytes(_band_labels) + _get_grid_bytes(_band_phi) + _get_vector_bytes(_deep_cells) +
+			_get_vector_bytes(_fluid_cells) + _get_vector_bytes(_grid_tile_flags) +
+			_get_vector_bytes(_active_grid_tiles) + _get_vector_bytes(_active_cells) +
+			_get_vector_bytes(_free_particles) + _get_vector_bytes(_particle_seeds) +
+			_get_vector_bytes(_hash_scratch.chunk_offsets) + _get_vector_bytes(_hash_scratch.layer_begin) +
+			_get_vector_bytes(_hash_scratch.layer_sorted) + _get_vector_bytes(_hash_scratch.order) +
+			_get_vector_bytes(_hash_scratch.layer_fluid_cells);
+		return result;
 	}
 
-	vec3d simulation::_grad_kernel(vec3d p) const {
-		vec3d neg_sign = vec_ops::apply<vec3d>(
-			[](double d) {
-				return d > 0.0 ? -1.0 : 1.0;
-			},
-			p
-				);
-		vec3d n = vec3d(1.0, 1.0, 1.0) - vec_ops::apply<vec3d>(static_cast<double (*)(double)>(std::abs), p);
-		return vec3d(neg_sign.x * n.y * n.z, n.x * neg_sign.y * n.z, n.x * n.y * neg_sign.z) / cell_size;
+	template <typename T> T basic_simulation<T>::cfl() const {
+		T maxlen = 0.0;
+		for (vec3<T> v : _particles.velocities) {
+			maxlen = std::max(maxlen, v.squared_length());
+		}
+		return cell_size / std::sqrt(maxlen);
 	}
 
-	void simulation::_advect_particles(double dt) {
+	template <typename T> void basic_simulation<T>::_advect_particles(T dt) {
 		for (auto &src : sources) {
 			if (src->active && src->coerce_velocity) {
 				for (vec3s v : src->cells) {
 					_cell_particles cell = _space_hash(v);
 					for (std::size_t c = cell.begin, i = 0; i < cell.count; ++i, ++c) {
-						particle &p = _particles[c];
-						p.velocity = src->velocity;
-						p.cx = p.cy = p.cz = vec3d();
+						_particles.velocities[c] = vec3<T>(src->velocity);
+						_particles.cx[c] = _particles.cy[c] = _particles.cz[c] = vec3<T>();
 					}
 				}
 			}
 		}
 
-		vec3d
-			skin_width = vec3d(boundary_skin_width, boundary_skin_width, boundary_skin_width),
+		vec3<T>
+			skin_width = vec3<T>(boundary_skin_width, boundary_skin_width, boundary_skin_width),
 			min_corner = grid_offset + skin_width,
-			max_corner = cell_size * vec3d(grid().grid().get_size()) + grid_offset - skin_width;
-		for (particle &p : _particles) {
-			p.position += p.velocity * dt;
+			max_corner = cell_size * vec3<T>(grid().get_size()) + grid_offset - skin_width;
+		int num_particles = static_cast<int>(_particles.size());
+#pragma omp parallel for
+		for (int i = 0; i < num_particles; ++i) {
+			vec3<T> &pos = _particles.positions[i];
+			pos += _particles.velocities[i] * dt;
 			// clamp the particle back into the grid
-			vec_ops::apply_to(p.position, std::clamp<double>, p.position, min_corner, max_corner);
+			vec_ops::apply_to(pos, std::clamp<T>, pos, min_corner, max_corner);
 		}
 	}
 
-	void simulation::update_and_hash_particles() {
-		for (particle &p : _particles) {
-			vec3d grid_pos = (p.position - grid_offset) / cell_size;
+	template <typename T> void basic_simulation<T>::update_and_hash_particles() {
+		int num_particles = static_cast<int>(_particles.size());
+#pragma omp parallel for
+		for (int i = 0; i < num_particles; ++i) {
+			vec3<T> grid_pos = (_particles.positions[i] - grid_offset) / cell_size;
 			vec3s grid_index = vec_ops::apply<vec3s>(
-				[](double pos, std::size_t max) {
-					return std::min(static_cast<std::size_t>(std::max(pos, 0.0)), max - 1);
+				[](T pos, std::size_t max) {
+					return std::min(static_cast<std::size_t>(std::max(pos, static_cast<T>(0))), max - 1);
 				},
-				grid_pos, grid().grid().get_size()
+				grid_pos, grid().get_size()
 					);
-			p.raw_cell_index = grid().grid().index_to_raw(grid_index);
+			_particles.raw_cell_indices[i] = grid().index_to_raw(grid_index);
 		}
 
 		hash_particles();
 	}
 
-	void simulation::hash_particles() {
+	template <typename T> void basic_simulation<T>::hash_particles() {
 		reset_space_hash();
 
-		std::sort(_particles.begin(), _particles.end(), [](const particle &lhs, const particle &rhs) {
-			return lhs.raw_cell_index < rhs.raw_cell_index;
-		});
+		// this is a stable counting sort that is done in two passes. the first pass partitions particles into
+		// layers of cells with the same Z coordinate, in parallel over fixed-size chunks of particles. the second
+		// pass sorts particles inside each layer, in parallel over layers, and fills _space_hash along the way.
+		// the result is a permutation that is then applied to each particle array once
+		constexpr std::size_t chunk_size = 1 << 16;
+
+		const std::vector<std::size_t> &raw_indices = _particles.raw_cell_indices;
+		std::size_t
+			num_particles = raw_indices.size(),
+			num_layers = grid().get_size().z,
+			layer_size = grid().get_size().x * grid().get_size().y,
+			num_chunks = (num_particles + chunk_size - 1) / chunk_size;
+		if (num_particles == 0) {
+			return;
+		}
 
-		if (_particles.size() > 0) {
+		// histogram of each chunk
+		std::vector<std::size_t> &chunk_offsets = _hash_scratch.chunk_offsets;
+		chunk_offsets.assign(num_chunks * num_layers, 0);
+		int inum_chunks = static_cast<int>(num_chunks);
+#pragma omp parallel for
+		for (int ichunk = 0; ichunk < inum_chunks; ++ichunk) {
+			auto chunk = static_cast<std::size_t>(ichunk);
+			std::size_t *counts = &chunk_offsets[chunk * num_layers];
+			std::size_t end = std::min(num_particles, (chunk + 1) * chunk_size);
+			for (std::size_t i = chunk * chunk_size; i < end; ++i) {
+				++counts[raw_indices[i] / layer_size];
+			}
+		}
+		// prefix sum, visiting chunks in order for each layer to keep the sort stable
+		std::vector<std::size_t> &layer_begin = _hash_scratch.layer_begin;
+		layer_begin.resize(num_layers + 1);
+		std::size_t sum = 0;
+		for (std::size_t layer = 0; layer < num_layers; ++layer) {
+			layer_begin[layer] = sum;
+			for (std::size_t chunk = 0; chunk < num_chunks; ++chunk) {
+				std::size_t &offset = chunk_offsets[chunk * num_layers + layer];
+				std::size_t count = offset;
+				offset = sum;
+				sum += count;
+			}
+		}
+		layer_begin[num_layers] = sum;
+		// scatter
+		std::vector<std::size_t> &layer_sorted = _hash_scratch.layer_sorted;
+		layer_sorted.resize(num_particles);
+#pragma omp parallel for
+		for (int ichunk = 0; ichunk < inum_chunks; ++ichunk) {
+			auto chunk = static_cast<std::size_t>(ichunk);
+			std::size_t *offsets = &chunk_offsets[chunk * num_layers];
+			std::size_t end = std::min(num_particles, (chunk + 1) * chunk_size);
+			for (std::size_t i = chunk * chunk_size; i < end; ++i) {
+				layer_sorted[offsets[raw_indices[i] / layer_size]++] = i;
+			}
+		}
+
+		// activate the tiles that contain particles, in parallel over slabs of layers that are one tile thick so
+		// that no two threads activate the same tile
+		constexpr std::size_t tile_size = sparse_grid<_cell_particles>::tile_size;
+		int num_tile_slabs = static_cast<int>((num_layers + tile_size - 1) / tile_size);
+#pragma omp parallel for schedule(dynamic)
+		for (int islab = 0; islab < num_tile_slabs; ++islab) {
+			auto slab = static_cast<std::size_t>(islab);
 			std::size_t
-				last_cell = _particles.front().raw_cell_index, // the cell the last particle is in
-				count = 1;
-			_fluid_cells.emplace_back(last_cell);
-			for (std::size_t i = 1; i < _particles.size(); ++i, ++count) {
-				std::size_t cur_cell = _particles[i].raw_cell_index;
-				if (cur_cell != last_cell) {
-					_space_hash[last_cell].count = count;
-					count = 0;
-
-					_fluid_cells.emplace_back(cur_cell);
-					_space_hash[cur_cell].begin = i;
-					last_cell = cur_cell;
-				}
-			}
-			_space_hash[last_cell].count = count;
-		}
-	}
-
-	void simulation::_transfer_to_grid_pic() {
-		double half_cell = 0.5 * cell_size;
-		double zpos = grid_offset.z + half_cell;
-		for (std::size_t z = 0; z < grid().grid().get_size().z; ++z, zpos += cell_size) {
-			double zpos_face = zpos + half_cell, ypos = grid_offset.y + half_cell;
-			for (std::size_t y = 0; y < grid().grid().get_size().y; ++y, ypos += cell_size) {
-				double ypos_face = ypos + half_cell, xpos = grid_offset.x + half_cell;
-				for (std::size_t x = 0; x < grid().grid().get_size().x; ++x, xpos += cell_size) {
-					mac_grid::cell &cell = grid().grid()(x, y, z);
-					double xpos_face = xpos + half_cell;
-
-					vec3d sum_vel, sum_weight;
-					vec3d
-						xface(xpos_face, ypos, zpos),
-						yface(xpos, ypos_face, zpos),
-						zface(xpos, ypos, zpos_face);
-					_for_all_nearby_particles(
-						vec3s(x, y, z), vec3s(1, 1, 1), vec3s(1, 1, 1),
-						[&](particle &p) {
-							vec3d weights(
-								_kernel((p.position - xface) / cell_size),
-								_kernel((p.position - yface) / cell_size),
-								_kernel((p.position - zface) / cell_size)
-							);
-							sum_weight += weights;
-							sum_vel += vec_ops::memberwise::mul(weights, p.velocity);
-						}
-					);
-					vec_ops::apply_to(
-						cell.velocities_posface,
-						[](double vel, double weight) {
-							return weight > 1e-6 ? vel / weight : 0.0; // TODO magic number
-						},
-						sum_vel, sum_weight
-							);
-
-					if (cell.cell_type != mac_grid::cell::type::solid) {
-						cell.cell_type = mac_grid::cell::type::air;
-						if (_space_hash(x, y, z).count > 0) {
-							cell.cell_type = mac_grid::cell::type::fluid;
-						}
-					}
+				begin = layer_begin[slab * tile_size],
+				end = layer_begin[std::min((slab + 1) * tile_size, num_layers)];
+			for (std::size_t i = begin; i < end; ++i) {
+				_space_hash.activate_tile(_space_hash.get_raw_tile_of(
+					grid().index_from_raw(raw_indices[layer_sorted[i]])
+				));
+			}
+		}
+		_space_hash.collect_active_tiles();
+
+		// sort each layer. only cells that contain particles are visited, so this does not depend on the size of
+		// the grid
+		std::vector<std::size_t> &order = _hash_scratch.order;
+		order.resize(num_particles);
+		std::vector<std::vector<std::size_t>> &layer_fluid_cells = _hash_scratch.layer_fluid_cells;
+		layer_fluid_cells.resize(num_layers);
+		int inum_layers = static_cast<int>(num_layers);
+#pragma omp parallel for schedule(dynamic)
+		for (int ilayer = 0; ilayer < inum_layers; ++ilayer) {
+			auto layer = static_cast<std::size_t>(ilayer);
+			std::vector<std::size_t> &cells = layer_fluid_cells[layer];
+			cells.clear();
+			std::size_t begin = layer_begin[layer], end = layer_begin[layer + 1];
+			if (begin == end) {
+				continue;
+			}
+			for (std::size_t i = begin; i < end; ++i) {
+				std::size_t raw = raw_indices[layer_sorted[i]];
+				if (++_space_hash.at_active(grid().index_from_raw(raw)).count == 1) {
+					cells.emplace_back(raw);
 				}
 			}
+			std::sort(cells.begin(), cells.end());
+			// here _cell_particles::begin is used as the insertion cursor
+			std::size_t cursor = begin;
+			for (std::size_t cell : cells) {
+				_cell_particles &cell_particles = _space_hash.at_active(grid().index_from_raw(cell));
+				cell_particles.begin = cursor;
+				cursor += cell_particles.count;
+			}
+			for (std::size_t i = begin; i < end; ++i) {
+				std::size_t particle_index = layer_sorted[i];
+				_cell_particles &cell_particles =
+					_space_hash.at_active(grid().index_from_raw(raw_indices[particle_index]));
+				order[cell_particles.begin++] = particle_index;
+			}
+			for (std::size_t cell : cells) {
+				_cell_particles &cell_particles = _space_hash.at_active(grid().index_from_raw(cell));
+				cell_particles.begin -= cell_particles.count;
+			}
+		}
+
+		for (const std::vector<std::size_t> &cells : layer_fluid_cells) {
+			_fluid_cells.insert(_fluid_cells.end(), cells.begin(), cells.end());
+		}
+		// the second hashing in each time step often only appends particles that are already in order
+		bool sorted = true;
+		for (std::size_t i = 0; i < num_particles; ++i) {
+			if (order[i] != i) {
+				sorted = false;
+				break;
+			}
+		}
+		if (!sorted) {
+			_particles.permute(order);
 		}
 	}
 
-	void simulation::_transfer_to_grid_flip() {
-		_transfer_to_grid_pic();
-		_old_grid = _grid;
-		_remove_boundary_velocities(_old_grid);
+	template <typename T> void basic_simulation<T>::_update_active_cells() {
+		constexpr std::size_t tile_size = sparse_grid<_cell_particles>::tile_size;
+		std::size_t radius = _get_active_band_radius(), tile_radius = (radius + tile_size - 1) / tile_size;
+
+		// find tiles that may contain cells in the band
+		for (unsigned char &flags : _grid_tile_flags) {
+			flags = (flags & _active_current) ? _active_previous : 0;
+		}
+		vec3s num_tiles = _space_hash.get_tile_count();
+		for (std::size_t tile : _space_hash.get_active_tiles()) {
+			vec3s index = _space_hash.tile_index_from_raw(tile);
+			vec3s
+				min_tile = vec_ops::apply<vec3s>(
+					[tile_radius](std::size_t v) {
+						return v < tile_radius ? 0 : v - tile_radius;
+					},
+					index
+						),
+				max_tile = vec_ops::apply<vec3s>(
+					[tile_radius](std::size_t v, std::size_t max) {
+						return std::min(v + tile_radius + 1, max);
+					},
+					index, num_tiles
+						);
+			for (std::size_t z = min_tile.z; z < max_tile.z; ++z) {
+				for (std::size_t y = min_tile.y; y < max_tile.y; ++y) {
+					for (std::size_t x = min_tile.x; x < max_tile.x; ++x) {
+						_grid_tile_flags[_space_hash.tile_index_to_raw(vec3s(x, y, z))] |= _active_current;
+					}
+				}
+			}
+		}
+		_active_grid_tiles.clear();
+		for (std::size_t i = 0; i < _grid_tile_flags.size(); ++i) {
+			if (_grid_tile_flags[i] != 0) {
+				_active_grid_tiles.emplace_back(i);
+			}
+		}
+
+		// dilate fluid cells by the radius along each axis in turn. cells outside of the active tiles are further
+		// away from fluid cells than the radius, so their values are always zero
+		vec3s grid_size = grid().get_size();
+		int inum_tiles = static_cast<int>(_active_grid_tiles.size());
+		auto dilate = [&](std::size_t dim, const auto &is_set, auto &&store) {
+#pragma omp parallel for
+			for (int i = 0; i < inum_tiles; ++i) {
+				auto tile_id = static_cast<std::size_t>(i);
+				_space_hash.for_each_cell_in_tile(_active_grid_tiles[tile_id], [&](vec3s cell) {
+					std::size_t
+						min_coord = cell[dim] < radius ? 0 : cell[dim] - radius,
+						max_coord = std::min(cell[dim] + radius + 1, grid_size[dim]);
+					bool set = false;
+					vec3s neighbor = cell;
+					for (neighbor[dim] = min_coord; !set && neighbor[dim] < max_coord; ++neighbor[dim]) {
+						set = is_set(neighbor);
+					}
+					store(tile_id, cell, set);
+				});
+			}
+		};
+		dilate(
+			0,
+			[this](vec3s cell) {
+				return _space_hash(cell).count > 0 || _is_deep_liquid(grid().index_to_raw(cell));
+			},
+			[this](std::size_t, vec3s cell, bool set) {
+				_band_scratch[0](cell) = set ? 1 : 0;
+			}
+		);
+		dilate(
+			1,
+			[this](vec3s cell) {
+				return _band_scratch[0](cell) != 0;
+			},
+			[this](std::size_t, vec3s cell, bool set) {
+				_band_scratch[1](cell) = set ? 1 : 0;
+			}
+		);
+		std::vector<std::vector<std::size_t>> tile_cells(_active_grid_tiles.size());
+		dilate(
+			2,
+			[this](vec3s cell) {
+				return _band_scratch[1](cell) != 0;
+			},
+			[this, &tile_cells](std::size_t tile_id, vec3s cell, bool set) {
+				std::size_t raw = grid().index_to_raw(cell);
+				unsigned char &flags = _active_cell_flags[raw];
+				flags = (flags & _active_current) ? _active_previous : 0;
+				if (set) {
+					flags |= _active_current;
+				}
+				if (flags != 0) {
+					tile_cells[tile_id].emplace_back(raw);
+				}
+			}
+		);
+
+		_active_cells.clear();
+		for (const std::vector<std::size_t> &cells : tile_cells) {
+			_active_cells.insert(_active_cells.end(), cells.begin(), cells.end());
+		}
 	}
 
-	void simulation::_transfer_to_grid_apic() {
-		double half_cell = 0.5 * cell_size;
-		double zpos = grid_offset.z + half_cell;
-		for (std::size_t z = 0; z < grid().grid().get_size().z; ++z, zpos += cell_size) {
-			double zpos_face = zpos + half_cell, ypos = grid_offset.y + half_cell;
-			for (std::size_t y = 0; y < grid().grid().get_size().y; ++y, ypos += cell_size) {
-				double ypos_face = ypos + half_cell, xpos = grid_offset.x + half_cell;
-				for (std::size_t x = 0; x < grid().grid().get_size().x; ++x, xpos += cell_size) {
-					mac_grid::cell &cell = grid().grid()(x, y, z);
-					double xpos_face = xpos + half_cell;
-
-					vec3d sum_vel, sum_weight;
-					vec3d
-						xface(xpos_face, ypos, zpos),
-						yface(xpos, ypos_face, zpos),
-						zface(xpos, ypos, zpos_face);
-					_for_all_nearby_particles(
-						vec3s(x, y, z), vec3s(1, 1, 1), vec3s(1, 1, 1),
-						[&](particle &p) {
-							vec3d
-								weights(
-									_kernel(p.position - xface),
-									_kernel(p.position - yface),
-									_kernel(p.position - zface)
-								),
-								affine(
-									vec_ops::dot(p.cx, xface - p.position),
-									vec_ops::dot(p.cy, yface - p.position),
-									vec_ops::dot(p.cz, zface - p.position)
-								);
-							sum_weight += weights;
-							sum_vel += vec_ops::memberwise::mul(weights, p.velocity + affine);
+	template <typename T> template <bool Affine> void basic_simulation<T>::_scatter_to_grid() {
+		vec3s grid_size = grid().get_size();
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			grid().velocities(dim).for_each_in_list_parallel(
+				_active_cells,
+				[](std::size_t, T &vel) {
+					vel = 0.0;
+				}
+			);
+		}
+		_face_weights.for_each_in_list_parallel(
+			_active_cells,
+			[](std::size_t, vec3<T> &weights) {
+				weights = vec3<T>();
+			}
+		);
+
+		// particles are sorted by their raw cell indices, so particles in each slab are stored consecutively
+		std::size_t
+			layer_size = grid_size.x * grid_size.y,
+			num_slabs = (grid_size.z + _transfer_slab_thickness - 1) / _transfer_slab_thickness;
+		std::vector<std::size_t> slab_begin(num_slabs + 1);
+		for (std::size_t i = 0; i <= num_slabs; ++i) {
+			std::size_t first_cell = std::min(i * _transfer_slab_thickness, grid_size.z) * layer_size;
+			slab_begin[i] = static_cast<std::size_t>(std::lower_bound(
+				_particles.raw_cell_indices.begin(), _particles.raw_cell_indices.end(), first_cell
+			) - _particles.raw_cell_indices.begin());
+		}
+
+		vec3i isize(grid_size);
+		auto scatter = [&](std::size_t i) {
+			vec3<T> position = _particles.positions[i], grid_pos = (position - grid_offset) / cell_size;
+			// for each velocity component, the index of the first cell in the 2x2x2 stencil and the fraction
+			// position inside the stencil
+			vec3i base[3];
+			vec3<T> frac[3];
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				vec3<T> face_pos = grid_pos - vec3<T>(0.5, 0.5, 0.5);
+				face_pos[dim] -= 0.5;
+				base[dim] = vec_ops::apply<vec3i>(
+					[](T coord) {
+						return static_cast<int>(std::floor(coord));
+					},
+					face_pos
+						);
+				frac[dim] = face_pos - vec3<T>(base[dim]);
+			}
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				for (int dz = 0; dz < 2; ++dz) {
+					int z = base[dim].z + dz;
+					if (z < 0 || z >= isize.z) {
+						continue;
+					}
+					T wz = dz == 0 ? 1.0 - frac[dim].z : frac[dim].z;
+					for (int dy = 0; dy < 2; ++dy) {
+						int y = base[dim].y + dy;
+						if (y < 0 || y >= isize.y) {
+							continue;
 						}
-					);
-					vec_ops::apply_to(
-						cell.velocities_posface,
-						[](double vel, double weight) {
-							return weight > 1e-6 ? vel / weight : 0.0; // TODO magic number
-						},
-						sum_vel, sum_weight
-							);
-
-					if (cell.cell_type != mac_grid::cell::type::solid) {
-						cell.cell_type = mac_grid::cell::type::air;
-						if (_space_hash(x, y, z).count > 0) {
-							cell.cell_type = mac_grid::cell::type::fluid;
+						T wyz = wz * (dy == 0 ? 1.0 - frac[dim].y : frac[dim].y);
+						for (int dx = 0; dx < 2; ++dx) {
+							int x = base[dim].x + dx;
+							if (x < 0 || x >= isize.x) {
+								continue;
+							}
+							T weight = wyz * (dx == 0 ? 1.0 - frac[dim].x : frac[dim].x);
+							T vel = _particles.velocities[i][dim];
+							if constexpr (Affine) {
+								vec3<T> face = vec3<T>(vec3i(x, y, z)) + vec3<T>(0.5, 0.5, 0.5);
+								face[dim] += 0.5;
+								const vec3<T> &c =
+									dim == 0 ? _particles.cx[i] : (dim == 1 ? _particles.cy[i] : _particles.cz[i]);
+								vel += vec_ops::dot(c, grid_offset + face * cell_size - position);
+							}
+							std::size_t raw = grid().index_to_raw(vec3s(vec3i(x, y, z)));
+							grid().velocities(dim)[raw] += weight * vel;
+							_face_weights[raw][dim] += weight;
 						}
 					}
 				}
 			}
+		};
+		for (std::size_t parity = 0; parity < 2; ++parity) {
+			int inum_slabs = static_cast<int>(num_slabs);
+#pragma omp parallel for schedule(dynamic)
+			for (int slab = static_cast<int>(parity); slab < inum_slabs; slab += 2) {
+				auto slab_id = static_cast<std::size_t>(slab);
+				for (std::size_t i = slab_begin[slab_id]; i < slab_begin[slab_id + 1]; ++i) {
+					scatter(i);
+				}
+			}
 		}
+
+		grid().cell_types().for_each_in_list_parallel(
+			_active_cells,
+			[this](std::size_t raw, mac_grid::cell::type &type) {
+				bool deep = _is_deep_liquid(raw);
+				for (std::size_t dim = 0; dim < 3; ++dim) {
+					T &vel = grid().velocities(dim)[raw], weight = _face_weights[raw][dim];
+					if (weight > 1e-6) { // TODO magic number
+						vel /= weight;
+					} else {
+						vel = deep ? _deep_velocities[dim][raw] : 0.0;
+					}
+				}
+
+				if (type != mac_grid::cell::type::solid) {
+					type = mac_grid::cell::type::air;
+					if (deep || _space_hash(grid().index_from_raw(raw)).count > 0) {
+						type = mac_grid::cell::type::fluid;
+					}
+				}
+			}
+		);
+	}
+
+	template <typename T> void basic_simulation<T>::_transfer_to_grid_pic() {
+		_scatter_to_grid<false>();
+	}
+
+	template <typename T> void basic_simulation<T>::_transfer_to_grid_flip() {
+		_transfer_to_grid_pic();
+		// velocities outside of the active cells are zero in both grids, so only the active cells are copied
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			const grid3<T> &velocities = grid().velocities(dim);
+			_old_grid.velocities(dim).for_each_in_list_parallel(
+				_active_cells,
+				[&velocities](std::size_t raw, T &vel) {
+					vel = velocities[raw];
+				}
+			);
+		}
+		_remove_boundary_velocities(_old_grid);
+	}
+
+	template <typename T> void basic_simulation<T>::_transfer_to_grid_apic() {
+		_scatter_to_grid<true>();
 		_remove_boundary_velocities(_grid);
 	}
 
-	void simulation::_transfer_to_grid() {
+	template <typename T> void basic_simulation<T>::_transfer_to_grid() {
 		switch (simulation_method) {
 		case method::pic:
 			_transfer_to_grid_pic();
@@ -411,141 +803,337 @@ namespace fluid {
 		}
 	}
 
-	vec3d simulation::_get_negative_face_velocities(const mac_grid &grid, vec3s id) {
-		vec3d neg_vel;
+	template <typename T> vec3<T> basic_simulation<T>::_get_negative_face_velocities(
+		const basic_mac_grid<T> &grid, vec3s id
+	) {
+		vec3<T> neg_vel;
 		if (id.x > 0) {
-			neg_vel.x = grid.grid()(id - vec3s::axis<0>()).velocities_posface.x;
+			neg_vel.x = grid.velocities(0)(id - vec3s::axis<0>());
 		}
 		if (id.y > 0) {
-			neg_vel.y = grid.grid()(id - vec3s::axis<1>()).velocities_posface.y;
+			neg_vel.y = grid.velocities(1)(id - vec3s::axis<1>());
 		}
 		if (id.z > 0) {
-			neg_vel.z = grid.grid()(id - vec3s::axis<2>()).velocities_posface.z;
+			neg_vel.z = grid.velocities(2)(id - vec3s::axis<2>());
 		}
 		return neg_vel;
 	}
 
-	void simulation::_remove_boundary_velocities(mac_grid &g) {
-		vec3s max_pos = g.grid().get_size() - vec3s(1, 1, 1);
-		if (g.grid().get_array_size(g.grid().get_size()) > 0) {
-			for (std::size_t z = 0; z < g.grid().get_size().z; ++z) {
-				for (std::size_t y = 0; y < g.grid().get_size().y; ++y) {
-					g.grid()(max_pos.x, y, z).velocities_posface.x = 0.0;
+	template <typename T> void basic_simulation<T>::_remove_boundary_velocities(basic_mac_grid<T> &g) {
+		vec3s max_pos = g.get_size() - vec3s(1, 1, 1);
+		if (g.get_cell_count() > 0) {
+			for (std::size_t z = 0; z < g.get_size().z; ++z) {
+				for (std::size_t y = 0; y < g.get_size().y; ++y) {
+					g.velocities(0)(max_pos.x, y, z) = 0.0;
 				}
-				for (std::size_t x = 0; x < g.grid().get_size().x; ++x) {
-					g.grid()(x, max_pos.y, z).velocities_posface.y = 0.0;
+				for (std::size_t x = 0; x < g.get_size().x; ++x) {
+					g.velocities(1)(x, max_pos.y, z) = 0.0;
 				}
 			}
-			for (std::size_t y = 0; y < g.grid().get_size().y; ++y) {
-				for (std::size_t x = 0; x < g.grid().get_size().x; ++x) {
-					g.grid()(x, y, max_pos.z).velocities_posface.z = 0.0;
+			for (std::size_t y = 0; y < g.get_size().y; ++y) {
+				for (std::size_t x = 0; x < g.get_size().x; ++x) {
+					g.velocities(2)(x, y, max_pos.z) = 0.0;
 				}
 			}
 		}
 	}
 
-	void simulation::_transfer_from_grid_pic() {
-		for (particle &p : _particles) {
-			auto [grid_index, t] = p.compute_cell_index_and_position(grid_offset, cell_size);
-			auto [v, tmid] = grid().get_face_samples(grid_index, t);
-			p.velocity.x = trilerp(
-				v.v000.x, v.v001.x, v.v010.x, v.v011.x, v.v100.x, v.v101.x, v.v110.x, v.v111.x, tmid.z, tmid.y, t.x
-			);
-			p.velocity.y = trilerp(
-				v.v000.y, v.v001.y, v.v010.y, v.v011.y, v.v100.y, v.v101.y, v.v110.y, v.v111.y, tmid.z, t.y, tmid.x
-			);
-			p.velocity.z = trilerp(
-				v.v000.z, v.v001.z, v.v010.z, v.v011.z, v.v100.z, v.v101.z, v.v110.z, v.v111.z, t.z, tmid.y, tmid.x
-			);
+	/// The scalar type of each element of the given lane type.
+	template <typename Lane> struct _lane_scalar {
+		using type = Lane; ///< Scalar lanes contain a single element.
+	};
+#ifdef __AVX2__
+	/// Specialization for \ref vec4d_avx.
+	template <> struct _lane_scalar<vec4d_avx> {
+		using type = double; ///< The scalar type.
+	};
+	/// Specialization for \ref vec8f_avx.
+	template <> struct _lane_scalar<vec8f_avx> {
+		using type = float; ///< The scalar type.
+	};
+#endif
+	/// Shorthand for \ref _lane_scalar::type.
+	template <typename Lane> using _lane_scalar_t = typename _lane_scalar<Lane>::type;
+
+	/// Returns a lane with all elements set to the given value.
+	template <typename Lane> FLUID_FORCEINLINE Lane _lane_uniform(_lane_scalar_t<Lane> v) {
+		return v;
+	}
+	/// Loads a lane from the given aligned array.
+	template <typename Lane> FLUID_FORCEINLINE Lane _lane_load(const _lane_scalar_t<Lane> *arr) {
+		return *arr;
+	}
+	/// Stores the lane into the given aligned array.
+	template <typename T> FLUID_FORCEINLINE void _lane_store(T v, T *arr) {
+		*arr = v;
+	}
+	/// Memberwise multiplication.
+	template <typename T> FLUID_FORCEINLINE T _lane_mul(T a, T b) {
+		return a * b;
+	}
+	/// Memberwise absolute value.
+	template <typename T> FLUID_FORCEINLINE T _lane_abs(T v) {
+		return std::abs(v);
+	}
+	/// Returns -1 for positive elements and 1 for all other elements.
+	template <typename T> FLUID_FORCEINLINE T _lane_negative_sign(T v) {
+		return v > 0 ? -1 : 1;
+	}
+
+#ifdef __AVX2__
+	template <> FLUID_FORCEINLINE vec4d_avx _lane_uniform<vec4d_avx>(double v) {
+		return vec4d_avx::uniform(v);
+	}
+	template <> FLUID_FORCEINLINE vec4d_avx _lane_load<vec4d_avx>(const double *arr) {
+		return vec4d_avx::load_aligned(arr);
+	}
+	/// Stores the lane into the given aligned array.
+	FLUID_FORCEINLINE void _lane_store(vec4d_avx v, double *arr) {
+		v.store_aligned(arr);
+	}
+	/// Memberwise multiplication.
+	FLUID_FORCEINLINE vec4d_avx _lane_mul(vec4d_avx a, vec4d_avx b) {
+		return vec_ops::memberwise::mul(a, b);
+	}
+	/// Memberwise absolute value.
+	FLUID_FORCEINLINE vec4d_avx _lane_abs(vec4d_avx v) {
+		return vec_ops::memberwise::abs(v);
+	}
+	/// Returns -1 for positive elements and 1 for all other elements.
+	FLUID_FORCEINLINE vec4d_avx _lane_negative_sign(vec4d_avx v) {
+		__m256d positive = _mm256_cmp_pd(v.value, _mm256_setzero_pd(), _CMP_GT_OQ);
+		return vec4d_avx(_mm256_blendv_pd(_mm256_set1_pd(1.0), _mm256_set1_pd(-1.0), positive));
+	}
+
+	template <> FLUID_FORCEINLINE vec8f_avx _lane_uniform<vec8f_avx>(float v) {
+		return vec8f_avx::uniform(v);
+	}
+	template <> FLUID_FORCEINLINE vec8f_avx _lane_load<vec8f_avx>(const float *arr) {
+		return vec8f_avx::load_aligned(arr);
+	}
+	/// Stores the lane into the given aligned array.
+	FLUID_FORCEINLINE void _lane_store(vec8f_avx v, float *arr) {
+		v.store_aligned(arr);
+	}
+	/// Memberwise multiplication.
+	FLUID_FORCEINLINE vec8f_avx _lane_mul(vec8f_avx a, vec8f_avx b) {
+		return vec_ops::memberwise::mul(a, b);
+	}
+	/// Memberwise absolute value.
+	FLUID_FORCEINLINE vec8f_avx _lane_abs(vec8f_avx v) {
+		return vec_ops::memberwise::abs(v);
+	}
+	/// Returns -1 for positive elements and 1 for all other elements.
+	FLUID_FORCEINLINE vec8f_avx _lane_negative_sign(vec8f_avx v) {
+		__m256 positive = _mm256_cmp_ps(v.value, _mm256_setzero_ps(), _CMP_GT_OQ);
+		return vec8f_avx(_mm256_blendv_ps(_mm256_set1_ps(1.0f), _mm256_set1_ps(-1.0f), positive));
+	}
+#endif
+
+	/// Linear interpolation, with the same order of operations as \ref lerp().
+	template <typename Lane> FLUID_FORCEINLINE Lane _lane_lerp(Lane a, Lane b, Lane t) {
+		return _lane_mul(a, _lane_uniform<Lane>(1) - t) + _lane_mul(b, t);
+	}
+
+	/// The eight faces around a group of particles for a single velocity component, and the positions of the
+	/// particles relative to these faces. Elements of different particles are stored contiguously so that they can
+	/// be loaded into lanes directly.
+	template <typename T, std::size_t Lanes> struct _face_stencil {
+		/// Velocities at the eight faces, indexed by <tt>z * 4 + y * 2 + x</tt>.
+		alignas(32) T values[8][Lanes];
+		alignas(32) T t[3][Lanes]; ///< Positions of the particles inside the stencil along all axes.
+	};
+
+	/// Computes the indices of the first face in the stencil of the given component, and the position of the
+	/// particle inside that stencil. The results are the same as those of \ref basic_mac_grid::get_face_samples().
+	template <std::size_t Dim, typename T> FLUID_FORCEINLINE std::pair<vec3i, vec3<T>> _face_stencil_position(
+		vec3s cell, vec3<T> t
+	) {
+		vec3i base(cell);
+		for (std::size_t axis = 0; axis < 3; ++axis) {
+			if (axis == Dim) {
+				--base[axis];
+				continue;
+			}
+			t[axis] -= static_cast<T>(0.5);
+			if (t[axis] < 0) {
+				--base[axis];
+				t[axis] += 1;
+			}
 		}
+		return { base, t };
 	}
 
-	void simulation::_transfer_from_grid_flip(double blend) {
-		for (particle &p : _particles) {
-			auto [grid_index, t] = p.compute_cell_index_and_position(grid_offset, cell_size);
-			auto [v_old, tmid] = _old_grid.get_face_samples(grid_index, t);
-			auto [v_new, tmid_other] = grid().get_face_samples(grid_index, t);
-			vec3d
-				old_velocity(
-					trilerp(
-						v_old.v000.x, v_old.v001.x, v_old.v010.x, v_old.v011.x,
-						v_old.v100.x, v_old.v101.x, v_old.v110.x, v_old.v111.x,
-						tmid.z, tmid.y, t.x
-					),
-					trilerp(
-						v_old.v000.y, v_old.v001.y, v_old.v010.y, v_old.v011.y,
-						v_old.v100.y, v_old.v101.y, v_old.v110.y, v_old.v111.y,
-						tmid.z, t.y, tmid.x
-					),
-					trilerp(
-						v_old.v000.z, v_old.v001.z, v_old.v010.z, v_old.v011.z,
-						v_old.v100.z, v_old.v101.z, v_old.v110.z, v_old.v111.z,
-						t.z, tmid.y, tmid.x
-					)
-				),
-				new_velocity(
-					trilerp(
-						v_new.v000.x, v_new.v001.x, v_new.v010.x, v_new.v011.x,
-						v_new.v100.x, v_new.v101.x, v_new.v110.x, v_new.v111.x,
-						tmid.z, tmid.y, t.x
-					),
-					trilerp(
-						v_new.v000.y, v_new.v001.y, v_new.v010.y, v_new.v011.y,
-						v_new.v100.y, v_new.v101.y, v_new.v110.y, v_new.v111.y,
-						tmid.z, t.y, tmid.x
-					),
-					trilerp(
-						v_new.v000.z, v_new.v001.z, v_new.v010.z, v_new.v011.z,
-						v_new.v100.z, v_new.v101.z, v_new.v110.z, v_new.v111.z,
-						t.z, tmid.y, tmid.x
-					)
-				);
-			p.velocity = new_velocity + (p.velocity - old_velocity) * blend;
-		}
-	}
-
-	vec3d simulation::_calculate_c_vector(
-		double v000, double v001, double v010, double v011,
-		double v100, double v101, double v110, double v111,
-		double tx, double ty, double tz
-	) const {
-		return
-			_grad_kernel(vec3d(tx, ty, tz)) * v000 +
-			_grad_kernel(vec3d(tx - 1.0, ty, tz)) * v001 +
-			_grad_kernel(vec3d(tx, ty - 1.0, tz)) * v010 +
-			_grad_kernel(vec3d(tx - 1.0, ty - 1.0, tz)) * v011 +
-			_grad_kernel(vec3d(tx, ty, tz - 1.0)) * v100 +
-			_grad_kernel(vec3d(tx - 1.0, ty, tz - 1.0)) * v101 +
-			_grad_kernel(vec3d(tx, ty - 1.0, tz - 1.0)) * v110 +
-			_grad_kernel(vec3d(tx - 1.0, ty - 1.0, tz - 1.0)) * v111;
-	}
-
-	void simulation::_transfer_from_grid_apic() {
-		for (particle &p : _particles) {
-			auto [grid_index, t] = p.compute_cell_index_and_position(grid_offset, cell_size);
-			auto [v, tmid] = grid().get_face_samples(grid_index, t);
-			p.velocity.x = trilerp(
-				v.v000.x, v.v001.x, v.v010.x, v.v011.x, v.v100.x, v.v101.x, v.v110.x, v.v111.x, tmid.z, tmid.y, t.x
-			);
-			p.velocity.y = trilerp(
-				v.v000.y, v.v001.y, v.v010.y, v.v011.y, v.v100.y, v.v101.y, v.v110.y, v.v111.y, tmid.z, t.y, tmid.x
-			);
-			p.velocity.z = trilerp(
-				v.v000.z, v.v001.z, v.v010.z, v.v011.z, v.v100.z, v.v101.z, v.v110.z, v.v111.z, t.z, tmid.y, tmid.x
-			);
-			p.cx = _calculate_c_vector(
-				v.v000.x, v.v001.x, v.v010.x, v.v011.x, v.v100.x, v.v101.x, v.v110.x, v.v111.x, t.x, tmid.y, tmid.z
-			);
-			p.cy = _calculate_c_vector(
-				v.v000.y, v.v001.y, v.v010.y, v.v011.y, v.v100.y, v.v101.y, v.v110.y, v.v111.y, tmid.x, t.y, tmid.z
-			);
-			p.cz = _calculate_c_vector(
-				v.v000.z, v.v001.z, v.v010.z, v.v011.z, v.v100.z, v.v101.z, v.v110.z, v.v111.z, tmid.x, tmid.y, t.z
-			);
+	/// Gathers the eight face velocities of the given component into the given lane of the stencil. Face
+	/// velocities outside of the grid along the component's axis, as well as those on the max border, are treated
+	/// as zero; indices along the other axes are clamped.
+	template <std::size_t Dim, typename T, std::size_t Lanes> FLUID_FORCEINLINE void _gather_face_stencil(
+		const basic_mac_grid<T> &grid, vec3i base, std::size_t lane, _face_stencil<T, Lanes> &stencil
+	) {
+		vec3i size(grid.get_size());
+		const grid3<T> &component = grid.velocities(Dim);
+		for (int dz = 0; dz < 2; ++dz) {
+			for (int dy = 0; dy < 2; ++dy) {
+				for (int dx = 0; dx < 2; ++dx) {
+					vec3i id = base + vec3i(dx, dy, dz);
+					T value = 0;
+					if (id[Dim] >= 0 && id[Dim] < size[Dim] - 1) {
+						for (std::size_t axis = 0; axis < 3; ++axis) {
+							if (axis != Dim) {
+								id[axis] = std::clamp(id[axis], 0, size[axis] - 1);
+							}
+						}
+						value = component(vec3s(id));
+					}
+					stencil.values[dz * 4 + dy * 2 + dx][lane] = value;
+				}
+			}
 		}
 	}
 
-	void simulation::_transfer_from_grid() {
+	/// Trilinearly interpolates the values in the stencil, with the same order of operations as \ref trilerp().
+	template <typename Lane> FLUID_FORCEINLINE Lane _interpolate_stencil(const Lane (&v)[8], const Lane (&t)[3]) {
+		return _lane_lerp(
+			_lane_lerp(_lane_lerp(v[0], v[1], t[0]), _lane_lerp(v[2], v[3], t[0]), t[1]),
+			_lane_lerp(_lane_lerp(v[4], v[5], t[0]), _lane_lerp(v[6], v[7], t[0]), t[1]),
+			t[2]
+		);
+	}
+
+	/// Computes the c vector used by APIC, i.e., the sum of the values in the stencil weighted by the gradients of
+	/// the linear kernel.
+	template <typename Lane> FLUID_FORCEINLINE void _stencil_c_vector(
+		const Lane (&v)[8], const Lane (&t)[3], _lane_scalar_t<Lane> cell_size, Lane (&c)[3]
+	) {
+		using scalar = _lane_scalar_t<Lane>;
+		Lane n[2][3], neg_sign[2][3]; // indexed by [offset][axis]
+		for (std::size_t axis = 0; axis < 3; ++axis) {
+			for (std::size_t offset = 0; offset < 2; ++offset) {
+				Lane p = t[axis] - _lane_uniform<Lane>(static_cast<scalar>(offset));
+				n[offset][axis] = _lane_uniform<Lane>(1) - _lane_abs(p);
+				neg_sign[offset][axis] = _lane_negative_sign(p);
+			}
+		}
+		for (std::size_t axis = 0; axis < 3; ++axis) {
+			c[axis] = _lane_uniform<Lane>(0);
+		}
+		for (std::size_t i = 0; i < 8; ++i) {
+			std::size_t ox = i & 1, oy = (i >> 1) & 1, oz = i >> 2;
+			c[0] = c[0] + _lane_mul(_lane_mul(_lane_mul(neg_sign[ox][0], n[oy][1]), n[oz][2]), v[i]);
+			c[1] = c[1] + _lane_mul(_lane_mul(_lane_mul(n[ox][0], neg_sign[oy][1]), n[oz][2]), v[i]);
+			c[2] = c[2] + _lane_mul(_lane_mul(_lane_mul(n[ox][0], n[oy][1]), neg_sign[oz][2]), v[i]);
+		}
+		Lane inv_cell_size = _lane_uniform<Lane>(1 / cell_size);
+		for (std::size_t axis = 0; axis < 3; ++axis) {
+			c[axis] = _lane_mul(c[axis], inv_cell_size);
+		}
+	}
+
+	template <typename T> template <typename basic_simulation<T>::method Method, typename Lane>
+	void basic_simulation<T>::_transfer_from_grid_lanes(std::size_t first, T blend) {
+		constexpr std::size_t lanes = sizeof(Lane) / sizeof(T);
+		constexpr bool use_old_grid = Method == method::flip_blend;
+
+		_face_stencil<T, lanes> stencils[3]{}, old_stencils[use_old_grid ? 3 : 1]{};
+		alignas(32) T old_velocities[3][lanes];
+		for (std::size_t lane = 0; lane < lanes; ++lane) {
+			std::size_t i = first + lane;
+			auto [cell, t] = particle::compute_cell_index_and_position(_particles.positions[i], grid_offset, cell_size);
+			auto gather = [&](auto dim) {
+				constexpr std::size_t d = decltype(dim)::value;
+				auto [base, stencil_t] = _face_stencil_position<d>(cell, t);
+				for (std::size_t axis = 0; axis < 3; ++axis) {
+					stencils[d].t[axis][lane] = stencil_t[axis];
+				}
+				_gather_face_stencil<d>(grid(), base, lane, stencils[d]);
+				if constexpr (use_old_grid) {
+					_gather_face_stencil<d>(_old_grid, base, lane, old_stencils[d]);
+				}
+			};
+			gather(std::integral_constant<std::size_t, 0>());
+			gather(std::integral_constant<std::size_t, 1>());
+			gather(std::integral_constant<std::size_t, 2>());
+			if constexpr (use_old_grid) {
+				for (std::size_t dim = 0; dim < 3; ++dim) {
+					old_velocities[dim][lane] = _particles.velocities[i][dim];
+				}
+			}
+		}
+
+		alignas(32) T velocities[3][lanes], c_vectors[3][3][lanes];
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			Lane v[8], t[3];
+			for (std::size_t j = 0; j < 8; ++j) {
+				v[j] = _lane_load<Lane>(stencils[dim].values[j]);
+			}
+			for (std::size_t axis = 0; axis < 3; ++axis) {
+				t[axis] = _lane_load<Lane>(stencils[dim].t[axis]);
+			}
+			Lane velocity = _interpolate_stencil(v, t);
+			if constexpr (use_old_grid) {
+				Lane old_v[8];
+				for (std::size_t j = 0; j < 8; ++j) {
+					old_v[j] = _lane_load<Lane>(old_stencils[dim].values[j]);
+				}
+				Lane old_grid_velocity = _interpolate_stencil(old_v, t);
+				Lane old_velocity = _lane_load<Lane>(old_velocities[dim]);
+				velocity = velocity + _lane_mul(old_velocity - old_grid_velocity, _lane_uniform<Lane>(blend));
+			}
+			_lane_store(velocity, velocities[dim]);
+			if constexpr (Method == method::apic) {
+				Lane c[3];
+				_stencil_c_vector(v, t, cell_size, c);
+				for (std::size_t axis = 0; axis < 3; ++axis) {
+					_lane_store(c[axis], c_vectors[dim][axis]);
+				}
+			}
+		}
+
+		for (std::size_t lane = 0; lane < lanes; ++lane) {
+			std::size_t i = first + lane;
+			_particles.velocities[i] = vec3<T>(velocities[0][lane], velocities[1][lane], velocities[2][lane]);
+			if constexpr (Method == method::apic) {
+				_particles.cx[i] = vec3<T>(c_vectors[0][0][lane], c_vectors[0][1][lane], c_vectors[0][2][lane]);
+				_particles.cy[i] = vec3<T>(c_vectors[1][0][lane], c_vectors[1][1][lane], c_vectors[1][2][lane]);
+				_particles.cz[i] = vec3<T>(c_vectors[2][0][lane], c_vectors[2][1][lane], c_vectors[2][2][lane]);
+			}
+		}
+	}
+
+	template <typename T> template <typename basic_simulation<T>::method Method>
+	void basic_simulation<T>::_transfer_from_grid_batched(T blend) {
+#ifdef __AVX2__
+		// single precision fits twice as many particles into each vector
+		using lane_type = std::conditional_t<std::is_same_v<T, float>, vec8f_avx, vec4d_avx>;
+#else
+		using lane_type = T;
+#endif
+		constexpr std::size_t lanes = sizeof(lane_type) / sizeof(T);
+
+		// particles are sorted by cell, so consecutive groups mostly read the same faces
+		int num_groups = static_cast<int>(_particles.size() / lanes);
+#pragma omp parallel for
+		for (int group = 0; group < num_groups; ++group) {
+			_transfer_from_grid_lanes<Method, lane_type>(static_cast<std::size_t>(group) * lanes, blend);
+		}
+		for (std::size_t i = static_cast<std::size_t>(num_groups) * lanes; i < _particles.size(); ++i) {
+			_transfer_from_grid_lanes<Method, T>(i, blend);
+		}
+	}
+
+	template <typename T> void basic_simulation<T>::_transfer_from_grid_pic() {
+		_transfer_from_grid_batched<method::pic>(0.0);
+	}
+
+	template <typename T> void basic_simulation<T>::_transfer_from_grid_flip(T blend) {
+		_transfer_from_grid_batched<method::flip_blend>(blend);
+	}
+
+	template <typename T> void basic_simulation<T>::_transfer_from_grid_apic() {
+		_transfer_from_grid_batched<method::apic>(0.0);
+	}
+
+	template <typename T> void basic_simulation<T>::_transfer_from_grid() {
 		switch (simulation_method) {
 		case method::pic:
 			_transfer_from_grid_pic();
@@ -559,74 +1147,185 @@ namespace fluid {
 		}
 	}
 
-	void simulation::_correct_positions(double dt) {
+	template <typename T> void basic_simulation<T>::_correct_positions(T dt) {
 		// "Preserving Fluid Sheets with Adaptively Sampled Anisotropic Particles"
 		// https://github.com/ryichando/shiokaze/blob/53997a4dcaee9ae8c55dcdbd9077f95f1f6c052a/src/flip/macnbflip3.cpp#L377
 
-		double re = cell_size / std::sqrt(2.0); // particle radius
-		std::uniform_real_distribution<double> dist(-1.0, 1.0);
-		std::vector<vec3d> new_positions(_particles.size());
-
-		int isize = static_cast<int>(_particles.size());
-#pragma omp parallel
-		{
-			pcg32 thread_rand(std::random_device{}());
-#pragma omp for
-			for (int i = 0; i < isize; ++i) {
-				const particle &p = _particles[i];
-				vec3d spring;
-				_for_all_nearby_particles(
-					p.compute_cell_index(grid_offset, cell_size), vec3s(1, 1, 1), vec3s(1, 1, 1),
-					[&](const particle &other) {
-						if (&other != &p) {
-							vec3d offset = p.position - other.position;
-							double sqr_dist = offset.squared_length();
-							if (sqr_dist < 1e-12) {
-								// the two particles are not too far away, weight is 1, so just add a random force
-								// to avoid floating point errors
-								spring += vec3d(dist(thread_rand), dist(thread_rand), dist(thread_rand));
-							} else {
-								double kernel_lower = 1.0 - sqr_dist / (re * re);
-								double kernel = 0.0;
-								if (kernel_lower > 0.0) {
-									kernel = kernel_lower * kernel_lower * kernel_lower;
-								}
-								spring += (kernel / std::sqrt(sqr_dist)) * offset;
-							}
-						}
-					}
+		// each cell handles pairs within itself and with the 13 neighbors in this list, so that every pair of
+		// neighboring cells is visited exactly once
+		constexpr int neighbor_offsets[13][3]{
+			{ 1, 0, 0 },
+			{ -1, 1, 0 }, { 0, 1, 0 }, { 1, 1, 0 },
+			{ -1, -1, 1 }, { 0, -1, 1 }, { 1, -1, 1 },
+			{ -1, 0, 1 }, { 0, 0, 1 }, { 1, 0, 1 },
+			{ -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 }
+		};
+
+		T re = cell_size / std::sqrt(2.0); // particle radius
+		T sqr_re = re * re;
+		std::vector<vec3<T>> springs(_particles.size());
+		auto add_pair_force = [&](std::size_t i, std::size_t j) {
+			vec3<T> offset = _particles.positions[i] - _particles.positions[j];
+			T sqr_dist = offset.squared_length();
+			if (sqr_dist >= sqr_re) {
+				return;
+			}
+			vec3<T> force;
+			if (sqr_dist < 1e-12) {
+				// the two particles are not too far away, weight is 1, so just add a random force to avoid floating
+				// point errors
+				force = philox4x32::to_vec3<T>(
+					philox4x32::generate(
+						_get_random_counter(_random_stream::position_correction),
+						(static_cast<std::uint64_t>(i) << 32) ^ j, random_key
+					),
+					-1.0, 1.0
 				);
-				new_positions[i] = p.position + spring * (dt * correction_stiffness * re);
+			} else {
+				T kernel_lower = 1.0 - sqr_dist / sqr_re;
+				force = (kernel_lower * kernel_lower * kernel_lower / std::sqrt(sqr_dist)) * offset;
+			}
+			springs[i] += force;
+			springs[j] -= force;
+		};
+
+		vec3s grid_size = grid().get_size();
+		vec3i isize(grid_size);
+		auto process_cell = [&](std::size_t raw) {
+			vec3s cell = grid().index_from_raw(raw);
+			const _cell_particles &particles = _space_hash(cell);
+			std::size_t end = particles.begin + particles.count;
+			for (std::size_t i = particles.begin; i < end; ++i) {
+				for (std::size_t j = i + 1; j < end; ++j) {
+					add_pair_force(i, j);
+				}
+			}
+			vec3i icell(cell);
+			for (const int (&offset)[3] : neighbor_offsets) {
+				vec3i neighbor = icell + vec3i(offset[0], offset[1], offset[2]);
+				if (
+					neighbor.x < 0 || neighbor.y < 0 || neighbor.x >= isize.x || neighbor.y >= isize.y ||
+					neighbor.z >= isize.z
+				) {
+					continue;
+				}
+				const _cell_particles &others = _space_hash(vec3s(neighbor));
+				std::size_t others_end = others.begin + others.count;
+				for (std::size_t i = particles.begin; i < end; ++i) {
+					for (std::size_t j = others.begin; j < others_end; ++j) {
+						add_pair_force(i, j);
+					}
+				}
+			}
+		};
+
+		// fluid cells are sorted, so fluid cells in each slab are stored consecutively
+		std::size_t
+			layer_size = grid_size.x * grid_size.y,
+			num_slabs = (grid_size.z + _transfer_slab_thickness - 1) / _transfer_slab_thickness;
+		std::vector<std::size_t> slab_begin(num_slabs + 1);
+		for (std::size_t i = 0; i <= num_slabs; ++i) {
+			std::size_t first_cell = std::min(i * _transfer_slab_thickness, grid_size.z) * layer_size;
+			slab_begin[i] = static_cast<std::size_t>(
+				std::lower_bound(_fluid_cells.begin(), _fluid_cells.end(), first_cell) - _fluid_cells.begin()
+			);
+		}
+		for (std::size_t parity = 0; parity < 2; ++parity) {
+			int inum_slabs = static_cast<int>(num_slabs);
+#pragma omp parallel for schedule(dynamic)
+			for (int slab = static_cast<int>(parity); slab < inum_slabs; slab += 2) {
+				auto slab_id = static_cast<std::size_t>(slab);
+				for (std::size_t i = slab_begin[slab_id]; i < slab_begin[slab_id + 1]; ++i) {
+					process_cell(_fluid_cells[i]);
+				}
 			}
 		}
 
 		// apply new positions & clamp back to the grid
-		vec3d grid_max = grid_offset + vec3d(grid().grid().get_size()) * cell_size;
-		for (std::size_t i = 0; i < _particles.size(); ++i) {
-			_particles[i].position = vec_ops::apply<vec3d>(
-				std::clamp<double>, new_positions[i], grid_offset, grid_max
+		T spring_scale = dt * correction_stiffness * re;
+		vec3<T> grid_max = grid_offset + vec3<T>(grid().get_size()) * cell_size;
+		int nparticles = static_cast<int>(_particles.size());
+#pragma omp parallel for
+		for (int i = 0; i < nparticles; ++i) {
+			_particles.positions[i] = vec_ops::apply<vec3<T>>(
+				std::clamp<T>, _particles.positions[i] + springs[i] * spring_scale, grid_offset, grid_max
 			);
 		}
 	}
 
-	void simulation::_detect_collisions() {
+	template <typename T> void basic_simulation<T>::_detect_collisions() {
+		if (continuous_collision_detection) {
+			_detect_collisions_continuous();
+			return;
+		}
+
+		// push particles out along the gradient until they're at least one skin width away from solids
+		T skin_width = boundary_skin_width / cell_size;
 		int nparticles = static_cast<int>(_particles.size());
 #pragma omp parallel for
 		for (int i = 0; i < nparticles; ++i) {
-			particle &p = _particles[static_cast<std::size_t>(i)];
-			vec3d from = p.old_position, to = p.position;
+			vec3<T> &position = _particles.positions[i];
+			// the interpolated field is not exact near edges and corners, so the projection is repeated
+			for (std::size_t j = 0; j < 3; ++j) {
+				auto [distance, gradient] = _solid_sdf.sample(vec3d((position - grid_offset) / cell_size));
+				double length = gradient.length();
+				if (distance >= skin_width || length <= 0.0) {
+					break;
+				}
+				position += vec3<T>(gradient * ((skin_width - distance) * cell_size / length));
+			}
+
+			// the field is positive near convex corners of solids, so particles that still end up in a solid cell
+			// are moved out through the nearest face that borders a non-solid cell
+			vec3s cell = world_position_to_cell_index(position);
+			if (grid().get_cell_type(cell) != grid_cell_type::solid) {
+				continue;
+			}
+			vec3<T> grid_pos = (position - grid_offset) / cell_size;
+			T nearest = std::numeric_limits<T>::max(), target = 0;
+			std::size_t nearest_dim = 3;
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				vec3s below = cell, above = cell;
+				--below[dim]; // wraps around for the first layer of cells, which is treated as solid
+				++above[dim];
+				auto coord = static_cast<T>(cell[dim]);
+				if (grid().get_cell_type(below) != grid_cell_type::solid && grid_pos[dim] - coord < nearest) {
+					nearest = grid_pos[dim] - coord;
+					target = coord - skin_width;
+					nearest_dim = dim;
+				}
+				if (grid().get_cell_type(above) != grid_cell_type::solid && coord + 1 - grid_pos[dim] < nearest) {
+					nearest = coord + 1 - grid_pos[dim];
+					target = coord + 1 + skin_width;
+					nearest_dim = dim;
+				}
+			}
+			if (nearest_dim < 3) { // otherwise the cell is enclosed by solids and there is nowhere to go
+				grid_pos[nearest_dim] = target;
+				position = grid_offset + grid_pos * cell_size;
+			}
+		}
+	}
+
+	template <typename T> void basic_simulation<T>::_detect_collisions_continuous() {
+		int nparticles = static_cast<int>(_particles.size());
+#pragma omp parallel for
+		for (int i = 0; i < nparticles; ++i) {
+			vec3<T> &position = _particles.positions[i];
+			// cells are marched in double precision regardless of the scalar type
+			vec3d from(_particles.old_positions[i]), to(position);
 			for (std::size_t j = 0; j < 3; ++j) {
 				bool into_wall = false;
-				grid().grid().march_cells(
-					[this, &p, &from, &to, &into_wall](vec3i pos, std::size_t dim, vec3d normal, double t) {
+				grid().cell_types().march_cells(
+					[this, &from, &to, &into_wall](vec3i pos, std::size_t dim, vec3d normal, double t) {
 						if (pos.x >= 0 && pos.y >= 0 && pos.z >= 0) {
 							vec3s upos(pos);
 							if (
-								upos.x < grid().grid().get_size().x &&
-								upos.y < grid().grid().get_size().y &&
-								upos.z < grid().grid().get_size().z
+								upos.x < grid().get_size().x &&
+								upos.y < grid().get_size().y &&
+								upos.z < grid().get_size().z
 							) {
-								if (grid().grid()(pos.x, pos.y, pos.z).cell_type != mac_grid::cell::type::solid) {
+								if (grid().cell_types()(upos) != mac_grid::cell::type::solid) {
 									return true;
 								}
 							}
@@ -643,124 +1342,533 @@ namespace fluid {
 						into_wall = true;
 						return false;
 					},
-					(from - grid_offset) / cell_size, (to - grid_offset) / cell_size
+					(from - vec3d(grid_offset)) / cell_size, (to - vec3d(grid_offset)) / cell_size
 						);
 				if (!into_wall) {
 					break;
 				}
 			}
-			p.position = to;
+			position = vec3<T>(to);
 
 			// take into account skin width of nearby solid cells
-			vec3d grid_pos = p.position - grid_offset;
+			vec3<T> grid_pos = position - grid_offset;
 			vec3s cell_index(grid_pos / cell_size);
-			vec3d cell_pos = grid_pos - vec3d(cell_index) * cell_size;
-			double cell_skin_max = cell_size - boundary_skin_width;
+			vec3<T> cell_pos = grid_pos - vec3<T>(cell_index) * cell_size;
+			T cell_skin_max = cell_size - boundary_skin_width;
 			vec_ops::for_each(
-				[this, grid_pos, cell_index, cell_skin_max](double cp, double &pos, std::size_t dim) {
+				[this, grid_pos, cell_index, cell_skin_max](T cp, T &pos, std::size_t dim) {
 					vec3s offset;
 					offset[dim] = 1;
 					if (cp < boundary_skin_width) {
 						if (
 							cell_index[dim] == 0 ||
-							grid().grid()(cell_index - offset).cell_type == mac_grid::cell::type::solid
+							grid().cell_types()(cell_index - offset) == mac_grid::cell::type::solid
 						) {
 							pos += boundary_skin_width - cp;
 						}
 					}
 					if (cp > cell_skin_max) {
 						if (
-							cell_index[dim] + 1 >= grid().grid().get_size()[dim] ||
-							grid().grid()(cell_index + offset).cell_type == mac_grid::cell::type::solid
+							cell_index[dim] + 1 >= grid().get_size()[dim] ||
+							grid().cell_types()(cell_index + offset) == mac_grid::cell::type::solid
 						) {
 							pos += cell_skin_max - cp;
 						}
 					}
 				},
-				cell_pos, p.position, vec3s(0, 1, 2)
+				cell_pos, position, vec3s(0, 1, 2)
 					);
 		}
 	}
 
-	void simulation::_extrapolate_velocities(const std::vector<vec3s> &fluid_cells) {
-		grid3<unsigned char> valid(grid().grid().get_size(), 0);
+	template <typename T> void basic_simulation<T>::_extrapolate_velocities(const std::vector<vec3s> &fluid_cells) {
+		constexpr std::size_t chunk_size = 1 << 10;
+
+		grid3<unsigned char> &valid = _extrapolation_valid;
+		vec3s grid_size = grid().get_size();
+		// the current layer, and all cells that have been marked as valid so that they can be reset afterwards
+		std::vector<std::size_t> frontier, valid_cells;
 		for (vec3s cell : fluid_cells) {
-			valid(cell) = 1;
+			std::size_t raw = grid().index_to_raw(cell);
+			valid[raw] = 1;
+			frontier.emplace_back(raw);
 		}
+		valid_cells = frontier;
+
+		// calls the callback for each neighbor of the given cell, until the callback returns false
+		auto for_each_neighbor = [&grid_size](vec3s pos, auto &&callback) {
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				if (pos[dim] > 0) {
+					vec3s neg = pos;
+					--neg[dim];
+					if (!callback(neg, dim, false)) {
+						return;
+					}
+				}
+				if (pos[dim] + 1 < grid_size[dim]) {
+					vec3s pospos = pos;
+					++pospos[dim];
+					if (!callback(pospos, dim, true)) {
+						return;
+					}
+				}
+			}
+		};
+		// extrapolates to the given cell if the given valid cell is the first valid neighbor of the cell, so that
+		// every cell is extrapolated to exactly once in each layer without synchronization. returns whether the
+		// cell has been extrapolated to
+		auto extrapolate = [&](std::size_t from_flat, vec3s pos) {
+			std::size_t first_valid = from_flat;
+			for_each_neighbor(pos, [&](vec3s neighbor, std::size_t, bool) {
+				std::size_t neighbor_flat = grid().index_to_raw(neighbor);
+				if (valid[neighbor_flat] != 0) {
+					first_valid = neighbor_flat;
+					return false;
+				}
+				return true;
+			});
+			if (first_valid != from_flat) {
+				return false;
+			}
 
-		std::vector<std::size_t> new_valid_cells;
+			std::size_t valid_neighbors = 0;
+			vec3<T> neighbor_vels;
+			vec3<mac_grid::cell::type> type_pos(
+				mac_grid::cell::type::solid,
+				mac_grid::cell::type::solid,
+				mac_grid::cell::type::solid
+			);
+			for_each_neighbor(pos, [&](vec3s neighbor, std::size_t dim, bool positive) {
+				std::size_t neighbor_flat = grid().index_to_raw(neighbor);
+				if (valid[neighbor_flat] != 0) {
+					neighbor_vels += grid().get_velocities_posface(neighbor_flat);
+					if (positive) {
+						type_pos[dim] = grid().cell_types()[neighbor_flat];
+					}
+					++valid_neighbors;
+				}
+				return true;
+			});
+			std::size_t pos_flat = grid().index_to_raw(pos);
+			mac_grid::cell::type this_type = grid().cell_types()[pos_flat];
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				if (this_type == type_pos[dim]) {
+					grid().velocities(dim)[pos_flat] = neighbor_vels[dim] / static_cast<T>(valid_neighbors);
+				}
+			}
+			return true;
+		};
+
+		for (std::size_t layer = 0; layer < _extrapolation_distance && !frontier.empty(); ++layer) {
+			// find and extrapolate to the next layer. only cells in the next layer are written to, and they are not
+			// read since they're not valid yet
+			std::size_t num_chunks = (frontier.size() + chunk_size - 1) / chunk_size;
+			std::vector<std::vector<std::size_t>> chunk_layers(num_chunks);
+			int inum_chunks = static_cast<int>(num_chunks);
+#pragma omp parallel for schedule(dynamic)
+			for (int ichunk = 0; ichunk < inum_chunks; ++ichunk) {
+				auto chunk = static_cast<std::size_t>(ichunk);
+				std::size_t end = std::min(frontier.size(), (chunk + 1) * chunk_size);
+				for (std::size_t i = chunk * chunk_size; i < end; ++i) {
+					std::size_t from_flat = frontier[i];
+					for_each_neighbor(grid().index_from_raw(from_flat), [&](vec3s neighbor, std::size_t, bool) {
+						std::size_t neighbor_flat = grid().index_to_raw(neighbor);
+						if (valid[neighbor_flat] == 0 && extrapolate(from_flat, neighbor)) {
+							chunk_layers[chunk].emplace_back(neighbor_flat);
+						}
+						return true;
+					});
+				}
+			}
 
-		for (std::size_t i = 0; i < velocity_extrapolation_iterations; ++i) {
-			// update valid cells
-			for (std::size_t cell : new_valid_cells) {
+			frontier.clear();
+			for (const std::vector<std::size_t> &cells : chunk_layers) {
+				frontier.insert(frontier.end(), cells.begin(), cells.end());
+			}
+			for (std::size_t cell : frontier) {
 				valid[cell] = 1;
 			}
-			new_valid_cells.clear();
+			valid_cells.insert(valid_cells.end(), frontier.begin(), frontier.end());
+		}
 
-			// one iteration of extrapolation
-			valid.for_each(
-				[this, &valid, &new_valid_cells](vec3s pos, unsigned char cell_valid) {
-					if (cell_valid != 0) {
-						return;
+		for (std::size_t cell : valid_cells) {
+			valid[cell] = 0;
+		}
+	}
+
+	template <typename T> void basic_simulation<T>::_update_sinks() {
+		_free_particles.clear();
+		for (auto &snk : sinks) {
+			if (!snk->active) {
+				continue;
+			}
+			for (vec3s v : snk->cells) {
+				if (!grid().is_inside(v)) {
+					continue;
+				}
+				_cell_particles cell = _space_hash(v);
+				if (cell.count > 0) {
+					for (std::size_t c = cell.begin, i = 0; i < cell.count; ++i, ++c) {
+						_free_particles.emplace_back(c);
 					}
-					std::size_t valid_neighbors = 0;
-					vec3d neighbor_vels;
-					vec3<mac_grid::cell::type> type_pos(
-						mac_grid::cell::type::solid,
-						mac_grid::cell::type::solid,
-						mac_grid::cell::type::solid
-					);
-					std::size_t pos_flat = grid().grid().index_to_raw(pos);
-					mac_grid::cell &this_cell = grid().grid()[pos_flat];
-					vec_ops::for_each(
-						[&](std::size_t dim) {
-							if (pos[dim] > 0) {
-								vec3s neg = pos;
-								--neg[dim];
-								if (valid(neg) != 0) {
-									const mac_grid::cell &neg_cell = grid().grid()(neg);
-									neighbor_vels += neg_cell.velocities_posface;
-									++valid_neighbors;
-								}
-							}
-							if (pos[dim] + 1 < grid().grid().get_size()[dim]) {
-								vec3s pospos = pos;
-								++pospos[dim];
-								if (valid(pospos) != 0) {
-									const mac_grid::cell &pos_cell = grid().grid()(pospos);
-									neighbor_vels += pos_cell.velocities_posface;
-									type_pos[dim] = pos_cell.cell_type;
-									++valid_neighbors;
-								}
-							}
-						},
-						vec3s(0, 1, 2)
-							);
-					if (valid_neighbors > 0) {
-						vec_ops::for_each(
-							[&](std::size_t dim) {
-								if (this_cell.cell_type == type_pos[dim]) {
-									this_cell.velocities_posface[dim] =
-										neighbor_vels[dim] / static_cast<double>(valid_neighbors);
-								}
-							},
-							vec3s(0, 1, 2)
-								);
-						new_valid_cells.emplace_back(pos_flat);
+					_space_hash.at_active(v).count = 0;
+				}
+			}
+		}
+		// sinks may overlap
+		std::sort(_free_particles.begin(), _free_particles.end());
+		_free_particles.erase(std::unique(_free_particles.begin(), _free_particles.end()), _free_particles.end());
+	}
+
+	/// Samples the given grid at the given position using trilinear interpolation. The position is in cells, such
+	/// that the samples lie at integer coordinates. Positions outside of the grid are clamped.
+	template <typename T> [[nodiscard]] T _sample_trilinear(const grid3<T> &grid, vec3<T> pos) {
+		vec3s size = grid.get_size(), base, next;
+		vec3<T> t;
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			T max_coord = static_cast<T>(size[dim] - 1);
+			T coord = std::clamp(pos[dim], static_cast<T>(0), max_coord);
+			T floor_coord = std::min(std::floor(coord), std::max(max_coord - 1, static_cast<T>(0)));
+			base[dim] = static_cast<std::size_t>(floor_coord);
+			next[dim] = std::min(base[dim] + 1, size[dim] - 1);
+			t[dim] = coord - floor_coord;
+		}
+		auto lerp = [](T a, T b, T t) {
+			return a + t * (b - a);
+		};
+		return lerp(
+			lerp(
+				lerp(grid(base.x, base.y, base.z), grid(next.x, base.y, base.z), t.x),
+				lerp(grid(base.x, next.y, base.z), grid(next.x, next.y, base.z), t.x),
+				t.y
+			),
+			lerp(
+				lerp(grid(base.x, base.y, next.z), grid(next.x, base.y, next.z), t.x),
+				lerp(grid(base.x, next.y, next.z), grid(next.x, next.y, next.z), t.x),
+				t.y
+			),
+			t.z
+		);
+	}
+	/// Samples the velocity of the given grid at the given position, which is in cells relative to the origin of
+	/// the grid.
+	template <typename T> [[nodiscard]] vec3<T> _sample_velocity(const basic_mac_grid<T> &grid, vec3<T> pos) {
+		vec3<T> result;
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			// faces in the positive direction of each cell
+			vec3<T> face_pos = pos - vec3<T>(0.5, 0.5, 0.5);
+			face_pos[dim] -= 0.5;
+			result[dim] = _sample_trilinear(grid.velocities(dim), face_pos);
+		}
+		return result;
+	}
+
+	template <typename T> void basic_simulation<T>::_advect_narrow_band(T dt) {
+		using _type = mac_grid::cell::type;
+
+		// compute the level set at the start of this time step from the cell types of the previous time step.
+		// distances to solid cells are not included, so that walls below the liquid are not treated as surfaces
+		constexpr unsigned char label_air = 0, label_liquid = 1, label_solid = 2;
+		vec3s size = grid().get_size();
+		grid3<unsigned char> &labels = _band_labels;
+		int num_cells = static_cast<int>(grid().get_cell_count());
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto raw = static_cast<std::size_t>(i);
+			_type type = grid().cell_types()[raw];
+			labels[raw] = type == _type::fluid ? label_liquid : (type == _type::solid ? label_solid : label_air);
+		}
+		grid3<double> &to_air = _band_distances[0], &to_liquid = _band_distances[1];
+		solid_distance_field::compute_squared_distances(labels, label_air, to_air);
+		solid_distance_field::compute_squared_distances(labels, label_liquid, to_liquid);
+		grid3<T> &phi = _band_phi;
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto raw = static_cast<std::size_t>(i);
+			phi[raw] = labels[raw] == label_liquid ? 0.5 - std::sqrt(to_air[raw]) : std::sqrt(to_liquid[raw]) - 0.5;
+		}
+
+		// semi-Lagrangian advection of the level set and of the velocities of deep cells
+		if (_liquid_phi.get_size() != size) {
+			_liquid_phi = grid3<T>(size);
+			for (grid3<T> &vel : _deep_velocities) {
+				vel = grid3<T>(size, 0.0);
+			}
+		}
+		// deep cells are gathered per chunk, so that concatenating the chunks keeps them sorted
+		constexpr std::size_t chunk_size = 4096;
+		std::size_t num_chunks = (static_cast<std::size_t>(num_cells) + chunk_size - 1) / chunk_size;
+		std::vector<std::vector<std::size_t>> chunk_deep_cells(num_chunks);
+		T band = static_cast<T>(narrow_band_width), scale = dt / cell_size;
+		int inum_chunks = static_cast<int>(num_chunks);
+#pragma omp parallel for
+		for (int ichunk = 0; ichunk < inum_chunks; ++ichunk) {
+			auto chunk = static_cast<std::size_t>(ichunk);
+			std::size_t end = std::min(static_cast<std::size_t>(num_cells), (chunk + 1) * chunk_size);
+			for (std::size_t raw = chunk * chunk_size; raw < end; ++raw) {
+				vec3<T> center = vec3<T>(grid().index_from_raw(raw)) + vec3<T>(0.5, 0.5, 0.5);
+				vec3<T> from = center - _sample_velocity(grid(), center) * scale;
+				_liquid_phi[raw] = _sample_trilinear(phi, from - vec3<T>(0.5, 0.5, 0.5));
+
+				unsigned char &flags = _narrow_band_flags[raw];
+				flags = (flags & _deep_current) ? _deep_previous : 0;
+				if (_liquid_phi[raw] < -band && labels[raw] != label_solid) {
+					flags |= _deep_current;
+					chunk_deep_cells[chunk].emplace_back(raw);
+					for (std::size_t dim = 0; dim < 3; ++dim) {
+						vec3<T> face = center;
+						face[dim] += 0.5;
+						vec3<T> face_from = face - _sample_velocity(grid(), face) * scale;
+						_deep_velocities[dim][raw] = _sample_velocity(grid(), face_from)[dim];
 					}
 				}
-			);
+			}
+		}
+		_deep_cells.clear();
+		for (const std::vector<std::size_t> &cells : chunk_deep_cells) {
+			_deep_cells.insert(_deep_cells.end(), cells.begin(), cells.end());
+		}
+	}
+
+	template <typename T> void basic_simulation<T>::_update_narrow_band_particles() {
+		// remove particles in deep cells
+		for (std::size_t raw : _fluid_cells) {
+			if (_is_deep_liquid(raw)) {
+				vec3s index = grid().index_from_raw(raw);
+				_cell_particles &cell = _space_hash.at_active(index);
+				for (std::size_t c = cell.begin, i = 0; i < cell.count; ++i, ++c) {
+					_free_particles.emplace_back(c);
+				}
+				cell.count = 0;
+			}
+		}
+		std::sort(_free_particles.begin(), _free_particles.end());
+
+		// reseed cells that the band has moved into. their velocities are sampled from the grid, which still holds
+		// the velocities of the previous time step
+		std::size_t target = default_seeding_density * default_seeding_density * default_seeding_density;
+		constexpr std::size_t chunk_size = 4096;
+		std::size_t num_cells = grid().get_cell_count(), num_chunks = (num_cells + chunk_size - 1) / chunk_size;
+		std::vector<std::vector<_particle_seed>> chunk_seeds(num_chunks);
+		int inum_chunks = static_cast<int>(num_chunks);
+#pragma omp parallel for schedule(dynamic)
+		for (int ichunk = 0; ichunk < inum_chunks; ++ichunk) {
+			auto chunk = static_cast<std::size_t>(ichunk);
+			std::size_t end = std::min(num_cells, (chunk + 1) * chunk_size);
+			for (std::size_t raw = chunk * chunk_size; raw < end; ++raw) {
+				if (_narrow_band_flags[raw] != _deep_previous || _liquid_phi[raw] >= 0.0) {
+					continue;
+				}
+				vec3s index = grid().index_from_raw(raw);
+				if (_space_hash(index).count > 0) {
+					continue;
+				}
+				_particle_seed &seed = chunk_seeds[chunk].emplace_back();
+				seed.velocity = _sample_velocity(grid(), vec3<T>(index) + vec3<T>(0.5, 0.5, 0.5));
+				seed.raw_cell = raw;
+				seed.count = target;
+			}
+		}
+		for (const std::vector<_particle_seed> &seeds : chunk_seeds) {
+			for (const _particle_seed &seed : seeds) {
+				vec3s index = grid().index_from_raw(seed.raw_cell);
+				_space_hash.activate_tile(_space_hash.get_raw_tile_of(index));
+				_space_hash.at_active(index).count = seed.count;
+				_particle_seeds.emplace_back(seed);
+			}
+		}
+	}
+
+	template <typename T> void basic_simulation<T>::_add_deep_liquid_cells() {
+		std::vector<std::size_t> deep_cells;
+		for (std::size_t raw : _deep_cells) {
+			vec3s index = grid().index_from_raw(raw);
+			if (_space_hash(index).count == 0) { // sources may have added particles
+				_space_hash.activate_tile(_space_hash.get_raw_tile_of(index));
+				deep_cells.emplace_back(raw);
+			}
 		}
+		if (deep_cells.empty()) {
+			return;
+		}
+		_space_hash.collect_active_tiles();
+		std::size_t num_particle_cells = _fluid_cells.size();
+		_fluid_cells.insert(_fluid_cells.end(), deep_cells.begin(), deep_cells.end());
+		std::inplace_merge(
+			_fluid_cells.begin(), _fluid_cells.begin() + static_cast<std::ptrdiff_t>(num_particle_cells),
+			_fluid_cells.end()
+		);
 	}
 
-	void simulation::_update_sources() {
+	template <typename T> void basic_simulation<T>::_control_particle_density() {
+		std::size_t
+			max_count = std::max<std::size_t>(max_particles_per_cell, 1),
+			min_count = std::min(min_particles_per_cell, max_count);
+		vec3s grid_size = grid().get_size();
+		auto is_interior = [&](vec3s cell) {
+			for (std::size_t dim = 0; dim < 3; ++dim) {
+				for (std::size_t neg = 0; neg < 2; ++neg) {
+					vec3s neighbor = cell;
+					if (neg) {
+						if (neighbor[dim] == 0) {
+							continue;
+						}
+						--neighbor[dim];
+					} else {
+						if (++neighbor[dim] == grid_size[dim]) {
+							continue;
+						}
+					}
+					if (
+						_space_hash(neighbor).count == 0 &&
+						grid().cell_types()(neighbor) != mac_grid::cell::type::solid
+					) {
+						return false;
+					}
+				}
+			}
+			return true;
+		};
+
+		// the removed particles and new seeds of each chunk of cells are merged in order afterwards, so that the
+		// result does not depend on scheduling
+		constexpr std::size_t chunk_size = 256;
+		std::size_t num_chunks = (_fluid_cells.size() + chunk_size - 1) / chunk_size;
+		std::vector<std::vector<std::size_t>> chunk_removed(num_chunks), chunk_capped(num_chunks);
+		std::vector<std::vector<_particle_seed>> chunk_seeds(num_chunks);
+		int inum_chunks = static_cast<int>(num_chunks);
+#pragma omp parallel for schedule(dynamic)
+		for (int ichunk = 0; ichunk < inum_chunks; ++ichunk) {
+			auto chunk = static_cast<std::size_t>(ichunk);
+			std::size_t end = std::min(_fluid_cells.size(), (chunk + 1) * chunk_size);
+			for (std::size_t i = chunk * chunk_size; i < end; ++i) {
+				vec3s index = grid().index_from_raw(_fluid_cells[i]);
+				_cell_particles cell = _space_hash(index);
+				if (cell.count > max_count) {
+					// particle k is merged into particle (k % max_count)
+					for (std::size_t kept = 0; kept < max_count; ++kept) {
+						std::size_t first = cell.begin + kept, group_size = 1;
+						vec3<T> velocity = _particles.velocities[first], cx = _particles.cx[first];
+						vec3<T> cy = _particles.cy[first], cz = _particles.cz[first];
+						for (std::size_t k = kept + max_count; k < cell.count; k += max_count, ++group_size) {
+							std::size_t other = cell.begin + k;
+							velocity += _particles.velocities[other];
+							cx += _particles.cx[other];
+							cy += _particles.cy[other];
+							cz += _particles.cz[other];
+						}
+						T inv_size = 1.0 / static_cast<T>(group_size);
+						_particles.velocities[first] = velocity * inv_size;
+						_particles.cx[first] = cx * inv_size;
+						_particles.cy[first] = cy * inv_size;
+						_particles.cz[first] = cz * inv_size;
+					}
+					for (std::size_t k = max_count; k < cell.count; ++k) {
+						chunk_removed[chunk].emplace_back(cell.begin + k);
+					}
+					chunk_capped[chunk].emplace_back(_fluid_cells[i]);
+				} else if (cell.count > 0 && cell.count < min_count && is_interior(index)) {
+					// cells emptied by sinks are not reseeded
+					_particle_seed &seed = chunk_seeds[chunk].emplace_back();
+					for (std::size_t k = 0; k < cell.count; ++k) {
+						seed.velocity += _particles.velocities[cell.begin + k];
+					}
+					seed.velocity /= static_cast<T>(cell.count);
+					seed.raw_cell = _fluid_cells[i];
+					seed.first_in_cell = cell.count;
+					seed.count = min_count - cell.count;
+				}
+			}
+		}
+
+		for (std::size_t chunk = 0; chunk < num_chunks; ++chunk) {
+			_free_particles.insert(_free_particles.end(), chunk_removed[chunk].begin(), chunk_removed[chunk].end());
+			for (std::size_t raw : chunk_capped[chunk]) {
+				_space_hash.at_active(grid().index_from_raw(raw)).count = max_count;
+			}
+			for (const _particle_seed &seed : chunk_seeds[chunk]) {
+				_space_hash.at_active(grid().index_from_raw(seed.raw_cell)).count = min_count;
+				_particle_seeds.emplace_back(seed);
+			}
+		}
+		std::sort(_free_particles.begin(), _free_particles.end());
+	}
+
+	template <typename T> void basic_simulation<T>::_update_sources() {
 		for (auto &src : sources) {
 			if (!src->active) {
 				continue;
 			}
+			std::size_t target = src->target_density_cubic_root;
+			target = target * target * target;
 			for (vec3s v : src->cells) {
-				seed_cell(v, src->velocity, src->target_density_cubic_root);
+				if (!grid().is_inside(v)) {
+					continue;
+				}
+				std::size_t count = _space_hash(v).count;
+				if (count < target) {
+					_particle_seed &seed = _particle_seeds.emplace_back();
+					seed.velocity = vec3<T>(src->velocity);
+					seed.raw_cell = grid().index_to_raw(v);
+					seed.first_in_cell = count;
+					seed.count = target - count;
+					// later sources seeding the same cell see the new particles
+					_space_hash.activate_tile(_space_hash.get_raw_tile_of(v));
+					_space_hash.at_active(v).count = target;
+				}
 			}
 		}
 	}
+
+	template <typename T> void basic_simulation<T>::_spawn_particles() {
+		// find where the particles of each seed go among all new particles
+		std::vector<std::size_t> seed_begin(_particle_seeds.size() + 1);
+		for (std::size_t i = 0; i < _particle_seeds.size(); ++i) {
+			seed_begin[i + 1] = seed_begin[i] + _particle_seeds[i].count;
+		}
+
+		// new particles first fill the slots of removed particles, then are appended
+		std::size_t
+			num_new = seed_begin.back(),
+			num_reused = std::min(num_new, _free_particles.size()),
+			old_size = _particles.size(),
+			new_size = old_size + (num_new - num_reused);
+		if (new_size > _particles.positions.capacity()) {
+			_particles.reserve(new_size + (num_new - num_reused) * _source_reserve_steps);
+		}
+		_particles.resize(new_size);
+
+		std::uint64_t counter = _get_random_counter(_random_stream::particle_seeding);
+		int num_seeds = static_cast<int>(_particle_seeds.size());
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < num_seeds; ++i) {
+			const _particle_seed &seed = _particle_seeds[i];
+			vec3<T> offset = grid_offset + vec3<T>(grid().index_from_raw(seed.raw_cell)) * cell_size;
+			for (std::size_t j = 0; j < seed.count; ++j) {
+				std::size_t id = seed_begin[i] + j;
+				std::size_t slot = id < num_reused ? _free_particles[id] : old_size + (id - num_reused);
+				// the random numbers are identified by the cell and the index of the particle in the cell
+				std::uint64_t id_in_cell = (static_cast<std::uint64_t>(seed.raw_cell) << 16) ^ (seed.first_in_cell + j);
+				particle p;
+				p.old_position = p.position = offset + philox4x32::to_vec3<T>(
+					philox4x32::generate(counter, id_in_cell, random_key), 0.0, cell_size
+				);
+				p.velocity = seed.velocity;
+				p.raw_cell_index = seed.raw_cell;
+				_particles[slot] = p;
+			}
+		}
+		_particle_seeds.clear();
+
+		_free_particles.erase(
+			_free_particles.begin(), _free_particles.begin() + static_cast<std::ptrdiff_t>(num_reused)
+		);
+		if (!_free_particles.empty()) {
+			_particles.remove_sorted(_free_particles);
+			_free_particles.clear();
+		}
+	}
+
+	template class basic_simulation<float>;
+	template class basic_simulation<double>;
 }
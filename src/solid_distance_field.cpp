@@ -0,0 +1,216 @@
+#include "fluid/solid_distance_field.h"
+
+/// \file
+/// Implementation of the solid signed distance field.
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+namespace fluid {
+	bool solid_distance_field::update(const grid3<grid_cell_type> &types) {
+		vec3s size = types.get_size();
+		bool changed = _solid.get_size() != size + vec3s(2, 2, 2);
+		if (!changed) {
+			int size_z = static_cast<int>(size.z);
+#pragma omp parallel for reduction(||: changed)
+			for (int z = 0; z < size_z; ++z) {
+				for (std::size_t y = 0; y < size.y; ++y) {
+					for (std::size_t x = 0; x < size.x; ++x) {
+						vec3s cell(x, y, static_cast<std::size_t>(z));
+						bool solid = types(cell) == grid_cell_type::solid;
+						if (solid != (_solid(cell + vec3s(1, 1, 1)) != 0)) {
+							changed = true;
+						}
+					}
+				}
+			}
+		}
+		if (!changed) {
+			return false;
+		}
+		_recompute(types);
+		return true;
+	}
+
+	bool solid_distance_field::update(const grid3<grid_cell_type> &types, const std::vector<std::size_t> &cells) {
+		bool changed = _solid.get_size() != types.get_size() + vec3s(2, 2, 2);
+		if (!changed) {
+			int num_cells = static_cast<int>(cells.size());
+#pragma omp parallel for reduction(||: changed)
+			for (int i = 0; i < num_cells; ++i) {
+				std::size_t raw = cells[static_cast<std::size_t>(i)];
+				bool solid = types[raw] == grid_cell_type::solid;
+				if (solid != (_solid(types.index_from_raw(raw) + vec3s(1, 1, 1)) != 0)) {
+					changed = true;
+				}
+			}
+		}
+		if (!changed) {
+			return false;
+		}
+		_recompute(types);
+		return true;
+	}
+
+	void solid_distance_field::_recompute(const grid3<grid_cell_type> &types) {
+		vec3s size = types.get_size(), padded_size = size + vec3s(2, 2, 2);
+		_solid = grid3<unsigned char>(padded_size, 1);
+		for (std::size_t z = 0; z < size.z; ++z) {
+			for (std::size_t y = 0; y < size.y; ++y) {
+				for (std::size_t x = 0; x < size.x; ++x) {
+					bool solid = types(x, y, z) == grid_cell_type::solid;
+					_solid(x + 1, y + 1, z + 1) = solid ? 1 : 0;
+				}
+			}
+		}
+
+		// distances between cell centers are offset by half a cell to obtain distances to the faces of solid cells
+		grid3<double> to_solid, to_fluid;
+		compute_squared_distances(_solid, 1, to_solid);
+		compute_squared_distances(_solid, 0, to_fluid);
+		_distances = grid3<double>(padded_size);
+		int num_cells = static_cast<int>(grid3<double>::get_array_size(padded_size));
+#pragma omp parallel for
+		for (int i = 0; i < num_cells; ++i) {
+			auto id = static_cast<std::size_t>(i);
+			_distances[id] = _solid[id] != 0 ? 0.5 - std::sqrt(to_fluid[id]) : std::sqrt(to_solid[id]) - 0.5;
+		}
+	}
+
+	std::pair<double, vec3d> solid_distance_field::sample(vec3d grid_pos) const {
+		vec3s size = _distances.get_size();
+		// position relative to the center of the first padding cell
+		vec3d pos = grid_pos + vec3d(0.5, 0.5, 0.5);
+		vec3s base;
+		vec3d t;
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			double max_base = static_cast<double>(size[dim] - 2);
+			double b = std::clamp(std::floor(pos[dim]), 0.0, max_base);
+			base[dim] = static_cast<std::size_t>(b);
+			t[dim] = std::clamp(pos[dim] - b, 0.0, 1.0);
+		}
+
+		double v[2][2][2];
+		for (std::size_t dz = 0; dz < 2; ++dz) {
+			for (std::size_t dy = 0; dy < 2; ++dy) {
+				for (std::size_t dx = 0; dx < 2; ++dx) {
+					v[dz][dy][dx] = _distances(base + vec3s(dx, dy, dz));
+				}
+			}
+		}
+		// interpolate along x, then y, then z, keeping track of the derivatives
+		double vx[2][2], y_diff[2], x_diff[2][2];
+		for (std::size_t dz = 0; dz < 2; ++dz) {
+			for (std::size_t dy = 0; dy < 2; ++dy) {
+				vx[dz][dy] = v[dz][dy][0] + t.x * (v[dz][dy][1] - v[dz][dy][0]);
+				x_diff[dz][dy] = v[dz][dy][1] - v[dz][dy][0];
+			}
+			y_diff[dz] = vx[dz][1] - vx[dz][0];
+		}
+		double
+			vxy0 = vx[0][0] + t.y * y_diff[0],
+			vxy1 = vx[1][0] + t.y * y_diff[1];
+		double dist = vxy0 + t.z * (vxy1 - vxy0);
+		auto lerp_yz = [&t](double v00, double v01, double v10, double v11) {
+			double a = v00 + t.y * (v01 - v00), b = v10 + t.y * (v11 - v10);
+			return a + t.z * (b - a);
+		};
+		vec3d grad(
+			lerp_yz(x_diff[0][0], x_diff[0][1], x_diff[1][0], x_diff[1][1]),
+			y_diff[0] + t.z * (y_diff[1] - y_diff[0]),
+			vxy1 - vxy0
+		);
+		return { dist, grad };
+	}
+
+	/// One-dimensional squared Euclidean distance transform from "Distance Transforms of Sampled Functions" by
+	/// Felzenszwalb and Huttenlocher. The function is sampled with the given stride, and the result is written
+	/// back in place.
+	///
+	/// \param f The sampled function. Cells without features should have a large value.
+	/// \param n The number of samples.
+	/// \param stride The stride between consecutive samples.
+	/// \param values Scratch space of at least \p n elements.
+	/// \param parabolas Scratch space of at least \p n elements.
+	/// \param bounds Scratch space of at least <tt>n + 1</tt> elements.
+	void _distance_transform_1d(
+		double *f, std::size_t n, std::size_t stride,
+		double *values, std::size_t *parabolas, double *bounds
+	) {
+		for (std::size_t i = 0; i < n; ++i) {
+			values[i] = f[i * stride];
+		}
+		auto intersect = [values](std::size_t q, std::size_t p) {
+			auto dq = static_cast<double>(q), dp = static_cast<double>(p);
+			return ((values[q] + dq * dq) - (values[p] + dp * dp)) / (2.0 * (dq - dp));
+		};
+		std::size_t k = 0;
+		parabolas[0] = 0;
+		bounds[0] = -std::numeric_limits<double>::infinity();
+		bounds[1] = std::numeric_limits<double>::infinity();
+		for (std::size_t q = 1; q < n; ++q) {
+			double s = intersect(q, parabolas[k]);
+			while (s <= bounds[k]) { // bounds[0] is negative infinity, so this stops at k = 0
+				--k;
+				s = intersect(q, parabolas[k]);
+			}
+			++k;
+			parabolas[k] = q;
+			bounds[k] = s;
+			bounds[k + 1] = std::numeric_limits<double>::infinity();
+		}
+		k = 0;
+		for (std::size_t q = 0; q < n; ++q) {
+			auto dq = static_cast<double>(q);
+			while (bounds[k + 1] < dq) {
+				++k;
+			}
+			auto diff = dq - static_cast<double>(parabolas[k]);
+			f[q * stride] = diff * diff + values[parabolas[k]];
+		}
+	}
+
+	void solid_distance_field::compute_squared_distances(
+		const grid3<unsigned char> &labels, unsigned char target, grid3<double> &result
+	) {
+		// larger than any squared distance, but small enough that differences are still meaningful
+		constexpr double no_feature = 1e12;
+
+		vec3s size = labels.get_size();
+		if (result.get_size() != size) {
+			result = grid3<double>(size);
+		}
+		std::size_t num_cells = grid3<double>::get_array_size(size);
+		for (std::size_t i = 0; i < num_cells; ++i) {
+			result[i] = labels[i] == target ? 0.0 : no_feature;
+		}
+		if (num_cells == 0) {
+			return;
+		}
+
+		std::size_t max_size = std::max({ size.x, size.y, size.z });
+		for (std::size_t dim = 0; dim < 3; ++dim) {
+			std::size_t
+				stride = dim == 0 ? 1 : (dim == 1 ? size.x : size.x * size.y),
+				other1 = (dim + 1) % 3,
+				other2 = (dim + 2) % 3,
+				num_lines = size[other1] * size[other2];
+			int inum_lines = static_cast<int>(num_lines);
+#pragma omp parallel
+			{
+				std::vector<double> values(max_size), bounds(max_size + 1);
+				std::vector<std::size_t> parabolas(max_size);
+#pragma omp for
+				for (int line = 0; line < inum_lines; ++line) {
+					vec3s start;
+					start[other1] = static_cast<std::size_t>(line) % size[other1];
+					start[other2] = static_cast<std::size_t>(line) / size[other1];
+					_distance_transform_1d(
+						&result(start), size[dim], stride, values.data(), parabolas.data(), bounds.data()
+					);
+				}
+			}
+		}
+	}
+}
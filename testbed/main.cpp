@@ -39,7 +39,7 @@ vec3d sim_grid_offset;
 vec3s sim_grid_size(50, 50, 50);
 double sim_cell_size = 1.0;
 std::mutex sim_particles_lock;
-std::vector<fluid::simulation::particle> sim_particles;
+fluid::particle_storage sim_particles;
 fluid::grid3<std::size_t> sim_grid_occupation;
 fluid::grid3<vec3d> sim_grid_velocities;
 std::atomic<std::size_t> sim_config = 0;
@@ -49,30 +49,30 @@ fluid::semaphore sim_mesher_sema;
 
 void update_simulation(const fluid::simulation &sim) {
 	// collect particles
-	std::vector<fluid::simulation::particle> new_particles(sim.particles().begin(), sim.particles().end());
+	fluid::particle_storage new_particles = sim.particles();
 
 	double energy = 0.0;
-	for (fluid::simulation::particle &p : new_particles) {
-		energy += 0.5 * p.velocity.squared_length();
-		energy -= fluid::vec_ops::dot(sim.gravity, p.position);
+	for (std::size_t i = 0; i < new_particles.size(); ++i) {
+		energy += 0.5 * new_particles.velocities[i].squared_length();
+		energy -= fluid::vec_ops::dot(sim.gravity, new_particles.positions[i]);
 	}
 	std::cout << "    total energy: " << energy << "\n";
 
 	// collect occupation
-	fluid::grid3<std::size_t> grid(sim.grid().grid().get_size(), 0);
-	for (const auto &particle : sim.particles()) {
-		vec3s pos(fluid::vec3i((particle.position - sim.grid_offset) / sim.cell_size));
+	fluid::grid3<std::size_t> grid(sim.grid().get_size(), 0);
+	for (vec3d position : sim.particles().positions) {
+		vec3s pos(fluid::vec3i((position - sim.grid_offset) / sim.cell_size));
 		if (pos.x < grid.get_size().x && pos.y < grid.get_size().y && pos.z < grid.get_size().z) {
 			++grid(pos);
 		}
 	}
 
 	// collect velocities
-	fluid::grid3<vec3d> grid_vels(sim.grid().grid().get_size());
+	fluid::grid3<vec3d> grid_vels(sim.grid().get_size());
 	for (std::size_t z = 0; z < grid_vels.get_size().z; ++z) {
 		for (std::size_t y = 0; y < grid_vels.get_size().y; ++y) {
 			for (std::size_t x = 0; x < grid_vels.get_size().x; ++x) {
-				grid_vels(x, y, z) = sim.grid().grid()(x, y, z).velocities_posface;
+				grid_vels(x, y, z) = sim.grid().get_velocities_posface(vec3s(x, y, z));
 			}
 		}
 	}
@@ -116,8 +116,8 @@ void simulation_thread() {
 	};
 	sim.post_grid_to_particle_transfer_callback = [&sim](double) {
 		double maxv = 0.0;
-		for (const fluid::simulation::particle &p : sim.particles()) {
-			maxv = std::max(maxv, p.velocity.squared_length());
+		for (vec3d v : sim.particles().velocities) {
+			maxv = std::max(maxv, v.squared_length());
 		}
 		std::cout << "    max particle velocity = " << std::sqrt(maxv) << "\n";
 	};
@@ -126,11 +126,7 @@ void simulation_thread() {
 		if (sim_reset) {
 			sim.particles().clear();
 			// reset solid cells
-			sim.grid().grid().for_each(
-				[](vec3s, fluid::mac_grid::cell &cell) {
-					cell.cell_type = fluid::mac_grid::cell::type::air;
-				}
-			);
+			sim.grid().cell_types().fill(fluid::mac_grid::cell::type::air);
 			// reset fluid sources
 			sim.sources.clear();
 
@@ -164,12 +160,12 @@ void simulation_thread() {
 					sim.sources.emplace_back(std::move(source));
 
 					// spherical obstacle
-					sim.grid().grid().for_each_in_range_unchecked(
-						[](vec3s cell, fluid::mac_grid::cell &c) {
+					sim.grid().cell_types().for_each_in_range_unchecked(
+						[](vec3s cell, fluid::mac_grid::cell::type &type) {
 							vec3d diff = vec3d(cell) + 0.5 * vec3d(sim_cell_size, sim_cell_size, sim_cell_size);
 							diff -= vec3d(25.0, 25.0, 25.0);
 							if (diff.squared_length() < 100.0) {
-								c.cell_type = fluid::mac_grid::cell::type::solid;
+								type = fluid::mac_grid::cell::type::solid;
 							}
 						},
 						vec3s(15, 15, 15), vec3s(35, 35, 35)
@@ -209,9 +205,7 @@ void mesher_thread() {
 			if (sim_mesh_valid) {
 				continue;
 			}
-			for (const fluid::simulation::particle &p : sim_particles) {
-				particles.emplace_back(p.position);
-			}
+			particles = sim_particles.positions;
 			sim_mesh_valid = true;
 		}
 
@@ -337,9 +331,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 				std::vector<vec3d> points;
 				{
 					std::lock_guard<std::mutex> guard(sim_particles_lock);
-					for (const fluid::simulation::particle &p : sim_particles) {
-						points.emplace_back(p.position);
-					}
+					points = sim_particles.positions;
 				}
 				std::ofstream fout("points.txt");
 				fluid::point_cloud::save_to_naive(fout, points.begin(), points.end());
@@ -692,12 +684,12 @@ int main() {
 				std::lock_guard<std::mutex> guard(sim_particles_lock);
 
 				double max_vel = 0.0;
-				for (fluid::simulation::particle &p : sim_particles) {
-					max_vel = std::max(max_vel, p.velocity.squared_length());
+				for (vec3d v : sim_particles.velocities) {
+					max_vel = std::max(max_vel, v.squared_length());
 				}
 				max_vel = std::sqrt(max_vel);
 
-				for (fluid::simulation::particle &p : sim_particles) {
+				for (auto p : sim_particles) {
 					vec3d pos = p.position;
 					switch (particle_vis) {
 					case particle_visualize_mode::none:
@@ -737,7 +729,7 @@ int main() {
 			glBegin(GL_LINES);
 			{
 				std::lock_guard<std::mutex> guard(sim_particles_lock);
-				for (fluid::simulation::particle &p : sim_particles) {
+				for (auto p : sim_particles) {
 					double mul = 0.01;
 					vec3d
 						pos = p.position,